@@ -0,0 +1,26 @@
+#ifndef NET_CHECKSUM_H
+#define NET_CHECKSUM_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Internet校验和(RFC 1071): 按主机字节序累加16位字, 结果可直接写入包头
+// 部分和是未取反的反码和, 多段数据可以依次累加, 除最后一段外各段长度应为偶数
+
+// 按编译目标使用AVX2/SSE2/NEON向量累加, 定义为0时只使用标量实现
+#ifndef NET_CHECKSUM_SIMD
+#define NET_CHECKSUM_SIMD       1
+#endif
+
+// 把data的反码和累加到sum上, 返回值不超过16位, 可以继续与其他部分和相加
+uint32_t net_checksum_add(uint32_t sum, const void *data, size_t len);
+
+// 折叠为16位并取反, 得到写入包头的校验和; 对包含校验和字段的数据结果为0表示正确
+static inline uint16_t net_checksum_finish(uint32_t sum) {
+    while (sum >> 16) {
+        sum = (sum & 0xFFFF) + (sum >> 16);
+    }
+    return (uint16_t)~sum;
+}
+
+#endif // NET_CHECKSUM_H
@@ -0,0 +1,97 @@
+#ifndef NET_LOG_H
+#define NET_LOG_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "net_device.h"
+
+// 日志级别
+#define NET_LOG_LEVEL_DEBUG     0
+#define NET_LOG_LEVEL_INFO      1
+#define NET_LOG_LEVEL_WARN      2
+#define NET_LOG_LEVEL_ERROR     3
+#define NET_LOG_LEVEL_NONE      4
+
+// 编译期最低日志级别, 低于此级别的日志调用(包括参数求值)编译为空
+// 调试数据通路时定义为NET_LOG_LEVEL_DEBUG
+#ifndef NET_LOG_MIN_LEVEL
+#define NET_LOG_MIN_LEVEL       NET_LOG_LEVEL_INFO
+#endif
+
+#if NET_LOG_MIN_LEVEL > NET_LOG_LEVEL_DEBUG
+#undef NET_LOGD
+#define NET_LOGD(...)           ((void)0)
+#undef NET_HEX_DUMP
+#define NET_HEX_DUMP(data, len) ((void)0)
+#endif
+
+#if NET_LOG_MIN_LEVEL > NET_LOG_LEVEL_INFO
+#undef NET_LOGI
+#define NET_LOGI(...)           ((void)0)
+#endif
+
+#if NET_LOG_MIN_LEVEL > NET_LOG_LEVEL_WARN
+#undef NET_LOGW
+#define NET_LOGW(...)           ((void)0)
+#endif
+
+#if NET_LOG_MIN_LEVEL > NET_LOG_LEVEL_ERROR
+#undef NET_LOGE
+#define NET_LOGE(...)           ((void)0)
+#endif
+
+// 限速日志: 每个调用点一个令牌桶, 每NET_LOG_RATELIMIT_INTERVAL_MS补充
+// NET_LOG_RATELIMIT_BURST条, 恢复输出时先报告期间被抑制的条数
+#ifndef NET_LOG_RATELIMIT_BURST
+#define NET_LOG_RATELIMIT_BURST         5
+#endif
+
+#ifndef NET_LOG_RATELIMIT_INTERVAL_MS
+#define NET_LOG_RATELIMIT_INTERVAL_MS   1000
+#endif
+
+typedef struct {
+    uint32_t last_ms;       // 上次补充令牌的时间
+    uint32_t tokens;
+    uint32_t suppressed;    // 自上次输出以来被抑制的条数
+    bool started;
+} net_ratelimit_t;
+
+// 取得一个令牌返回true, 并通过suppressed返回之前被抑制的条数
+// 只用于日志, 多线程下计数不精确可以接受
+static inline bool net_ratelimit(net_ratelimit_t *rl, uint32_t *suppressed) {
+    uint32_t now = net_get_time_ms();
+
+    if (!rl->started || now - rl->last_ms >= NET_LOG_RATELIMIT_INTERVAL_MS) {
+        rl->started = true;
+        rl->last_ms = now;
+        rl->tokens = NET_LOG_RATELIMIT_BURST;
+    }
+
+    if (rl->tokens == 0) {
+        rl->suppressed++;
+        return false;
+    }
+
+    rl->tokens--;
+    *suppressed = rl->suppressed;
+    rl->suppressed = 0;
+    return true;
+}
+
+#if NET_LOG_MIN_LEVEL > NET_LOG_LEVEL_WARN
+#define NET_LOGW_RATELIMIT(...) ((void)0)
+#else
+#define NET_LOGW_RATELIMIT(fmt, ...) do { \
+    static net_ratelimit_t _net_rl; \
+    uint32_t _net_suppressed; \
+    if (net_ratelimit(&_net_rl, &_net_suppressed)) { \
+        if (_net_suppressed) { \
+            NET_LOGW("%u similar messages suppressed", (unsigned)_net_suppressed); \
+        } \
+        NET_LOGW(fmt, ##__VA_ARGS__); \
+    } \
+} while (0)
+#endif
+
+#endif // NET_LOG_H
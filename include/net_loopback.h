@@ -0,0 +1,75 @@
+#ifndef NET_LOOPBACK_H
+#define NET_LOOPBACK_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "net_wrapper.h"
+
+// 内存回环链路: 两个端点通过一对单生产者/单消费者环形队列相连,
+// 用于在一个进程内运行客户端和服务器, 得到可重复的测试和性能数据
+// 每个端点可由多个线程发送(发送时加锁), 只能由一个线程接收
+
+// 每个方向默认的队列深度(2的幂)
+#ifndef NET_LOOP_RING_SIZE
+#define NET_LOOP_RING_SIZE      256
+#endif
+
+// 被重排的帧最多比原定送达时间晚多久: 之后一直没有下一帧时, 由接收方取出
+#ifndef NET_LOOP_REORDER_HOLD_MS
+#define NET_LOOP_REORDER_HOLD_MS 10
+#endif
+
+// 链路参数, 全部为0表示无损、无时延、不限速
+typedef struct {
+    uint32_t latency_ms;        // 单向时延
+    uint32_t bandwidth_kbps;    // 带宽(千比特/秒), 0表示不限速
+    uint32_t loss_ppm;          // 丢包率(百万分之一)
+    uint32_t reorder_ppm;       // 重排率(百万分之一), 被选中的帧延后到下一帧之后送达(最多延后NET_LOOP_REORDER_HOLD_MS)
+    uint32_t seed;              // 丢包/重排随机数种子, 相同种子得到相同的丢包序列
+    uint32_t ring_size;         // 队列深度(2的幂), 0使用NET_LOOP_RING_SIZE
+} net_loop_config_t;
+
+// 端点统计
+typedef struct {
+    uint32_t tx_frames;         // 提交发送的帧数
+    uint32_t rx_frames;         // 接收的帧数
+    uint32_t lost;              // 按丢包率丢弃
+    uint32_t reordered;         // 被重排
+    uint32_t overflow;          // 对端队列满丢弃
+} net_loop_stats_t;
+
+typedef struct net_loop_endpoint net_loop_endpoint_t;
+
+// 创建一对相连的端点, a发送的帧由b接收, 反之亦然; cfg为NULL使用默认参数
+int net_loop_pair_create(const net_loop_config_t *cfg,
+                         net_loop_endpoint_t **a, net_loop_endpoint_t **b);
+
+// 创建自环端点: 发送的帧由自己接收, 用于同一协议栈内的客户端和服务器
+net_loop_endpoint_t *net_loop_create(const net_loop_config_t *cfg);
+
+// 销毁端点(成对创建的端点需分别销毁, 接收时会访问对端, 两端都停止收发后再销毁)
+void net_loop_destroy(net_loop_endpoint_t *ep);
+
+// 修改链路参数(队列深度除外)并按新的种子重新开始丢包/重排序列, 队列中的帧不受影响
+// 用于在接收任务运行期间切换测试条件, 不必替换协议栈的链路
+void net_loop_set_config(net_loop_endpoint_t *ep, const net_loop_config_t *cfg);
+
+// 发送/接收一帧, 与net_link_ops_t的send/receive一致
+int net_loop_send(void *ep, const uint8_t *frame, size_t len);
+int net_loop_receive(void *ep, uint8_t *buf, size_t size);
+
+// 填写以该端点为后端的链路接口, 用于net_stack_init/net_stack_set_link
+void net_loop_link_ops(net_loop_endpoint_t *ep, net_link_ops_t *ops);
+
+void net_loop_get_stats(const net_loop_endpoint_t *ep, net_loop_stats_t *stats);
+
+// 接收分流函数: 返回帧应放入的队列序号, 负值表示复制到所有队列(例如ARP)
+typedef int (*net_loop_steer_fn)(void *arg, const uint8_t *frame, size_t len);
+
+// 把端点的接收拆分为count个队列, 模拟按流规则分流的多队列网卡; ops[i]为第i个队列的链路接口,
+// 各由一个协议栈实例(线程)使用; 发送都经ep发出, 任一队列接收时从ep取出已到达的帧并按steer分发
+// 拆分后不能再直接从ep接收, 队列随ep一起销毁
+int net_loop_split(net_loop_endpoint_t *ep, int count, net_loop_steer_fn steer, void *arg,
+                   net_link_ops_t *ops);
+
+#endif // NET_LOOPBACK_H
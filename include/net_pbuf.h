@@ -0,0 +1,92 @@
+#ifndef NET_PBUF_H
+#define NET_PBUF_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "net_device.h"
+#include "net_log.h"
+
+// 以太网头(14) + IP头(20) + UDP头(8), 发送时各层在此空间内向前填写包头
+#define NET_UDP_HEADROOM        (14 + 20 + 8)
+
+// 缓冲池中每个缓冲的大小(一个完整的帧)
+#ifndef NET_PBUF_BUF_SIZE
+#define NET_PBUF_BUF_SIZE       NET_MTU_MAX
+#endif
+
+// 缓冲池中的缓冲个数
+#ifndef NET_PBUF_POOL_SIZE
+#define NET_PBUF_POOL_SIZE      64
+#endif
+
+#define NET_PBUF_FLAG_POOL      0x01    // 来自缓冲池, 需要归还
+#define NET_PBUF_FLAG_CUSTOM    0x02    // 由所有者提供的缓冲, 释放时调用custom_free
+
+// 数据包缓冲: payload之前保留包头空间, 各层原地添加包头, 数据只写一次
+typedef struct net_pbuf {
+    struct net_pbuf *next;  // 空闲链表
+    uint8_t *buf;           // 缓冲起始地址
+    size_t size;            // 缓冲容量
+    uint8_t *payload;       // 当前数据起始地址
+    size_t len;             // 当前数据长度
+    uint8_t flags;
+    uint32_t src_ip;        // 接收: 源IP
+    uint32_t dst_ip;        // 接收: 目的IP(本机地址或多播组)
+    uint16_t src_port;      // 接收: 源端口
+    uint16_t dst_port;      // 接收: 目的端口
+    void (*custom_free)(struct net_pbuf *p);
+    struct net_pbuf_pool *pool; // 所属缓冲池
+} net_pbuf_t;
+
+typedef struct {
+    net_pbuf_t pbuf;
+    uint8_t mem[NET_PBUF_BUF_SIZE];
+} net_pbuf_slot_t;
+
+// 缓冲池, 每个协议栈实例一个
+typedef struct net_pbuf_pool {
+    net_pbuf_slot_t slots[NET_PBUF_POOL_SIZE];
+    net_pbuf_t *free;
+    bool initialized;
+#if NET_USE_ASYNC_TASK
+    void *mutex;            // 异步接收时缓冲池同时被接收任务和发送方使用
+#endif
+} net_pbuf_pool_t;
+
+// 初始化缓冲池(由net_stack_init调用)
+int net_pbuf_pool_init(net_pbuf_pool_t *pool);
+
+// 释放缓冲池的锁(net_stack_init失败时调用), 缓冲不能再被使用
+void net_pbuf_pool_deinit(net_pbuf_pool_t *pool);
+
+// 从缓冲池分配, payload位于NET_UDP_HEADROOM之后, 长度为len
+net_pbuf_t *net_pbuf_alloc(net_pbuf_pool_t *pool, size_t len);
+
+// 归还所属的缓冲池, 自定义缓冲交还所有者(外部缓冲无操作)
+void net_pbuf_free(net_pbuf_t *p);
+
+// 使用外部内存初始化缓冲, 保留headroom字节的包头空间
+void net_pbuf_init(net_pbuf_t *p, uint8_t *buf, size_t size, size_t headroom);
+
+// 在数据前添加len字节的包头, 返回新的数据起始地址, 空间不足返回NULL
+static inline void *net_pbuf_push(net_pbuf_t *p, size_t len) {
+    if ((size_t)(p->payload - p->buf) < len) {
+        return NULL;
+    }
+    p->payload -= len;
+    p->len += len;
+    return p->payload;
+}
+
+// 去掉数据前len字节的包头, 返回新的数据起始地址
+static inline void *net_pbuf_pull(net_pbuf_t *p, size_t len) {
+    if (p->len < len) {
+        return NULL;
+    }
+    p->payload += len;
+    p->len -= len;
+    return p->payload;
+}
+
+#endif // NET_PBUF_H
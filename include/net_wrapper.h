@@ -3,16 +3,124 @@
 
 #include <stdint.h>
 #include <stddef.h>
+#include <stdbool.h>
 #include "net_device.h"
+#include "net_log.h"
+#include "net_pbuf.h"
+#include "net_checksum.h"
 
 // 模拟UDP包头
 typedef struct {
     uint16_t src_port;
     uint16_t dst_port;
     uint16_t length;
-    uint16_t checksum; // 简单实现可以忽略
+    uint16_t checksum; // 伪首部+UDP头+数据的校验和, 0表示未计算
 } udp_header_t;
 
+// 发送时计算UDP校验和, 定义为0时校验和字段填0(IPv4下表示未计算)
+#ifndef NET_UDP_CHECKSUM
+#define NET_UDP_CHECKSUM        1
+#endif
+
+// 接收时校验IP头和UDP校验和, 丢弃校验和错误的包
+#ifndef NET_CHECKSUM_VERIFY
+#define NET_CHECKSUM_VERIFY     1
+#endif
+
+// 端口绑定表: 可绑定的端口数量和每个端口接收队列的深度
+#ifndef NET_SOCKET_MAX
+#define NET_SOCKET_MAX          16
+#endif
+
+#ifndef NET_SOCKET_QUEUE_LEN
+#define NET_SOCKET_QUEUE_LEN    32
+#endif
+
+// 端口哈希表大小(2的幂)
+#ifndef NET_SOCKET_HASH_BITS
+#define NET_SOCKET_HASH_BITS    5
+#endif
+#define NET_SOCKET_HASH_SIZE    (1u << NET_SOCKET_HASH_BITS)
+
+// 发送包头模板缓存的流数量(2的幂)
+#ifndef NET_FLOW_CACHE_SIZE
+#define NET_FLOW_CACHE_SIZE     8
+#endif
+
+// udp_send_batch一次提交的最大包数
+#ifndef NET_TX_BATCH_MAX
+#define NET_TX_BATCH_MAX        16
+#endif
+
+// udp_receive_burst建议的一次接收包数
+#ifndef NET_RX_BATCH_MAX
+#define NET_RX_BATCH_MAX        16
+#endif
+
+// 可同时加入的多播组成员数(组地址+端口+本地端口)
+#ifndef NET_MCAST_MAX
+#define NET_MCAST_MAX           8
+#endif
+
+// 发往多播组的包的TTL, 默认只在本网段内传送
+#ifndef NET_MCAST_TTL
+#define NET_MCAST_TTL           1
+#endif
+
+// 邻居(ARP)表大小(2的幂), 按IP哈希后在NET_ARP_PROBE个相邻表项内查找
+#ifndef NET_ARP_TABLE_BITS
+#define NET_ARP_TABLE_BITS      5
+#endif
+#define NET_ARP_TABLE_SIZE      (1u << NET_ARP_TABLE_BITS)
+
+#ifndef NET_ARP_PROBE
+#define NET_ARP_PROBE           4
+#endif
+
+// 邻居表项的有效期, 过期后重新解析
+#ifndef NET_ARP_MAX_AGE_MS
+#define NET_ARP_MAX_AGE_MS      300000
+#endif
+
+// 未解析时重发ARP请求的间隔
+#ifndef NET_ARP_REQUEST_INTERVAL_MS
+#define NET_ARP_REQUEST_INTERVAL_MS 1000
+#endif
+
+// 分片重组表的表项数, 即可同时重组的数据报个数, 0表示不重组(丢弃分片)
+#ifndef NET_IP_REASS_MAX
+#define NET_IP_REASS_MAX        2
+#endif
+
+// 可重组的IP数据长度上限(不含IP头), 每个表项占用一个此大小的静态缓冲
+#ifndef NET_IP_REASS_SIZE
+#define NET_IP_REASS_SIZE       (65535 - 20)
+#endif
+
+// 数据报的分片在此时间内未到齐则放弃
+#ifndef NET_IP_REASS_TIMEOUT_MS
+#define NET_IP_REASS_TIMEOUT_MS 2000
+#endif
+
+// 大块发送缓冲的分配函数(udp_send/udp_sendv发送超过一帧的数据报时使用)
+#ifndef NET_MALLOC
+#define NET_MALLOC(size)        malloc(size)
+#endif
+
+#ifndef NET_FREE
+#define NET_FREE(ptr)           free(ptr)
+#endif
+
+// 可以发送的最大UDP数据长度(IP数据报上限), 超过一帧的数据报自动分片
+#define NET_UDP_SEND_MAX        (65535 - 20 - 8)
+
+// 可以接收的最大UDP数据长度
+#if NET_IP_REASS_MAX > 0
+#define NET_UDP_PAYLOAD_MAX     (NET_IP_REASS_SIZE - 8)
+#else
+#define NET_UDP_PAYLOAD_MAX     (NET_MTU_MAX - NET_UDP_HEADROOM)
+#endif
+
 // 网络配置
 typedef struct {
     uint32_t ip_addr;      // 本地IP地址
@@ -21,17 +129,233 @@ typedef struct {
     uint8_t mac_addr[6];   // MAC地址
 } net_config_t;
 
-// 初始化网络封装层
+// UDP层统计(每个协议栈实例一份), 计数器使用原子操作更新
+typedef struct {
+    uint64_t tx_bytes;          // 发送的UDP数据字节
+    uint64_t rx_bytes;          // 交付给socket的UDP数据字节
+    uint32_t tx_packets;
+    uint32_t tx_errors;         // 链路发送失败
+    uint32_t rx_frames;         // 从链路取出的帧
+    uint32_t rx_packets;        // 交付给socket的UDP包
+    uint32_t rx_invalid;        // 非IPv4/UDP、目的地址不符或长度错误
+    uint32_t rx_no_socket;      // 目的端口未绑定且没有通配socket
+    uint32_t rx_queue_full;     // socket接收队列满
+    uint32_t rx_no_buffer;      // 缓冲池耗尽
+    uint32_t rx_bad_checksum;   // 校验和错误(同时计入rx_invalid)
+    uint32_t tx_fragments;      // 分片发送的帧数
+    uint32_t rx_fragments;      // 收到的分片
+    uint32_t rx_reassembled;    // 重组完成的数据报
+    uint32_t rx_reass_failed;   // 超时、表满或超过NET_IP_REASS_SIZE而放弃的数据报或分片
+    uint32_t tx_arp;            // 发送的ARP请求和应答
+    uint32_t rx_arp;            // 收到的ARP帧
+} net_udp_stats_t;
+
+// 分散发送的数据段
+typedef struct {
+    const void *base;
+    size_t len;
+} net_iovec_t;
+
+// 链路后端: 默认使用net_device, 可替换为内存回环(net_loopback.h)等实现
+// send返回负值表示失败; receive取出一帧, 没有可用的帧时返回0
+typedef struct {
+    int (*send)(void *ctx, const uint8_t *frame, size_t len);
+    int (*receive)(void *ctx, uint8_t *buf, size_t size);
+    void *ctx;
+} net_link_ops_t;
+
+// udp_receive等待数据期间反复调用的钩子(异步模式下等待间隔为NET_LINK_POLL_MS),
+// 用于在同一线程中驱动其他使用者(例如同一进程内服务器的轮询)
+typedef void (*net_idle_hook_t)(void *arg);
+
+// 端口绑定表项: 每个绑定的端口拥有一个有界接收队列
+typedef struct net_socket {
+    struct net_socket *hash_next;   // 哈希桶链表
+    bool used;
+    uint16_t port;                  // 0表示接收所有未绑定端口的数据
+#if NET_USE_ASYNC_TASK
+    void *sem;                      // 有数据入队时释放
+#endif
+    net_pbuf_t *queue[NET_SOCKET_QUEUE_LEN];
+    uint32_t head;                  // 写入位置(接收任务/轮询方)
+    uint32_t tail;                  // 读取位置(端口所有者)
+    uint32_t drops;                 // 队列满丢弃的包数
+} net_socket_t;
+
+// 多播组成员: 发往group:port的数据交给local_port
+typedef struct {
+    bool used;
+    uint32_t group;
+    uint16_t port;
+    uint16_t local_port;
+} net_mcast_member_t;
+
+// 发送包头模板: 同一个流的以太网/IP/UDP头只有长度、ID和校验和不同
+typedef struct {
+    bool valid;
+    uint32_t dst_ip;
+    uint16_t src_port;
+    uint16_t dst_port;
+    uint32_t ip_sum;                    // 长度和ID为0时IP头的反码和(未取反)
+    uint32_t udp_sum;                   // 伪首部和UDP头中除长度外的反码和(未取反)
+    uint32_t arp_gen;                   // 构建时的邻居表版本
+    bool expires;                       // 目的MAC来自邻居表, 到expire_ms需要重新解析
+    uint32_t expire_ms;
+    uint8_t header[NET_UDP_HEADROOM];
+} net_flow_t;
+
+// 邻居表项
+typedef struct {
+    uint32_t ip;
+    uint8_t mac[6];
+    uint8_t state;
+    uint32_t updated_ms;    // 创建或最近一次收到对方ARP的时间
+    uint32_t request_ms;    // 最近一次发送请求的时间
+} net_arp_entry_t;
+
+#if NET_IP_REASS_MAX > 0
+// 分片重组表项: 数据按分片偏移写入IP头之后, 到齐后作为一个完整的帧继续解析
+typedef struct {
+    net_pbuf_t pbuf;        // 重组完成的数据报, 必须是第一个成员
+    uint8_t state;
+    uint16_t id;
+    uint32_t src_ip;
+    uint32_t dst_ip;
+    uint32_t start_ms;      // 收到第一个分片的时间
+    uint32_t total;         // IP数据总长度, 收到最后一片前为0
+    uint32_t units;         // 已收到的8字节单元数
+    uint8_t map[(NET_IP_REASS_SIZE + 63) / 64];     // 每个8字节单元一位
+    uint8_t buf[14 + 20 + NET_IP_REASS_SIZE];
+} net_ip_reass_t;
+#endif
+
+// 协议栈实例: 一个网络接口(设备或链路后端)及其地址、端口表、邻居表、缓冲池和统计
+// 实例之间不共享状态, 可以每个核或每个网卡队列运行一个, 水平扩展
+// 同步模式下一个实例只能由一个线程使用; 异步模式下每个实例有自己的接收任务
+// 结构体较大(缓冲池和重组缓冲), 应静态分配
+typedef struct net_stack {
+    net_config_t config;
+    bool initialized;
+    uint16_t next_local_port;
+    uint16_t port_min;              // 动态端口范围
+    uint16_t port_max;
+
+    net_device_t net_device;
+    net_link_ops_t link;            // 链路后端, send为NULL时使用net_device
+    net_idle_hook_t idle_hook;
+    void *idle_arg;
+
+#if NET_USE_ASYNC_TASK
+    void *task;
+    void *sem;                      // 唤醒接收任务
+    void *mutex;                    // socket表锁, 只有异步接收时存在并发
+    void *link_mutex;               // 接收任务访问链路期间持有, 替换链路时等待
+    struct net_stack *device_next;  // 使用net_device的实例链表, 设备接收中断时全部唤醒
+    void *rx_event;                 // udp_wait有等待方时, 数据包入队后释放
+    uint32_t rx_waiters;            // udp_wait的等待方数
+#endif
+    uint32_t rx_seq;                // 每有数据包入队递增, udp_wait据此判断是否有新数据
+
+    net_pbuf_pool_t pool;
+
+    net_socket_t sockets[NET_SOCKET_MAX];
+    net_socket_t *socket_hash[NET_SOCKET_HASH_SIZE];
+    net_socket_t *socket_wildcard;
+    net_mcast_member_t mcast_members[NET_MCAST_MAX];
+
+    net_flow_t flow_cache[NET_FLOW_CACHE_SIZE];
+    uint16_t ip_id;
+
+    net_arp_entry_t arp_table[NET_ARP_TABLE_SIZE];
+    uint32_t arp_gen;               // 表项的MAC变化时递增, 使包头模板失效
+
+#if NET_IP_REASS_MAX > 0
+    net_ip_reass_t ip_reass[NET_IP_REASS_MAX];
+#endif
+
+    net_udp_stats_t stats;          // 计数器使用原子操作更新
+    uint8_t discard[NET_MTU_MAX];   // 缓冲耗尽时丢弃帧用
+} net_stack_t;
+
+// 以下接口的stack参数为NULL时使用默认协议栈(net_wrapper_init初始化的实例)
+
+// 初始化协议栈实例, link为NULL时使用net_device; 每个实例只能初始化一次
+int net_stack_init(net_stack_t *stack, const net_config_t *config, const net_link_ops_t *link);
+
+// 初始化默认协议栈, 使用net_device
 int net_wrapper_init(net_config_t *config);
 
+// 替换链路后端(例如在测试中切换回环链路), NULL恢复为net_device
+// 返回后接收任务不再访问旧的链路, 可以销毁; 调用方需保证替换期间没有其他线程发送
+void net_stack_set_link(net_stack_t *stack, const net_link_ops_t *link);
+
+// 设置等待钩子, NULL表示不使用
+void net_stack_set_idle_hook(net_stack_t *stack, net_idle_hook_t hook, void *arg);
+
+// 从协议栈的缓冲池分配发送缓冲, 用于udp_send_pbuf/udp_send_batch
+net_pbuf_t *udp_pbuf_alloc(net_stack_t *stack, size_t len);
+
+// 分配一个本地动态端口(默认49152~65535), 各实例独立分配
+uint16_t udp_alloc_port(net_stack_t *stack);
+
+// 限制实例的动态端口范围, 多个实例共用一个地址时各自使用不相交的范围,
+// 以便链路按目的端口把帧分流到所属实例; min为0时恢复默认范围
+void net_stack_set_port_range(net_stack_t *stack, uint16_t min, uint16_t max);
+
+// 分流用: 返回以太网帧的UDP目的端口; IPv4分片(后续分片没有UDP头)返回0, 其他帧(ARP等)返回-1
+int net_frame_udp_port(const uint8_t *frame, size_t len);
+
 // 发送UDP数据包
-int udp_send(uint32_t dest_ip, uint16_t src_port, uint16_t dest_port, 
+int udp_send(net_stack_t *stack, uint32_t dest_ip, uint16_t src_port, uint16_t dest_port,
              const uint8_t *data, size_t length);
 
-// 接收UDP数据包(非阻塞)
-int udp_receive(uint32_t *src_ip, uint16_t *src_port, uint16_t *dst_port,
+// 发送由多个数据段组成的UDP数据包, 各段直接拷贝到帧中UDP头之后
+// 一帧容纳不下时拷贝到临时分配的缓冲中按IP分片发送, 最长NET_UDP_SEND_MAX
+int udp_sendv(net_stack_t *stack, uint32_t dest_ip, uint16_t src_port, uint16_t dest_port,
+              const net_iovec_t *iov, int iovcnt);
+
+// 发送pbuf中的UDP数据, 包头在payload前的保留空间内原地填写
+// 发送后payload恢复为原来的UDP数据, pbuf仍归调用方所有(可用于重传)
+// 超过一帧的数据报按IP分片发送, 后续分片的包头临时写在前一分片数据的末尾, 发送后恢复
+int udp_send_pbuf(net_stack_t *stack, uint32_t dest_ip, uint16_t src_port, uint16_t dest_port,
+                  net_pbuf_t *p);
+
+// 向同一目的地址/端口连续发送count个pbuf, 包头由缓存的流模板生成,
+// 每个包只修改长度、IP ID和校验和; 返回成功发送的包数, 未发送任何包时返回-1
+int udp_send_batch(net_stack_t *stack, uint32_t dest_ip, uint16_t src_port, uint16_t dest_port,
+                   net_pbuf_t *const *pkts, int count);
+
+// 绑定/解绑本地端口, 收到的数据按目的端口放入所有者的接收队列
+// 端口已被绑定时udp_bind返回-1, 动态端口应换一个重试
+// 未绑定的端口在首次udp_receive时自动绑定, 端口0接收所有未绑定端口的数据
+int udp_bind(net_stack_t *stack, uint16_t port);
+void udp_unbind(net_stack_t *stack, uint16_t port);
+
+// 接收UDP数据包(非阻塞)，*dst_port为0时接收任意目的端口并回填实际端口
+int udp_receive(net_stack_t *stack, uint32_t *src_ip, uint16_t *src_port, uint16_t *dst_port,
                 uint8_t *buffer, size_t buf_size, int timeout_ms);
 
+// 加入多播组: 发往group:port的数据放入local_port的接收队列(pbuf的dst_port为port)
+// 同一组和端口可由多个本地端口加入, 每个成员各收到一份
+int udp_join_group(net_stack_t *stack, uint32_t group, uint16_t port, uint16_t local_port);
+void udp_leave_group(net_stack_t *stack, uint32_t group, uint16_t port, uint16_t local_port);
+
+// 读取/清零UDP层统计
+void udp_get_stats(net_stack_t *stack, net_udp_stats_t *stats);
+void udp_reset_stats(net_stack_t *stack);
+
+// 批量接收: 最多等待timeout_ms直到有数据, 然后取出已就绪的最多max个数据包
+// 返回的pbuf位于缓冲池中, payload/len为UDP数据, src_ip/src_port/dst_port为地址信息,
+// 调用方直接处理后必须用udp_release_burst归还; 返回包数, 超时返回-1
+int udp_receive_burst(net_stack_t *stack, uint16_t port, net_pbuf_t **pkts, int max, int timeout_ms);
+void udp_release_burst(net_pbuf_t **pkts, int count);
+
+// 等待实例上任意端口有新数据, 用于一个线程同时服务多个端口(例如客户端事件循环):
+// 先用udp_rx_seq取得序号, 再以超时0逐个端口接收, 都没有数据时调用udp_wait,
+// 取得序号之后入队的数据使其立即返回, 不会错过唤醒; 有新数据返回0, 超时返回-1
+uint32_t udp_rx_seq(net_stack_t *stack);
+int udp_wait(net_stack_t *stack, uint32_t seq, int timeout_ms);
+
 
 
 
@@ -83,4 +407,9 @@ static inline uint32_t ntohl(uint32_t netlong) {
     return htonl(netlong); // 两者操作相同
 }
 
+// 是否为IPv4多播地址(224.0.0.0/4), 地址按网络字节序存放
+static inline bool net_ip_is_multicast(uint32_t ip) {
+    return (((const uint8_t *)&ip)[0] & 0xF0) == 0xE0;
+}
+
 #endif
\ No newline at end of file
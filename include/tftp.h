@@ -4,6 +4,16 @@
 #include <stdint.h>
 #include <stddef.h>
 #include <stdbool.h>
+#include <stdlib.h>
+
+// 协议栈实例(net_wrapper.h)
+typedef struct net_stack net_stack_t;
+
+// 内存分配(可按平台替换)
+#ifndef TFTP_MALLOC
+#define TFTP_MALLOC(size)       malloc(size)
+#define TFTP_FREE(ptr)          free(ptr)
+#endif
 
 // TFTP协议常量
 #define TFTP_DEFAULT_PORT        69
@@ -12,7 +22,23 @@
 #define TFTP_DEFAULT_RETRIES     5
 #define TFTP_MAX_BLOCK_SIZE      65464
 #define TFTP_MIN_BLOCK_SIZE      8
+#define TFTP_DEFAULT_WINDOW_SIZE 1
+#define TFTP_MAX_WINDOW_SIZE     64      // RFC 7440允许65535, 这里限制缓存占用
 #define TFTP_PACKET_MAX_SIZE     (4 + TFTP_MAX_BLOCK_SIZE)
+// 本地可接收的最大块, 受IP分片重组的数据报长度限制
+#define TFTP_BLOCK_SIZE_LIMIT    (NET_UDP_PAYLOAD_MAX - 4 < TFTP_MAX_BLOCK_SIZE ? \
+                                  NET_UDP_PAYLOAD_MAX - 4 : TFTP_MAX_BLOCK_SIZE)
+#define TFTP_FILENAME_MAX        256
+#define TFTP_EPHEMERAL_PORT_MIN  49152   // 动态端口范围
+#define TFTP_EPHEMERAL_PORT_MAX  65535
+
+// 自适应重传超时(RFC 6298), 协商的timeout为上限
+#ifndef TFTP_RTO_INIT_MS
+#define TFTP_RTO_INIT_MS         1000    // 尚无RTT样本时的初始值
+#endif
+#ifndef TFTP_RTO_MIN_MS
+#define TFTP_RTO_MIN_MS          10
+#endif
 
 // TFTP操作码
 typedef enum {
@@ -40,33 +66,163 @@ typedef enum {
 // TFTP选项
 typedef struct {
     uint16_t block_size;      // 块大小
+    uint16_t window_size;     // 窗口大小(RFC 7440), 0或1为停等模式
     uint32_t timeout_ms;      // 超时时间(毫秒)
-    uint16_t transfer_size;   // 传输大小(字节)
+    uint64_t transfer_size;   // 传输大小(字节, RFC 2349 tsize)
+    bool has_tsize;           // 选项中包含tsize, RRQ中值为0表示请求服务器报告文件大小
+    bool multicast;           // RFC 2090多播选项, 请求中为空值, OACK中给出以下参数
+    bool mcast_master;        // OACK: 本客户端为主客户端, 负责确认
+    uint16_t mcast_port;      // OACK: 多播组端口
+    uint32_t mcast_ip;        // OACK: 多播组地址(网络字节序)
+    uint8_t rollover;         // 块号超过65535后回绕到的值(0或1), 以"rollover"选项协商
     bool wait_oack;           // 是否等待OACK
     uint8_t retries;         // 重试次数
 } tftp_options_t;
 
+// 块RTT直方图: 桶0为<1ms, 桶i(i>=1)为[2^(i-1), 2^i)ms, 最后一个桶包含更大的值
+#define TFTP_RTT_HIST_BUCKETS    16
+
+// 传输统计, 会话内计数只由会话所有者更新, 全局计数使用原子操作更新
+typedef struct {
+    uint64_t tx_bytes;        // 发送的DATA数据字节(含重传)
+    uint64_t rx_bytes;        // 按序收到的DATA数据字节
+    uint32_t tx_blocks;       // 发送的DATA块(含重传)
+    uint32_t rx_blocks;       // 按序收到的DATA块
+    uint32_t retransmits;     // 重传的DATA块
+    uint32_t timeouts;        // 等待超时次数
+    uint32_t out_of_order;    // 乱序或重复的DATA块
+    uint32_t dup_acks;        // 重复或无效的ACK
+    uint32_t wrong_peer;      // 来自其他TID而被拒绝的包
+    uint32_t rtt_hist[TFTP_RTT_HIST_BUCKETS];
+} tftp_stats_t;
+
 // TFTP会话结构
 typedef struct {
+    net_stack_t* stack;       // 收发使用的协议栈实例, NULL为默认协议栈
     uint32_t peer_ip;
     uint16_t peer_port;
     uint16_t local_port;
     uint16_t block_num;
-    uint8_t retry_count;
+    uint8_t retry_count;      // 达到超时上限后的连续超时次数
     tftp_options_t options;
+    // RTT估计, 时间单位为微秒以保留亚毫秒链路上的平均值
+    uint32_t srtt_us;         // 平滑RTT
+    uint32_t rttvar_us;       // RTT偏差
+    uint32_t rto_ms;          // 当前重传超时, 0表示使用初始值
+    uint32_t rtt_start_ms;    // 计时开始时间
+    uint32_t rtt_seq;         // 正在计时的块, 确认到该块时得到一个样本
+    bool rtt_valid;           // 已有RTT样本
+    bool rtt_timing;          // 正在计时(发生重传时按Karn算法放弃本次样本)
+    tftp_stats_t stats;       // 本会话的统计
 } tftp_session_t;
 
 // TFTP数据回调函数
 typedef int (*tftp_data_callback)(void* user_data, const uint8_t* data, size_t size);
 typedef int (*tftp_get_data_callback)(void* user_data, uint8_t* buffer, size_t max_size);
+// 引用数据源: 通过data返回直接引用的数据(在传输结束前保持有效), 返回长度; 发送时拷贝一次到发送帧
+typedef int (*tftp_map_data_callback)(void* user_data, const uint8_t** data, size_t max_size);
+
+// 滑动窗口状态(RFC 7440), 发送端和接收端共用
+// 窗口内使用不回绕的32位逻辑块号, 只在收发报文时与16位块号相互转换
+typedef struct {
+    uint8_t* buffer;          // 发送端: window_size个DATA包(包头空间+4字节头+块)
+    size_t* lengths;          // 发送端: 各缓存块的数据长度
+    const uint8_t** mapped;   // 发送端(引用数据): 各块引用的数据, 此时buffer只暂存超过一帧的块
+    uint16_t window_size;
+    uint16_t block_size;
+    uint8_t rollover;         // 块号回绕到的值
+    uint32_t base;            // 发送端: 已确认的块数; 接收端: 已按序接收的块数
+    uint32_t sent;            // 发送端: 已发送的块数
+    uint32_t sent_max;        // 发送端: 曾经发送过的最大块号, 之前的块再次发送即为重传
+    uint32_t filled;          // 发送端: 已读入缓存的块数
+    uint64_t offset;          // 发送端: 已确认的数据字节数; 接收端: 已按序接收的数据字节数
+    uint16_t since_ack;       // 接收端: 自上次ACK以来按序收到的块数
+    uint32_t last_ooo;        // 接收端: 最近一次乱序/重复块的逻辑块号
+    bool gap_acked;           // 接收端: 已针对乱序发送过ACK
+    bool eof;                 // 已读到/收到最后一块
+} tftp_window_t;
 
 // 初始化默认配置
 void tftp_init_default_options(tftp_options_t* options);
 
+// 在协议栈实例上分配一个本地动态端口(TID)
+uint16_t tftp_alloc_local_port(net_stack_t* stack);
+
 // 核心协议函数
 int tftp_send_packet(tftp_session_t* session, tftp_opcode_t opcode, const void* data, size_t data_len);
-int tftp_receive_packet(tftp_session_t* session, tftp_opcode_t* opcode, void* data, size_t* data_len, int timeout_ms);
-int tftp_send_error(uint32_t ip, uint16_t port, tftp_error_t code, const char* message);
+// 接收对端的一个包, 操作码之后的内容拷贝到data(最多buf_size字节), 超过buf_size的包视为畸形包返回-1
+int tftp_receive_packet(tftp_session_t* session, tftp_opcode_t* opcode, void* data, size_t buf_size,
+                        size_t* data_len, int timeout_ms);
+int tftp_send_error(net_stack_t* stack, uint32_t ip, uint16_t port,
+                    tftp_error_t code, const char* message);
+int tftp_send_error_from(net_stack_t* stack, uint16_t local_port, uint32_t ip, uint16_t port,
+                         tftp_error_t code, const char* message);
+
+// 全局统计(所有会话之和), 通过tftp_get_stats读取快照
+extern tftp_stats_t g_tftp_stats;
+
+// 同时累加会话和全局计数
+#define TFTP_STAT_ADD(session, field, n) do { \
+    (session)->stats.field += (n); \
+    __atomic_fetch_add(&g_tftp_stats.field, (n), __ATOMIC_RELAXED); \
+} while (0)
+
+// 周期统计钩子, 收到全局统计快照
+typedef void (*tftp_stats_hook_t)(const tftp_stats_t* stats, void* arg);
+
+void tftp_get_stats(tftp_stats_t* stats);
+void tftp_reset_stats(void);
+
+// 设置周期统计钩子, 由tftp_stats_tick按interval_ms间隔调用, hook为NULL时关闭
+void tftp_set_stats_hook(tftp_stats_hook_t hook, void* arg, uint32_t interval_ms);
+void tftp_stats_tick(void);
+
+// 以NET_LOGI输出统计, 可直接作为统计钩子
+void tftp_stats_log(const tftp_stats_t* stats, void* arg);
+
+// RTT估计和重传超时
+void tftp_rtt_reset(tftp_session_t* session);
+void tftp_rtt_start(tftp_session_t* session, uint32_t seq);
+void tftp_rtt_sample(tftp_session_t* session, uint32_t seq);
+int tftp_rtt_backoff(tftp_session_t* session);
+
+// 当前重传超时, 不超过协商的timeout
+static inline uint32_t tftp_rto(const tftp_session_t* session) {
+    uint32_t rto = session->rto_ms ? session->rto_ms : TFTP_RTO_INIT_MS;
+    return rto < session->options.timeout_ms ? rto : session->options.timeout_ms;
+}
+
+// 滑动窗口
+int tftp_window_init(tftp_window_t* w, const tftp_options_t* options, bool sender);
+void tftp_window_free(tftp_window_t* w);
+int tftp_window_init_mapped(tftp_window_t* w, const tftp_options_t* options);
+int tftp_window_fill(tftp_window_t* w, tftp_get_data_callback read, void* user_data);
+int tftp_window_fill_mapped(tftp_window_t* w, tftp_map_data_callback map, void* user_data);
+int tftp_window_send(tftp_session_t* session, tftp_window_t* w);
+int tftp_window_send_to(tftp_session_t* session, tftp_window_t* w, uint32_t ip, uint16_t port);
+void tftp_window_seek(tftp_window_t* w, uint32_t n);
+int32_t tftp_window_distance(const tftp_window_t* w, uint32_t ref, uint16_t block_num);
+int tftp_window_on_ack(tftp_window_t* w, uint16_t block_num);
+int tftp_window_on_data(tftp_window_t* w, uint16_t block_num, size_t len, bool* send_ack);
+int tftp_send_ack(tftp_session_t* session, uint16_t block_num);
+
+// 逻辑块号n对应的报文块号: 65535之后回绕到rollover(0或1)
+static inline uint16_t tftp_window_block(const tftp_window_t* w, uint32_t n) {
+    if (n == 0 || w->rollover == 0) {
+        return (uint16_t)n;
+    }
+    return (uint16_t)((n - 1) % 65535 + 1);
+}
+
+// 发送端回退到最后确认的块, 重新发送整个窗口
+static inline void tftp_window_rewind(tftp_window_t* w) {
+    w->sent = w->base;
+}
+
+// 发送端: 所有块均已确认
+static inline bool tftp_window_done(const tftp_window_t* w) {
+    return w->eof && w->base == w->filled;
+}
 
 // 选项协商
 int tftp_parse_options(const uint8_t* data, size_t len, tftp_options_t* options);
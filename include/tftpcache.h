@@ -0,0 +1,72 @@
+#ifndef TFTP_CACHE_H
+#define TFTP_CACHE_H
+
+#include "tftpserver.h"
+
+// 热点文件块缓存: 放在另一个提供者之前, 同时下载同一文件的会话共用一份数据
+// 数据按(文件, 块大小, 段序号)分段缓存, 每段TFTP_CACHE_CHUNK_BLOCKS块, 只在首次访问时从后端读取
+// 段带引用计数, 会话窗口仍引用的段不会被淘汰; 未被引用的段按LRU淘汰, 总大小不超过预算
+// (所有段都被引用时允许暂时超出预算)
+// 写请求直接交给后端, 打开和关闭时使该文件的缓存失效
+// 可被分片服务器的多个工作线程共用
+
+// 每段的块数, 不小于最大窗口, 使窗口内的块最多跨越两个段
+#ifndef TFTP_CACHE_CHUNK_BLOCKS
+#define TFTP_CACHE_CHUNK_BLOCKS 64
+#endif
+
+// 可同时缓存的文件数, 表满时新文件不经过缓存
+#ifndef TFTP_CACHE_FILES
+#define TFTP_CACHE_FILES        16
+#endif
+
+// 段哈希表大小(2的幂)
+#ifndef TFTP_CACHE_HASH_BITS
+#define TFTP_CACHE_HASH_BITS    8
+#endif
+#define TFTP_CACHE_HASH_SIZE    (1u << TFTP_CACHE_HASH_BITS)
+
+typedef struct tftp_cache_chunk tftp_cache_chunk_t;
+
+// 缓存的文件, 文件名相同即为同一文件
+typedef struct {
+    char name[TFTP_FILENAME_MAX];
+    uint32_t generation;        // 写入时递增, 旧的段不再命中
+    uint32_t opens;             // 打开的句柄数
+    uint32_t chunks;            // 缓存中的段数, 与opens都为0时表项可重用
+} tftp_cache_file_t;
+
+// 缓存统计
+typedef struct {
+    uint64_t hits;              // 段命中次数
+    uint64_t misses;            // 从后端读取的段数
+    uint64_t evictions;         // 淘汰的段数
+    uint64_t backend_bytes;     // 从后端读取的字节数
+    size_t bytes;               // 当前缓存的字节数
+} tftp_cache_stats_t;
+
+typedef struct {
+    const tftp_server_provider_t* backend;
+    void* backend_data;
+    size_t budget;              // 缓存大小预算(字节)
+    tftp_cache_file_t files[TFTP_CACHE_FILES];
+    tftp_cache_chunk_t* hash[TFTP_CACHE_HASH_SIZE];
+    tftp_cache_chunk_t* lru_head;       // 未被引用的段, 最近使用的在前
+    tftp_cache_chunk_t* lru_tail;
+    tftp_cache_stats_t stats;
+    bool lock;
+} tftp_cache_t;
+
+// 初始化缓存, backend需支持read, budget为缓存大小预算(字节)
+int tftp_cache_init(tftp_cache_t* cache, const tftp_server_provider_t* backend,
+                    void* backend_data, size_t budget);
+
+// 释放所有段, 调用前应关闭所有使用缓存的会话
+void tftp_cache_deinit(tftp_cache_t* cache);
+
+void tftp_cache_get_stats(tftp_cache_t* cache, tftp_cache_stats_t* stats);
+
+// 缓存提供者, user_data为tftp_cache_t*
+extern const tftp_server_provider_t tftp_cache_provider;
+
+#endif // TFTP_CACHE_H
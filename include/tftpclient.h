@@ -10,4 +10,100 @@ int tftp_client_put(tftp_session_t* session, const char* filename,
 int tftp_client_get(tftp_session_t* session, const char* filename,
                    tftp_data_callback data_cb, void* user_data);
 
+// 文件大小回调: 服务器在OACK中报告tsize时, 在第一个数据块之前调用一次,
+// 可据此一次性预分配接收缓冲; 返回非0时以"磁盘已满"错误终止传输
+typedef int (*tftp_size_callback)(void* user_data, uint64_t size);
+
+// 下载并请求服务器报告文件大小, 报告的大小同时保存在session->options.transfer_size
+int tftp_client_get_sized(tftp_session_t* session, const char* filename,
+                          tftp_size_callback size_cb, tftp_data_callback data_cb,
+                          void* user_data);
+
+// 按偏移写入的数据回调, 多播下载时数据块可能乱序到达
+typedef int (*tftp_write_callback)(void* user_data, uint64_t offset,
+                                   const uint8_t* data, size_t size);
+
+// 多播下载(RFC 2090): 加入服务器分配的多播组, 与其他客户端共用同一份数据流;
+// 中途加入时先接收组中正在发送的块, 成为主客户端后再补齐缺少的块
+// size_cb在数据到达前报告文件大小, 服务器不支持多播时按单播下载
+int tftp_client_get_multicast(tftp_session_t* session, const char* filename,
+                              tftp_size_callback size_cb, tftp_write_callback write_cb,
+                              void* user_data);
+
+// 非阻塞传输(单播上传/下载): tftp_client_start_put/get发出请求后立即返回,
+// 之后每次tftp_client_step只处理已到达的包和到期的重传, 不等待;
+// 一个线程可以交替推进任意多个传输, 通常交给tftp_client_loop_t统一驱动
+// 上面的单播阻塞接口即是反复推进单个传输直到结束
+
+// 请求报文的最大长度(文件名+模式+选项)
+#define TFTP_CLIENT_REQUEST_SIZE (2 + TFTP_FILENAME_MAX + 1 + 32 + 1 + 128)
+
+typedef enum {
+    TFTP_XFER_REQUEST = 0,  // 已发送请求, 等待服务器的首个应答
+    TFTP_XFER_DATA,         // 正在传输数据
+    TFTP_XFER_DONE,         // 成功完成
+    TFTP_XFER_FAILED        // 失败或已取消
+} tftp_xfer_state_t;
+
+typedef struct tftp_client_xfer tftp_client_xfer_t;
+
+// 传输结束回调, result为0表示成功, -1表示失败; 回调中可以开始新的传输
+typedef void (*tftp_xfer_done_callback)(tftp_client_xfer_t* xfer, int result, void* user_data);
+
+// 传输状态, 由调用方分配, 在传输结束前保持有效
+struct tftp_client_xfer {
+    tftp_session_t* session;        // 对端地址、选项、RTT和统计, 与阻塞接口相同
+    tftp_xfer_state_t state;
+    bool write;                     // 上传
+    tftp_get_data_callback get_data;
+    tftp_size_callback size_cb;
+    tftp_data_callback data_cb;
+    void* user_data;
+    tftp_window_t window;
+    uint16_t server_port;           // 重发请求的目的端口
+    uint8_t attempts;               // 已发送请求的次数
+    uint32_t last_ms;               // 最近一次发送或收到对端包的时间, 超时从此计算
+    size_t request_len;
+    uint8_t request[TFTP_CLIENT_REQUEST_SIZE];  // 保存请求以便首个应答丢失时重发
+    // 事件循环使用
+    tftp_client_xfer_t* next;
+    tftp_xfer_done_callback done_cb;
+    void* done_arg;
+};
+
+// 开始下载/上传, 请求已发出时返回0
+// session由调用方设置stack、peer_ip、peer_port(服务器端口)和options, 传输期间不能用于其他传输
+int tftp_client_start_get(tftp_client_xfer_t* xfer, tftp_session_t* session, const char* filename,
+                          tftp_size_callback size_cb, tftp_data_callback data_cb, void* user_data);
+int tftp_client_start_put(tftp_client_xfer_t* xfer, tftp_session_t* session, const char* filename,
+                          tftp_get_data_callback get_data, void* user_data);
+
+// 推进传输: 处理本地端口上已到达的包, 到期时重传, 不阻塞
+// 返回1表示仍在进行, 0表示成功完成, -1表示失败; 结束时释放本地端口
+int tftp_client_step(tftp_client_xfer_t* xfer);
+
+// 距离下一次超时的毫秒数, 在此之前没有包到达时不需要再调用tftp_client_step
+uint32_t tftp_client_next_timeout(const tftp_client_xfer_t* xfer);
+
+// 取消进行中的传输, 通知服务器后按失败结束
+void tftp_client_cancel(tftp_client_xfer_t* xfer);
+
+// 客户端事件循环: 在一个线程中驱动同一协议栈实例上的多个传输,
+// 等待时阻塞到任一传输的端口有包到达或最早的重传到期
+typedef struct {
+    net_stack_t* stack;
+    tftp_client_xfer_t* head;
+    int count;                      // 进行中的传输数
+} tftp_client_loop_t;
+
+void tftp_client_loop_init(tftp_client_loop_t* loop, net_stack_t* stack);
+
+// 加入已开始的传输(会话须使用循环的协议栈实例), 结束时从循环中移除并调用done_cb(可为NULL)
+int tftp_client_loop_add(tftp_client_loop_t* loop, tftp_client_xfer_t* xfer,
+                         tftp_xfer_done_callback done_cb, void* user_data);
+
+// 推进所有传输, 之后等待到有包到达、最早的重传到期或超过timeout_ms, 返回仍在进行的传输数
+// 通常循环调用直到返回0
+int tftp_client_loop_poll(tftp_client_loop_t* loop, int timeout_ms);
+
 #endif // TFTP_CLIENT_H
\ No newline at end of file
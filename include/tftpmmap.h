@@ -0,0 +1,13 @@
+#ifndef TFTP_MMAP_H
+#define TFTP_MMAP_H
+
+#include "tftpserver.h"
+
+// 基于mmap的文件提供者(POSIX)
+// 读请求的文件整体映射到内存, 数据块从映射页拷贝一次到发送帧, 不经过读缓冲
+// 写请求使用pwrite按偏移写入临时文件, 最后一块确认前fsync并改名替换目标文件
+// 替换不影响正在读取旧文件的会话, 未完成的上传不改变目标文件
+// user_data为文件根目录(const char*), NULL表示当前目录
+extern const tftp_server_provider_t tftp_mmap_provider;
+
+#endif // TFTP_MMAP_H
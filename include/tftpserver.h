@@ -3,15 +3,195 @@
 
 #include "tftp.h"
 
+// 最大并发会话数
+#ifndef TFTP_SERVER_MAX_SESSIONS
+#define TFTP_SERVER_MAX_SESSIONS 128
+#endif
+
+// 多播传输(RFC 2090)的成员客户端数, 所有多播传输共用
+#ifndef TFTP_SERVER_MCAST_CLIENTS
+#define TFTP_SERVER_MCAST_CLIENTS 32
+#endif
+
+// OACK/ACK/ERROR等控制包的缓冲大小
+#define TFTP_SERVER_CTRL_PACKET_SIZE 160
+
+// 分片服务器的最大工作线程数
+#ifndef TFTP_SERVER_MAX_WORKERS
+#define TFTP_SERVER_MAX_WORKERS 16
+#endif
+
+// 每个工作线程待处理的转交请求数(2的幂), 队列满时由收到请求的线程自己处理
+#ifndef TFTP_SERVER_HANDOFF_LEN
+#define TFTP_SERVER_HANDOFF_LEN 16
+#endif
+
+// 工作线程每次poll的最长等待时间, 也是转交请求的最大处理延迟
+#ifndef TFTP_SERVER_WORKER_POLL_MS
+#define TFTP_SERVER_WORKER_POLL_MS 1
+#endif
+
+// 提供者的sync暂未完成时, 再次调用前的间隔
+#ifndef TFTP_SERVER_SYNC_POLL_MS
+#define TFTP_SERVER_SYNC_POLL_MS 10
+#endif
+
+// 可转交的请求包的最大长度
+#define TFTP_SERVER_REQUEST_MAX 512
+
 // 服务器回调类型
-typedef int (*tftp_server_read_cb)(void* user_data, const char* filename, 
+typedef int (*tftp_server_read_cb)(void* user_data, const char* filename,
                                  uint8_t* buffer, size_t max_size);
 typedef int (*tftp_server_write_cb)(void* user_data, const char* filename,
                                   const uint8_t* data, size_t size);
 
-// 服务器接口
-void tftp_server_process(tftp_server_read_cb read_cb, 
+// 文件提供者: 每个会话只打开一次文件, 之后按偏移读写, 会话结束时关闭
+// open成功返回0并通过handle返回会话私有的文件句柄, 失败返回负值
+// read/write返回实际读写的字节数, 失败返回负值
+// map可选: 通过data返回offset处数据的直接引用(在close前保持有效), 返回长度;
+// 提供map时数据块不经过读缓冲, 从引用处拷贝一次到发送帧(超过一帧的块先拷贝到窗口缓存再分片)
+// size可选: 通过size返回读请求文件的大小, 成功返回0; 用于在OACK中回应tsize
+// sync可选: 写请求的最后一块写入后、发送最后的ACK前调用, 把已写入的数据持久化, 失败返回负值
+// write和sync不能立即完成时可返回TFTP_PROVIDER_PENDING, 不阻塞服务器线程:
+// write此时不能写入任何数据, 服务器不确认该块, 由客户端重传;
+// sync此时服务器暂不发送最后的ACK, 每隔TFTP_SERVER_SYNC_POLL_MS再次调用直到完成
+#define TFTP_PROVIDER_PENDING (-2)
+
+typedef struct {
+    int (*open)(void* user_data, const char* filename, bool write, void** handle);
+    int (*read)(void* user_data, void* handle, uint64_t offset,
+                uint8_t* buffer, size_t max_size);
+    int (*write)(void* user_data, void* handle, uint64_t offset,
+                 const uint8_t* data, size_t size);
+    void (*close)(void* user_data, void* handle);
+    int (*map)(void* user_data, void* handle, uint64_t offset,
+               const uint8_t** data, size_t max_size);
+    int (*size)(void* user_data, void* handle, uint64_t* size);
+    int (*sync)(void* user_data, void* handle);
+} tftp_server_provider_t;
+
+// 会话状态
+typedef enum {
+    TFTP_SERVER_SESSION_FREE = 0,   // 空闲
+    TFTP_SERVER_SESSION_READ,       // 处理RRQ, 向客户端发送数据
+    TFTP_SERVER_SESSION_WRITE,      // 处理WRQ, 从客户端接收数据
+    TFTP_SERVER_SESSION_DALLY       // 传输已完成, 等待可能的重传
+} tftp_server_session_state_t;
+
+// 服务器会话
+typedef struct {
+    tftp_server_session_state_t state;
+    tftp_session_t session;
+    char filename[TFTP_FILENAME_MAX];
+    tftp_window_t window;       // 数据窗口
+    void* handle;               // 提供者返回的文件句柄
+    uint64_t offset;            // 下一次读写的文件偏移
+    uint8_t packet[TFTP_SERVER_CTRL_PACKET_SIZE]; // 最近发送的控制包(用于超时重传)
+    size_t packet_len;
+    uint32_t last_send_ms;      // 最近一次发送的时间
+    bool oack_pending;          // 已发送OACK, 等待ACK0(RRQ)或DATA1(WRQ)
+    bool sync_pending;          // 最后一块已写入, 等待提供者的sync完成后再确认
+    bool multicast;             // 多播传输: DATA发往组地址, 只有主客户端(会话的对端)确认
+    uint16_t mcast_port;        // 多播组端口
+    uint32_t mcast_last;        // 多播传输最后一块的逻辑块号
+} tftp_server_session_t;
+
+// 多播传输的成员客户端, 当前的主客户端也在其中
+typedef struct {
+    uint32_t ip;
+    uint16_t port;
+    uint16_t session_port;      // 所属多播传输的会话端口, 0表示空闲
+} tftp_server_mcast_client_t;
+
+struct tftp_server_shard;
+
+// 服务器实例
+typedef struct {
+    net_stack_t* stack;         // 收发使用的协议栈实例, NULL为默认协议栈
+    uint16_t port;              // 监听端口
+    const tftp_server_provider_t* provider;
+    void* provider_data;        // 传给提供者的user_data
+    tftp_server_read_cb read_cb;        // 旧式回调, 通过内部提供者适配
+    tftp_server_write_cb write_cb;
+    void* user_data;
+    uint16_t active_sessions;
+    tftp_server_session_t sessions[TFTP_SERVER_MAX_SESSIONS];
+    uint32_t mcast_ip;          // 多播组地址, 0表示不接受多播选项
+    uint16_t mcast_port;        // 多播端口基值, 各传输使用mcast_port+会话序号
+    tftp_server_mcast_client_t mcast_clients[TFTP_SERVER_MCAST_CLIENTS];
+    struct tftp_server_shard* shard;    // 所属的分片服务器, NULL表示独立运行
+    int shard_index;                    // 在分片服务器中的工作线程序号
+} tftp_server_t;
+
+// 监听者转交给工作线程的请求
+typedef struct {
+    uint32_t ip;
+    uint16_t port;
+    uint16_t len;
+    uint8_t data[TFTP_SERVER_REQUEST_MAX];
+} tftp_server_request_t;
+
+// 分片服务器的工作线程: 独占一个协议栈实例、一段会话端口和其上的所有会话
+typedef struct {
+    tftp_server_t server;
+    tftp_server_request_t requests[TFTP_SERVER_HANDOFF_LEN];
+    uint32_t head;              // 转交方写入位置(持有lock)
+    uint32_t tail;              // 工作线程读取位置
+    bool lock;
+    void* task;
+    void* exited;               // 工作线程退出时释放
+} tftp_server_worker_t;
+
+// 分片服务器: 每个工作线程在自己的协议栈实例上轮询, 数据路径上不共享任何状态
+// 收到监听端口请求的工作线程(通常是0号)负责分配: 读请求按客户端地址哈希转交给所属工作线程,
+// 写请求留给0号工作线程, 因为链路无法按端口分流IP分片, 分片应全部交给0号实例
+typedef struct tftp_server_shard {
+    tftp_server_worker_t* workers;
+    int worker_count;
+    uint16_t port_span;         // 每个工作线程的会话端口数
+    bool running;
+} tftp_server_shard_t;
+
+// 服务器接口, 服务器及其所有会话使用stack收发, 同步模式下只能在该实例所属的线程中轮询
+int tftp_server_init(tftp_server_t* server,
+                     net_stack_t* stack,
+                     tftp_server_read_cb read_cb,
+                     tftp_server_write_cb write_cb,
+                     void* user_data);
+
+// 使用文件提供者初始化服务器
+int tftp_server_init_provider(tftp_server_t* server,
+                              net_stack_t* stack,
+                              const tftp_server_provider_t* provider,
+                              void* user_data);
+
+// 接受多播选项(RFC 2090): 同一文件的读请求共用一个传输, DATA发往group_ip,
+// 由主客户端确认, 其他客户端在主客户端完成后依次接替并补齐缺少的块
+// 需要提供者支持size; group_ip为0时关闭
+void tftp_server_set_multicast(tftp_server_t* server, uint32_t group_ip, uint16_t base_port);
+
+// 接收并处理所有就绪的包, 然后推进所有会话的超时状态, 不会阻塞在单个传输上
+int tftp_server_poll(tftp_server_t* server, int timeout_ms);
+
+// 关闭所有会话
+void tftp_server_deinit(tftp_server_t* server);
+
+// 启动count个工作线程, 工作线程i使用已初始化的stacks[i]收发, 并把它的动态端口范围限制为
+// 互不相交的一段; 链路需把发往各段端口的帧分流到对应实例(网卡流规则或net_loop_split),
+// 分流规则可直接使用tftp_server_shard_steer; 不支持多播选项
+int tftp_server_shard_start(tftp_server_shard_t* shard, net_stack_t* const* stacks, int count,
+                            const tftp_server_provider_t* provider, void* user_data);
+
+// 停止所有工作线程并关闭它们的会话
+void tftp_server_shard_stop(tftp_server_shard_t* shard);
+
+// 帧应交给的工作线程: 会话端口所属的工作线程, 监听端口和IP分片为0号, 其他(ARP等)返回-1表示所有
+// 参数顺序与net_loop_steer_fn一致
+int tftp_server_shard_steer(void* shard, const uint8_t* frame, size_t len);
+
+// 兼容接口, 使用内部默认服务器实例和默认协议栈
+void tftp_server_process(tftp_server_read_cb read_cb,
                         tftp_server_write_cb write_cb,
                         void* user_data);
 
-#endif // TFTP_SERVER_H
\ No newline at end of file
+#endif // TFTP_SERVER_H
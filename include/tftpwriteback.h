@@ -0,0 +1,63 @@
+#ifndef TFTP_WRITEBACK_H
+#define TFTP_WRITEBACK_H
+
+#include "tftpserver.h"
+
+// 延迟写提供者: 放在另一个提供者之前, 写请求的数据块先合并到大的缓冲中,
+// 缓冲写满后交给后台任务按顺序写入后端, 服务器不必等待存储就能确认数据块
+// sync把剩余数据和后端的sync一起交给后台任务, 完成前返回TFTP_PROVIDER_PENDING,
+// 服务器之后再次调用, 完成后才发送最后的ACK; 后台写入失败时,
+// 之后的write或sync返回失败, 由服务器向客户端报告错误
+// 中止的会话关闭时仍等待已提交的缓冲写完
+// 读请求直接交给后端
+
+// 每个缓冲的大小, 缓冲覆盖的文件范围按此大小对齐
+#ifndef TFTP_WRITEBACK_BUFFER_SIZE
+#define TFTP_WRITEBACK_BUFFER_SIZE  (256 * 1024)
+#endif
+
+// 每个写会话最多的缓冲数(至少2), 都在等待写入时write返回TFTP_PROVIDER_PENDING,
+// 服务器不确认该块, 由客户端重传(存储慢于网络时的背压)
+#ifndef TFTP_WRITEBACK_BUFFERS
+#define TFTP_WRITEBACK_BUFFERS      4
+#endif
+
+// 缓冲内存的对齐(2的幂)
+#ifndef TFTP_WRITEBACK_ALIGN
+#define TFTP_WRITEBACK_ALIGN        4096
+#endif
+
+typedef struct tftp_writeback_buf tftp_writeback_buf_t;
+
+typedef struct {
+    uint64_t flushes;           // 后台写入的缓冲数
+    uint64_t bytes;             // 后台写入的字节数
+    uint64_t stalls;            // write因没有空闲缓冲返回TFTP_PROVIDER_PENDING的次数
+    uint64_t errors;            // 后台写入失败次数
+} tftp_writeback_stats_t;
+
+typedef struct {
+    const tftp_server_provider_t* backend;
+    void* backend_data;
+    void* task;
+    void* wake;                 // 有缓冲待写入或需要退出时唤醒后台任务
+    void* exited;               // 后台任务退出时释放
+    tftp_writeback_buf_t* queue_head;   // 待写入的缓冲, 按提交顺序
+    tftp_writeback_buf_t* queue_tail;
+    tftp_writeback_stats_t stats;
+    bool lock;
+    bool running;
+} tftp_writeback_t;
+
+// 初始化并启动后台写入任务, backend需支持open和write
+int tftp_writeback_init(tftp_writeback_t* wb, const tftp_server_provider_t* backend, void* backend_data);
+
+// 停止后台任务, 调用前应关闭所有使用它的会话
+void tftp_writeback_deinit(tftp_writeback_t* wb);
+
+void tftp_writeback_get_stats(tftp_writeback_t* wb, tftp_writeback_stats_t* stats);
+
+// 延迟写提供者, user_data为tftp_writeback_t*
+extern const tftp_server_provider_t tftp_writeback_provider;
+
+#endif // TFTP_WRITEBACK_H
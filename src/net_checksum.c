@@ -0,0 +1,132 @@
+#include "net_checksum.h"
+#include <string.h>
+
+#if NET_CHECKSUM_SIMD && defined(__AVX2__)
+#include <immintrin.h>
+#define NET_CHECKSUM_VEC        32
+#elif NET_CHECKSUM_SIMD && defined(__SSE2__)
+#include <emmintrin.h>
+#define NET_CHECKSUM_VEC        16
+#elif NET_CHECKSUM_SIMD && defined(__ARM_NEON)
+#include <arm_neon.h>
+#define NET_CHECKSUM_VEC        16
+#endif
+
+// 短于此长度(包头等)直接使用标量实现
+#define NET_CHECKSUM_VEC_MIN    64
+
+// 向量累加器的32位通道每轮最多增加2*0xFFFF, 每隔此轮数并入64位和以免溢出
+#define NET_CHECKSUM_VEC_ROUNDS 16384
+
+#if defined(NET_CHECKSUM_VEC) && defined(__AVX2__)
+// 16位字零扩展为32位后分两组累加, 减少相邻轮之间的依赖
+static uint64_t net_checksum_vec(const uint8_t *p, size_t rounds) {
+    const __m256i zero = _mm256_setzero_si256();
+    __m256i lo = zero;
+    __m256i hi = zero;
+    uint32_t lanes[8];
+    uint64_t sum = 0;
+
+    while (rounds--) {
+        __m256i x = _mm256_loadu_si256((const __m256i *)p);
+        lo = _mm256_add_epi32(lo, _mm256_unpacklo_epi16(x, zero));
+        hi = _mm256_add_epi32(hi, _mm256_unpackhi_epi16(x, zero));
+        p += 32;
+    }
+
+    _mm256_storeu_si256((__m256i *)lanes, _mm256_add_epi32(lo, hi));
+    for (int i = 0; i < 8; i++) {
+        sum += lanes[i];
+    }
+    return sum;
+}
+#elif defined(NET_CHECKSUM_VEC) && defined(__SSE2__)
+static uint64_t net_checksum_vec(const uint8_t *p, size_t rounds) {
+    const __m128i zero = _mm_setzero_si128();
+    __m128i lo = zero;
+    __m128i hi = zero;
+    uint32_t lanes[4];
+
+    while (rounds--) {
+        __m128i x = _mm_loadu_si128((const __m128i *)p);
+        lo = _mm_add_epi32(lo, _mm_unpacklo_epi16(x, zero));
+        hi = _mm_add_epi32(hi, _mm_unpackhi_epi16(x, zero));
+        p += 16;
+    }
+
+    _mm_storeu_si128((__m128i *)lanes, _mm_add_epi32(lo, hi));
+    return (uint64_t)lanes[0] + lanes[1] + lanes[2] + lanes[3];
+}
+#elif defined(NET_CHECKSUM_VEC)
+// 相邻16位字两两相加后累加到32位通道
+static uint64_t net_checksum_vec(const uint8_t *p, size_t rounds) {
+    uint32x4_t acc = vdupq_n_u32(0);
+
+    while (rounds--) {
+        acc = vpadalq_u16(acc, vreinterpretq_u16_u8(vld1q_u8(p)));
+        p += 16;
+    }
+
+    uint64x2_t sum = vpaddlq_u32(acc);
+    return vgetq_lane_u64(sum, 0) + vgetq_lane_u64(sum, 1);
+}
+#endif
+
+// 标量实现: 以64位字累加, 进位回加到最低位; 2^16 ≡ 1 (mod 0xFFFF), 结果与按16位累加相同
+static uint64_t net_checksum_scalar(uint64_t sum, const uint8_t *p, size_t len) {
+    uint64_t w;
+    uint16_t h;
+
+    while (len >= 8) {
+        memcpy(&w, p, 8);
+        sum += w;
+        sum += sum < w;
+        p += 8;
+        len -= 8;
+    }
+
+    // 剩余部分不超过7字节, 不会溢出
+    sum = (sum & 0xFFFFFFFF) + (sum >> 32);
+    while (len >= 2) {
+        memcpy(&h, p, 2);
+        sum += h;
+        p += 2;
+        len -= 2;
+    }
+
+    // 奇数长度末尾补一个0字节
+    if (len) {
+        h = 0;
+        memcpy(&h, p, 1);
+        sum += h;
+    }
+    return sum;
+}
+
+uint32_t net_checksum_add(uint32_t sum, const void *data, size_t len) {
+    const uint8_t *p = data;
+    uint64_t acc = sum;
+
+#ifdef NET_CHECKSUM_VEC
+    if (len >= NET_CHECKSUM_VEC_MIN) {
+        size_t rounds = len / NET_CHECKSUM_VEC;
+        while (rounds > 0) {
+            size_t n = rounds < NET_CHECKSUM_VEC_ROUNDS ? rounds : NET_CHECKSUM_VEC_ROUNDS;
+            acc += net_checksum_vec(p, n);
+            p += n * NET_CHECKSUM_VEC;
+            rounds -= n;
+        }
+        len %= NET_CHECKSUM_VEC;
+    }
+#endif
+
+    acc = net_checksum_scalar(acc, p, len);
+
+    // 折叠为16位
+    acc = (acc & 0xFFFFFFFF) + (acc >> 32);
+    acc = (acc & 0xFFFFFFFF) + (acc >> 32);
+    acc = (acc & 0xFFFF) + (acc >> 16);
+    acc = (acc & 0xFFFF) + (acc >> 16);
+    acc = (acc & 0xFFFF) + (acc >> 16);
+    return (uint32_t)acc;
+}
@@ -0,0 +1,377 @@
+#include "net_loopback.h"
+#include <string.h>
+#include <stdlib.h>
+#include <stdbool.h>
+
+// 队列中的一帧, deliver_ms之前对接收方不可见
+typedef struct {
+    uint32_t deliver_ms;
+    uint16_t len;
+    uint8_t data[NET_MTU_MAX];
+} net_loop_frame_t;
+
+// 单生产者/单消费者环形队列
+typedef struct {
+    uint32_t size;              // 2的幂
+    uint32_t head;              // 写入位置(发送方)
+    uint32_t tail;              // 读取位置(接收方)
+    net_loop_frame_t *frames;
+} net_loop_ring_t;
+
+typedef struct net_loop_queue net_loop_queue_t;
+
+struct net_loop_endpoint {
+    net_loop_config_t cfg;
+    net_loop_ring_t *tx;        // 对端的接收队列
+    net_loop_ring_t *rx;        // 本端的接收队列(由本端释放)
+    net_loop_endpoint_t *peer;  // 向本端发送的端点, 接收时取出其超时的重排帧
+    uint32_t rng;               // xorshift32状态
+    uint64_t link_free_us;      // 限速时链路空闲的时刻
+    bool held;                  // 有一帧被重排, 等待下一帧之后发出或由接收方超时取出
+    net_loop_frame_t held_frame;
+    net_loop_stats_t stats;
+    bool tx_lock;               // 发送方自旋锁(异步接收任务会发送ARP应答)
+    bool rx_lock;               // 拆分后各队列分发接收帧时加锁
+    net_loop_queue_t *queues;   // 拆分的接收队列, NULL表示未拆分
+    int queue_count;
+    net_loop_steer_fn steer;
+    void *steer_arg;
+};
+
+// 拆分出的接收队列, 由分发者(持有rx_lock)写入, 队列所有者读取
+struct net_loop_queue {
+    net_loop_endpoint_t *ep;
+    net_loop_ring_t *ring;
+};
+
+static net_loop_ring_t *net_loop_ring_create(uint32_t size) {
+    net_loop_ring_t *ring = calloc(1, sizeof(net_loop_ring_t));
+    if (!ring) {
+        return NULL;
+    }
+
+    ring->size = size;
+    ring->frames = calloc(size, sizeof(net_loop_frame_t));
+    if (!ring->frames) {
+        free(ring);
+        return NULL;
+    }
+    return ring;
+}
+
+static void net_loop_ring_destroy(net_loop_ring_t *ring) {
+    if (ring) {
+        free(ring->frames);
+        free(ring);
+    }
+}
+
+static net_loop_endpoint_t *net_loop_endpoint_create(const net_loop_config_t *cfg, uint32_t seed) {
+    net_loop_endpoint_t *ep = calloc(1, sizeof(net_loop_endpoint_t));
+    if (!ep) {
+        return NULL;
+    }
+
+    if (cfg) {
+        ep->cfg = *cfg;
+    }
+    if (ep->cfg.ring_size == 0 || (ep->cfg.ring_size & (ep->cfg.ring_size - 1))) {
+        ep->cfg.ring_size = NET_LOOP_RING_SIZE;
+    }
+    ep->rng = seed ? seed : 0x2545F491;
+
+    ep->rx = net_loop_ring_create(ep->cfg.ring_size);
+    if (!ep->rx) {
+        free(ep);
+        return NULL;
+    }
+    return ep;
+}
+
+int net_loop_pair_create(const net_loop_config_t *cfg,
+                         net_loop_endpoint_t **a, net_loop_endpoint_t **b) {
+    uint32_t seed = cfg ? cfg->seed : 0;
+
+    // 两个方向使用不同的随机序列
+    *a = net_loop_endpoint_create(cfg, seed);
+    *b = net_loop_endpoint_create(cfg, seed ^ 0x9E3779B9);
+    if (!*a || !*b) {
+        net_loop_destroy(*a);
+        net_loop_destroy(*b);
+        *a = *b = NULL;
+        return -1;
+    }
+
+    (*a)->tx = (*b)->rx;
+    (*b)->tx = (*a)->rx;
+    (*a)->peer = *b;
+    (*b)->peer = *a;
+    return 0;
+}
+
+net_loop_endpoint_t *net_loop_create(const net_loop_config_t *cfg) {
+    net_loop_endpoint_t *ep = net_loop_endpoint_create(cfg, cfg ? cfg->seed : 0);
+    if (ep) {
+        ep->tx = ep->rx;
+        ep->peer = ep;
+    }
+    return ep;
+}
+
+void net_loop_destroy(net_loop_endpoint_t *ep) {
+    if (ep) {
+        for (int i = 0; i < ep->queue_count; i++) {
+            net_loop_ring_destroy(ep->queues[i].ring);
+        }
+        free(ep->queues);
+        net_loop_ring_destroy(ep->rx);
+        free(ep);
+    }
+}
+
+void net_loop_set_config(net_loop_endpoint_t *ep, const net_loop_config_t *cfg) {
+    while (__atomic_test_and_set(&ep->tx_lock, __ATOMIC_ACQUIRE)) {
+    }
+    uint32_t ring_size = ep->cfg.ring_size;
+    if (cfg) {
+        ep->cfg = *cfg;
+    } else {
+        memset(&ep->cfg, 0, sizeof(ep->cfg));
+    }
+    ep->cfg.ring_size = ring_size;
+    ep->rng = ep->cfg.seed ? ep->cfg.seed : 0x2545F491;
+    ep->link_free_us = 0;
+    __atomic_clear(&ep->tx_lock, __ATOMIC_RELEASE);
+}
+
+static uint32_t net_loop_random(net_loop_endpoint_t *ep) {
+    uint32_t x = ep->rng;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    ep->rng = x;
+    return x;
+}
+
+// 按百万分之ppm的概率返回true
+static inline bool net_loop_chance(net_loop_endpoint_t *ep, uint32_t ppm) {
+    return ppm > 0 && net_loop_random(ep) % 1000000 < ppm;
+}
+
+// 写入队列, 队列满时返回-1
+static int net_loop_ring_put(net_loop_ring_t *ring, uint32_t deliver_ms, const uint8_t *data, size_t len) {
+    uint32_t head = ring->head;
+    uint32_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+
+    if (head - tail >= ring->size) {
+        return -1;
+    }
+
+    net_loop_frame_t *slot = &ring->frames[head & (ring->size - 1)];
+    slot->deliver_ms = deliver_ms;
+    slot->len = (uint16_t)len;
+    memcpy(slot->data, data, len);
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+// 取出已到达的一帧, 没有数据返回0
+static int net_loop_ring_get(net_loop_ring_t *ring, uint8_t *buf, size_t size) {
+    uint32_t tail = ring->tail;
+    uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+
+    if (tail == head) {
+        return 0;
+    }
+
+    net_loop_frame_t *slot = &ring->frames[tail & (ring->size - 1)];
+    if ((int32_t)(slot->deliver_ms - net_get_time_ms()) > 0) {
+        return 0; // 尚未到达
+    }
+
+    size_t len = slot->len < size ? slot->len : size;
+    memcpy(buf, slot->data, len);
+    __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+    return (int)len;
+}
+
+// 放入对端队列, 队列满时丢弃(相当于网卡队列溢出)
+static void net_loop_push(net_loop_endpoint_t *ep, const net_loop_frame_t *frame) {
+    if (net_loop_ring_put(ep->tx, frame->deliver_ms, frame->data, frame->len) < 0) {
+        __atomic_fetch_add(&ep->stats.overflow, 1, __ATOMIC_RELAXED);
+    }
+}
+
+static int net_loop_send_locked(net_loop_endpoint_t *ep, const uint8_t *frame, size_t len) {
+    net_loop_frame_t *out;
+    net_loop_frame_t tmp;
+
+    ep->stats.tx_frames++;
+
+    if (net_loop_chance(ep, ep->cfg.loss_ppm)) {
+        ep->stats.lost++;
+        return 0; // 对发送方而言发送成功
+    }
+
+    // 送达时间: 限速时按帧长排队, 再加上传播时延
+    uint32_t now = net_get_time_ms();
+    uint32_t deliver = now;
+    if (ep->cfg.bandwidth_kbps) {
+        uint64_t now_us = (uint64_t)now * 1000;
+        if (ep->link_free_us < now_us) {
+            ep->link_free_us = now_us;
+        }
+        ep->link_free_us += (uint64_t)len * 8 * 1000 / ep->cfg.bandwidth_kbps;
+        deliver = (uint32_t)((ep->link_free_us + 999) / 1000);
+    }
+    deliver += ep->cfg.latency_ms;
+
+    // 重排: 暂存本帧, 在下一帧之后送达
+    out = ep->held ? &tmp : &ep->held_frame;
+    out->deliver_ms = deliver;
+    out->len = (uint16_t)len;
+    memcpy(out->data, frame, len);
+
+    if (!ep->held && net_loop_chance(ep, ep->cfg.reorder_ppm)) {
+        __atomic_store_n(&ep->held, true, __ATOMIC_RELAXED);
+        ep->stats.reordered++;
+        return 0;
+    }
+
+    net_loop_push(ep, out);
+    if (ep->held) {
+        // 队列按顺序送达, 被重排的帧不早于当前帧
+        ep->held_frame.deliver_ms = deliver;
+        net_loop_push(ep, &ep->held_frame);
+        __atomic_store_n(&ep->held, false, __ATOMIC_RELAXED);
+    }
+    return 0;
+}
+
+// 对端暂存的重排帧超过原定送达时间NET_LOOP_REORDER_HOLD_MS后仍没有下一帧时直接送达,
+// 否则传输的最后一帧被重排后永远不会到达
+static void net_loop_flush_held(net_loop_endpoint_t *ep) {
+    net_loop_endpoint_t *peer = ep->peer;
+
+    if (!__atomic_load_n(&peer->held, __ATOMIC_RELAXED)) {
+        return;
+    }
+
+    while (__atomic_test_and_set(&peer->tx_lock, __ATOMIC_ACQUIRE)) {
+    }
+    if (peer->held &&
+        (int32_t)(net_get_time_ms() - peer->held_frame.deliver_ms) >= NET_LOOP_REORDER_HOLD_MS) {
+        net_loop_push(peer, &peer->held_frame);
+        __atomic_store_n(&peer->held, false, __ATOMIC_RELAXED);
+    }
+    __atomic_clear(&peer->tx_lock, __ATOMIC_RELEASE);
+}
+
+int net_loop_send(void *arg, const uint8_t *frame, size_t len) {
+    net_loop_endpoint_t *ep = (net_loop_endpoint_t *)arg;
+
+    if (len > NET_MTU_MAX) {
+        return -1;
+    }
+
+    while (__atomic_test_and_set(&ep->tx_lock, __ATOMIC_ACQUIRE)) {
+    }
+    int ret = net_loop_send_locked(ep, frame, len);
+    __atomic_clear(&ep->tx_lock, __ATOMIC_RELEASE);
+    return ret;
+}
+
+int net_loop_receive(void *arg, uint8_t *buf, size_t size) {
+    net_loop_endpoint_t *ep = (net_loop_endpoint_t *)arg;
+
+    net_loop_flush_held(ep);
+    int len = net_loop_ring_get(ep->rx, buf, size);
+
+    if (len > 0) {
+        ep->stats.rx_frames++;
+    }
+    return len;
+}
+
+void net_loop_link_ops(net_loop_endpoint_t *ep, net_link_ops_t *ops) {
+    ops->send = net_loop_send;
+    ops->receive = net_loop_receive;
+    ops->ctx = ep;
+}
+
+void net_loop_get_stats(const net_loop_endpoint_t *ep, net_loop_stats_t *stats) {
+    *stats = ep->stats;
+}
+
+// 把端点上已到达的帧分发到各队列, 由持有rx_lock的接收者调用
+static void net_loop_distribute(net_loop_endpoint_t *ep) {
+    uint8_t frame[NET_MTU_MAX];
+    uint32_t now = net_get_time_ms();
+    int len;
+
+    while ((len = net_loop_receive(ep, frame, sizeof(frame))) > 0) {
+        int q = ep->steer(ep->steer_arg, frame, (size_t)len);
+        for (int i = 0; i < ep->queue_count; i++) {
+            if ((q < 0 || q % ep->queue_count == i) &&
+                net_loop_ring_put(ep->queues[i].ring, now, frame, (size_t)len) < 0) {
+                __atomic_fetch_add(&ep->stats.overflow, 1, __ATOMIC_RELAXED);
+            }
+        }
+    }
+}
+
+static int net_loop_queue_send(void *arg, const uint8_t *frame, size_t len) {
+    return net_loop_send(((net_loop_queue_t *)arg)->ep, frame, len);
+}
+
+static int net_loop_queue_receive(void *arg, uint8_t *buf, size_t size) {
+    net_loop_queue_t *queue = (net_loop_queue_t *)arg;
+    net_loop_endpoint_t *ep = queue->ep;
+    int len = net_loop_ring_get(queue->ring, buf, size);
+
+    // 本队列为空时代为分发, 其他队列的接收者正在分发时不等待
+    if (len == 0 && !__atomic_test_and_set(&ep->rx_lock, __ATOMIC_ACQUIRE)) {
+        net_loop_distribute(ep);
+        __atomic_clear(&ep->rx_lock, __ATOMIC_RELEASE);
+        len = net_loop_ring_get(queue->ring, buf, size);
+    }
+    return len;
+}
+
+int net_loop_split(net_loop_endpoint_t *ep, int count, net_loop_steer_fn steer, void *arg,
+                   net_link_ops_t *ops) {
+    if (count <= 0 || !steer || ep->queues) {
+        return -1;
+    }
+
+    net_loop_queue_t *queues = calloc((size_t)count, sizeof(net_loop_queue_t));
+    if (!queues) {
+        return -1;
+    }
+    for (int i = 0; i < count; i++) {
+        queues[i].ep = ep;
+        queues[i].ring = net_loop_ring_create(ep->cfg.ring_size);
+        if (!queues[i].ring) {
+            goto fail;
+        }
+    }
+
+    // 全部队列创建成功后才修改ep和ops, 失败时端点保持未拆分, 可以重试
+    for (int i = 0; i < count; i++) {
+        ops[i].send = net_loop_queue_send;
+        ops[i].receive = net_loop_queue_receive;
+        ops[i].ctx = &queues[i];
+    }
+    ep->queues = queues;
+    ep->steer = steer;
+    ep->steer_arg = arg;
+    ep->queue_count = count;
+    return 0;
+
+fail:
+    for (int i = 0; i < count; i++) {
+        net_loop_ring_destroy(queues[i].ring);
+    }
+    free(queues);
+    return -1;
+}
@@ -0,0 +1,117 @@
+#include "net_pbuf.h"
+#include <string.h>
+
+#if NET_USE_ASYNC_TASK
+static inline void net_pbuf_lock(net_pbuf_pool_t *pool) {
+    net_sem_wait(pool->mutex);
+}
+
+static inline void net_pbuf_unlock(net_pbuf_pool_t *pool) {
+    net_sem_post(pool->mutex);
+}
+#else
+static inline void net_pbuf_lock(net_pbuf_pool_t *pool) {
+}
+
+static inline void net_pbuf_unlock(net_pbuf_pool_t *pool) {
+}
+#endif
+
+int net_pbuf_pool_init(net_pbuf_pool_t *pool) {
+    if (pool->initialized) {
+        return 0;
+    }
+
+#if NET_USE_ASYNC_TASK
+    // 信号量作为互斥锁使用, 初始可获取
+    pool->mutex = net_create_sem();
+    if (!pool->mutex) {
+        NET_LOGE("Failed to create pbuf mutex");
+        return -1;
+    }
+    net_sem_post(pool->mutex);
+#endif
+
+    pool->free = NULL;
+    for (int i = 0; i < NET_PBUF_POOL_SIZE; i++) {
+        net_pbuf_t *p = &pool->slots[i].pbuf;
+        p->buf = pool->slots[i].mem;
+        p->size = NET_PBUF_BUF_SIZE;
+        p->flags = NET_PBUF_FLAG_POOL;
+        p->pool = pool;
+        p->next = pool->free;
+        pool->free = p;
+    }
+    pool->initialized = true;
+
+    return 0;
+}
+
+void net_pbuf_pool_deinit(net_pbuf_pool_t *pool) {
+    if (!pool->initialized) {
+        return;
+    }
+
+#if NET_USE_ASYNC_TASK
+    net_sem_destroy(pool->mutex);
+    pool->mutex = NULL;
+#endif
+    pool->free = NULL;
+    pool->initialized = false;
+}
+
+net_pbuf_t *net_pbuf_alloc(net_pbuf_pool_t *pool, size_t len) {
+    if (len > NET_PBUF_BUF_SIZE - NET_UDP_HEADROOM) {
+        NET_LOGE("pbuf too large: %zu", len);
+        return NULL;
+    }
+
+    if (!pool->initialized) {
+        NET_LOGE("pbuf pool not initialized");
+        return NULL;
+    }
+
+    net_pbuf_lock(pool);
+    net_pbuf_t *p = pool->free;
+    if (p) {
+        pool->free = p->next;
+    }
+    net_pbuf_unlock(pool);
+
+    if (!p) {
+        NET_LOGE("pbuf pool exhausted");
+        return NULL;
+    }
+
+    p->next = NULL;
+    p->payload = p->buf + NET_UDP_HEADROOM;
+    p->len = len;
+    return p;
+}
+
+void net_pbuf_free(net_pbuf_t *p) {
+    if (p && (p->flags & NET_PBUF_FLAG_CUSTOM)) {
+        p->custom_free(p);
+        return;
+    }
+    if (!p || !(p->flags & NET_PBUF_FLAG_POOL)) {
+        return;
+    }
+
+    net_pbuf_pool_t *pool = p->pool;
+    net_pbuf_lock(pool);
+    p->next = pool->free;
+    pool->free = p;
+    net_pbuf_unlock(pool);
+}
+
+void net_pbuf_init(net_pbuf_t *p, uint8_t *buf, size_t size, size_t headroom) {
+    p->next = NULL;
+    p->buf = buf;
+    p->size = size;
+    p->payload = buf + headroom;
+    p->len = 0;
+    p->flags = 0;
+    p->custom_free = NULL;
+    p->pool = NULL;
+}
@@ -1,6 +1,7 @@
 #include "net_wrapper.h"
 #include "net_device.h"
 #include <string.h>
+#include <stdlib.h>
 #include <stdbool.h>
 
 // 以太网类型 (假设使用IPv4)
@@ -12,22 +13,68 @@
 // ARP类型
 #define ETH_TYPE_ARP 0x0806
 
-// 网络状态
-typedef struct {
-    net_config_t config;
-    bool initialized;
-    uint16_t next_local_port;
+// ARP操作码和硬件类型(以太网)
+#define ARP_REQUEST     1
+#define ARP_REPLY       2
+#define ARP_HW_ETHER    1
+
+// 以太网最小帧长(不含FCS), ARP帧需要填充到此长度
+#define ETH_FRAME_MIN   60
+
+// IP分片字段
+#define IP_FLAG_MF      0x2000
+#define IP_OFFSET_MASK  0x1FFF
+
+// 每个分片携带的IP数据长度, 除最后一片外必须是8的倍数
+#define NET_IP_FRAG_SIZE    ((NET_MTU_MAX - 14 - 20) & ~7u)
 
-    net_device_t net_device;
-} net_wrapper_t;
-static net_wrapper_t g_net_wraper = {0};
+// 默认协议栈, 各接口的stack参数为NULL时使用
+static net_stack_t g_net_stack;
+
+static inline net_stack_t *net_stack_get(net_stack_t *stack) {
+    return stack ? stack : &g_net_stack;
+}
 
 #if NET_USE_ASYNC_TASK
-static void *net_task = NULL;
-static void *net_sem = NULL;
+// 平台层需提供带超时的信号量等待: 获取成功返回0, 超时返回负值
+extern int net_sem_wait_timeout(void *sem, uint32_t timeout_ms);
+
+// 使用net_device的实例, 设备的接收回调没有上下文参数, 收到数据时全部唤醒
+static net_stack_t *g_device_stacks = NULL;
+#endif
+
+static int net_rx_dispatch(net_stack_t *stack, int budget);
+static net_socket_t *net_socket_get(net_stack_t *stack, uint16_t port);
+
+// socket表锁, 只有异步接收时存在并发
+#if NET_USE_ASYNC_TASK
+static inline void net_lock(net_stack_t *stack) {
+    net_sem_wait(stack->mutex);
+}
+
+static inline void net_lock_release(net_stack_t *stack) {
+    net_sem_post(stack->mutex);
+}
+#else
+static inline void net_lock(net_stack_t *stack) {
+}
+
+static inline void net_lock_release(net_stack_t *stack) {
+}
+#endif
+
+// 使用替换的链路后端时, 接收任务按此间隔轮询(后端可能带有时延)
+#ifndef NET_LINK_POLL_MS
+#define NET_LINK_POLL_MS        1
 #endif
 
-static net_device_t g_net_device = {0};
+// 使用net_device时接收任务的最长等待, 防止错过唤醒或链路被替换后一直阻塞
+#ifndef NET_DEVICE_POLL_MS
+#define NET_DEVICE_POLL_MS      100
+#endif
+
+// 统计计数, 发送方和接收任务可能并发更新
+#define NET_STAT_ADD(stack, field, n)  __atomic_fetch_add(&(stack)->stats.field, (n), __ATOMIC_RELAXED)
 
 // IP头结构
 typedef struct {
@@ -50,21 +97,55 @@ typedef struct {
     uint16_t eth_type;
 } eth_header_t;
 
+_Static_assert(sizeof(eth_header_t) + sizeof(ip_header_t) + sizeof(udp_header_t) == NET_UDP_HEADROOM,
+               "NET_UDP_HEADROOM mismatch");
+
+// ARP报文(以太网/IPv4), IP地址字段不是4字节对齐, 按字节访问
+typedef struct {
+    uint16_t hw_type;
+    uint16_t proto_type;
+    uint8_t hw_len;
+    uint8_t proto_len;
+    uint16_t opcode;
+    uint8_t sender_mac[6];
+    uint8_t sender_ip[4];
+    uint8_t target_mac[6];
+    uint8_t target_ip[4];
+} arp_header_t;
+
+_Static_assert(sizeof(arp_header_t) == 28, "arp_header_t must be packed");
+
+// 邻居表项状态
+enum {
+    NET_ARP_FREE = 0,
+    NET_ARP_INCOMPLETE,     // 已发送请求, 等待应答
+    NET_ARP_REACHABLE,      // 已解析
+};
+
+#if NET_IP_REASS_MAX > 0
+// 分片重组表项状态, 只有接收方修改, 完成的数据报由读取方释放时归还
+enum {
+    IP_REASS_FREE = 0,
+    IP_REASS_ACTIVE,        // 正在接收分片
+    IP_REASS_DELIVERED,     // 已交给socket, 等待读取方释放
+};
+#endif
+
 static void net_input(uint8_t *buffer, size_t length)
 {
     NET_LOGD("net input %zu bytes", length);
 
 #if NET_USE_ASYNC_TASK
-    net_sem_post(net_sem);
+    for (net_stack_t *stack = __atomic_load_n(&g_device_stacks, __ATOMIC_ACQUIRE);
+         stack; stack = stack->device_next) {
+        net_sem_post(stack->sem);
+    }
 #endif
 }
 
 static void net_output(uint8_t *buffer, size_t length)
 {
     NET_LOGD("net output %zu bytes", length);
-#if NET_USE_ASYNC_TASK
-    net_sem_post(net_sem);
-#endif
 }
 
 static net_device_ops_t net_device_ops = {
@@ -72,30 +153,10 @@ static net_device_ops_t net_device_ops = {
     .rx_callback = net_input
 };
 
-// 计算IP校验和
-static uint16_t ip_checksum(const void *data, size_t length) {
-    uint32_t sum = 0;
-    const uint16_t *ptr = data;
-    
-    for (; length > 1; length -= 2) {
-        sum += *ptr++;
-    }
-    
-    if (length > 0) {
-        sum += *(uint8_t *)ptr;
-    }
-    
-    while (sum >> 16) {
-        sum = (sum & 0xFFFF) + (sum >> 16);
-    }
-    
-    return ~sum;
-}
-
 static int eth_input(uint8_t *data) {
     eth_header_t *eth = (eth_header_t *)data;
     if (ntohs(eth->eth_type) != ETH_TYPE_IPV4) {
-        NET_LOGW("Not an IPv4 packet");
+        NET_LOGW_RATELIMIT("Not an IPv4 packet");
         return -1; // 不是IP包
     }
 
@@ -105,7 +166,7 @@ static int eth_input(uint8_t *data) {
 static int udp_input(uint8_t *data) {
     ip_header_t *ip = (ip_header_t *)(data + sizeof(eth_header_t));
     if (ip->protocol != IP_PROTO_UDP) {
-        NET_LOGW("Not a UDP packet");
+        NET_LOGW_RATELIMIT("Not a UDP packet");
         return -1; // 不是UDP包
     }
 
@@ -129,168 +190,1388 @@ static void net_dev_callback(NET_MSG_TYPE msg_type, void *userdata, uint8_t *dat
     }
 }
 
+// 发送一帧到链路
+static inline int net_link_send(net_stack_t *stack, uint8_t *frame, size_t len) {
+    if (stack->link.send) {
+        return stack->link.send(stack->link.ctx, frame, len);
+    }
+    return net_send(&stack->net_device, frame, len);
+}
+
+// 从链路取出一帧, 没有数据返回0
+static inline int net_link_receive(net_stack_t *stack, uint8_t *buf, size_t size) {
+    if (stack->link.receive) {
+        return stack->link.receive(stack->link.ctx, buf, size);
+    }
+    return net_receive_pool(&stack->net_device, buf, size);
+}
+
 #if NET_USE_ASYNC_TASK
 static void net_thread_entry(void *arg)
 {
+    net_stack_t *stack = (net_stack_t *)arg;
+
     while (1)
     {
-        net_sem_wait(net_sem);
-        NET_LOGD("new data");
+        // 替换的链路后端不产生接收中断, 定时轮询; 设备收到数据时由rx_callback唤醒
+        // 都带超时, 链路在等待期间被替换时最迟在超时后按新的链路接收
+        net_sem_wait_timeout(stack->sem, __atomic_load_n(&stack->link.receive, __ATOMIC_RELAXED) ?
+                                         NET_LINK_POLL_MS : NET_DEVICE_POLL_MS);
+
+        // 持有链路锁接收, net_stack_set_link返回后不会再访问旧的链路
+        net_sem_wait(stack->link_mutex);
+        while (net_rx_dispatch(stack, NET_SOCKET_QUEUE_LEN) > 0) {
+        }
+        net_sem_post(stack->link_mutex);
     }
 }
 
-static int net_async_init(void)
+// 释放已创建的信号量
+static void net_async_release(net_stack_t *stack)
 {
-    net_sem = net_create_sem();
-    if (!net_sem) {
-        NET_LOGE("Failed to create semaphore");
-        return -1;
+    if (stack->mutex) net_sem_destroy(stack->mutex);
+    if (stack->link_mutex) net_sem_destroy(stack->link_mutex);
+    if (stack->sem) net_sem_destroy(stack->sem);
+    if (stack->rx_event) net_sem_destroy(stack->rx_event);
+    stack->mutex = stack->link_mutex = stack->sem = stack->rx_event = NULL;
+}
+
+// 创建锁和事件, 接收任务在初始化的最后一步启动
+static int net_async_init(net_stack_t *stack)
+{
+    // 信号量作为互斥锁使用, 初始可获取
+    stack->mutex = net_create_sem();
+    stack->link_mutex = net_create_sem();
+    if (!stack->mutex || !stack->link_mutex) {
+        NET_LOGE("Failed to create mutex");
+        goto fail;
     }
-    net_task = net_create_task(net_thread_entry, NULL);
-    if (!net_task) {
-        NET_LOGE("Failed to create task");
-        net_sem_destroy(net_sem);
-        return -1;
+    net_sem_post(stack->mutex);
+    net_sem_post(stack->link_mutex);
+
+    stack->sem = net_create_sem();
+    stack->rx_event = net_create_sem();
+    if (!stack->sem || !stack->rx_event) {
+        NET_LOGE("Failed to create semaphore");
+        goto fail;
     }
     return 0;
+
+fail:
+    net_async_release(stack);
+    return -1;
+}
+
+// 加入设备唤醒链表, 实例不会被移除
+static void net_device_register(net_stack_t *stack)
+{
+    stack->device_next = __atomic_load_n(&g_device_stacks, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&g_device_stacks, &stack->device_next, stack, false,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+    }
 }
 #endif
 
-// 初始化网络封装层
-int net_wrapper_init(net_config_t *config) {
+// 初始化协议栈实例
+int net_stack_init(net_stack_t *stack, const net_config_t *config, const net_link_ops_t *link) {
     if (!config) return -1;
 
-    memset(&g_net_wraper, 0, sizeof(net_wrapper_t));
+    stack = net_stack_get(stack);
+    if (stack->initialized) {
+        NET_LOGE("net stack already initialized");
+        return -1;
+    }
 
-    memcpy(&g_net_wraper.config, config, sizeof(net_config_t));
-    g_net_wraper.initialized = true;
-    g_net_wraper.next_local_port = 49152; // 从动态端口范围开始
+    memset(stack, 0, sizeof(*stack));
+    memcpy(&stack->config, config, sizeof(net_config_t));
+    net_stack_set_port_range(stack, 0, 0);
+    if (link) {
+        stack->link = *link;
+    }
+
+    if (net_pbuf_pool_init(&stack->pool) < 0) {
+        return -1;
+    }
 
 #if NET_USE_ASYNC_TASK
-    if (net_async_init() < 0) {
+    if (net_async_init(stack) < 0) {
         NET_LOGE("Failed to initialize async task");
-        return -1;
+        goto fail;
+    }
+#endif
+
+    // 替换的链路后端不需要初始化设备
+    if (!stack->link.send) {
+        stack->net_device.ops = net_device_ops;
+        stack->net_device.userdata = stack;
+        stack->net_device.callback = net_dev_callback;
+        if (net_init(&stack->net_device) < 0) {
+            NET_LOGE("Failed to initialize net device");
+            goto fail;
+        }
+    }
+
+#if NET_USE_ASYNC_TASK
+    // 任务无法停止, 最后创建; 成功后才加入设备唤醒链表, 失败时无需撤销
+    // 加入链表前到达的帧由任务的定时轮询取出
+    stack->task = net_create_task(net_thread_entry, stack);
+    if (!stack->task) {
+        NET_LOGE("Failed to create task");
+        goto fail;
+    }
+    if (!stack->link.send) {
+        net_device_register(stack);
     }
 #endif
 
-    g_net_wraper.net_device.ops = net_device_ops;
-    g_net_wraper.net_device.userdata = &g_net_wraper;
-    g_net_wraper.net_device.callback = net_dev_callback;
+    stack->initialized = true;
+    return 0;
+
+fail:
+#if NET_USE_ASYNC_TASK
+    net_async_release(stack);
+#endif
+    net_pbuf_pool_deinit(&stack->pool);
+    return -1;
+}
+
+// 初始化默认协议栈
+int net_wrapper_init(net_config_t *config) {
+    return net_stack_init(NULL, config, NULL);
+}
+
+void net_stack_set_link(net_stack_t *stack, const net_link_ops_t *link) {
+    stack = net_stack_get(stack);
+#if NET_USE_ASYNC_TASK
+    // 等待接收任务结束当前一轮接收
+    if (stack->task) {
+        net_sem_wait(stack->link_mutex);
+    }
+#endif
+    if (link) {
+        stack->link = *link;
+    } else {
+        memset(&stack->link, 0, sizeof(stack->link));
+    }
+#if NET_USE_ASYNC_TASK
+    if (stack->task) {
+        net_sem_post(stack->link_mutex);
+        net_sem_post(stack->sem); // 立即按新的链路接收
+    }
+#endif
+}
+
+void net_stack_set_idle_hook(net_stack_t *stack, net_idle_hook_t hook, void *arg) {
+    stack = net_stack_get(stack);
+    stack->idle_arg = arg;
+    stack->idle_hook = hook;
+}
+
+net_pbuf_t *udp_pbuf_alloc(net_stack_t *stack, size_t len) {
+    return net_pbuf_alloc(&net_stack_get(stack)->pool, len);
+}
+
+void net_stack_set_port_range(net_stack_t *stack, uint16_t min, uint16_t max) {
+    stack = net_stack_get(stack);
+    if (min == 0 || max < min) {
+        min = 49152; // 动态端口范围
+        max = 65535;
+    }
+    stack->port_min = min;
+    stack->port_max = max;
+    __atomic_store_n(&stack->next_local_port, min, __ATOMIC_RELAXED);
+}
+
+uint16_t udp_alloc_port(net_stack_t *stack) {
+    stack = net_stack_get(stack);
+    uint16_t port = __atomic_load_n(&stack->next_local_port, __ATOMIC_RELAXED);
+    uint16_t next;
     
-    return net_init(&g_net_wraper.net_device);
+    do {
+        next = port >= stack->port_max || port < stack->port_min ? stack->port_min : port + 1;
+    } while (!__atomic_compare_exchange_n(&stack->next_local_port, &port, next, true,
+                                          __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    return port;
 }
 
 // 发送UDP数据包
-int udp_send(uint32_t dest_ip, uint16_t src_port, uint16_t dest_port, 
+int udp_send(net_stack_t *stack, uint32_t dest_ip, uint16_t src_port, uint16_t dest_port, 
             const uint8_t *data, size_t length) {
-    if (!g_net_wraper.initialized) {
-        NET_LOGE("net warper not initialized");
+    net_iovec_t iov = { .base = data, .len = length };
+    return udp_sendv(stack, dest_ip, src_port, dest_port, &iov, 1);
+}
+
+// 发送多段UDP数据包
+int udp_sendv(net_stack_t *stack, uint32_t dest_ip, uint16_t src_port, uint16_t dest_port,
+              const net_iovec_t *iov, int iovcnt) {
+    stack = net_stack_get(stack);
+    size_t length = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        length += iov[i].len;
+    }
+    
+    if (length > NET_UDP_SEND_MAX) {
+        NET_LOGE("UDP datagram too large: %zu", length);
+        return -1;
+    }
+    
+    // 一帧能容纳时使用缓冲池, 否则临时分配整个数据报的缓冲, 由udp_send_batch分片
+    net_pbuf_t large;
+    uint8_t *mem = NULL;
+    net_pbuf_t *p;
+    if (length <= NET_PBUF_BUF_SIZE - NET_UDP_HEADROOM) {
+        p = net_pbuf_alloc(&stack->pool, length);
+        if (!p) {
+            return -1;
+        }
+    } else {
+        mem = NET_MALLOC(NET_UDP_HEADROOM + length);
+        if (!mem) {
+            return -1;
+        }
+        p = &large;
+        net_pbuf_init(p, mem, NET_UDP_HEADROOM + length, NET_UDP_HEADROOM);
+        p->len = length;
+    }
+    
+    // 数据: 各段直接写入帧中, 不经过中间缓冲
+    uint8_t *ptr = p->payload;
+    for (int i = 0; i < iovcnt; i++) {
+        if (iov[i].len > 0) {
+            memcpy(ptr, iov[i].base, iov[i].len);
+            ptr += iov[i].len;
+        }
+    }
+    
+    int ret = udp_send_pbuf(stack, dest_ip, src_port, dest_port, p);
+    if (mem) {
+        NET_FREE(mem);
+    } else {
+        net_pbuf_free(p);
+    }
+    return ret;
+}
+
+// 发送pbuf中的UDP数据
+int udp_send_pbuf(net_stack_t *stack, uint32_t dest_ip, uint16_t src_port, uint16_t dest_port,
+                  net_pbuf_t *p) {
+    return udp_send_batch(stack, dest_ip, src_port, dest_port, &p, 1) == 1 ? 0 : -1;
+}
+
+static inline uint32_t net_arp_hash(uint32_t ip) {
+    return (ip * 2654435761u) >> (32 - NET_ARP_TABLE_BITS);
+}
+
+// 查找邻居表项, 调用方需持有锁
+// create为true时未找到则占用探测范围内的空闲表项, 没有空闲表项时替换最久未更新的表项
+static net_arp_entry_t *net_arp_find(net_stack_t *stack, uint32_t ip, bool create, uint32_t now) {
+    net_arp_entry_t *victim = NULL;
+    uint32_t h = net_arp_hash(ip);
+    
+    for (uint32_t i = 0; i < NET_ARP_PROBE; i++) {
+        net_arp_entry_t *e = &stack->arp_table[(h + i) & (NET_ARP_TABLE_SIZE - 1)];
+        if (e->state == NET_ARP_FREE) {
+            victim = e; // 表项不会被释放, 之后的位置不会有该地址
+            break;
+        }
+        if (e->ip == ip) {
+            return e;
+        }
+        if (!victim || now - e->updated_ms > now - victim->updated_ms) {
+            victim = e;
+        }
+    }
+    
+    if (!create) {
+        return NULL;
+    }
+    
+    memset(victim, 0, sizeof(*victim));
+    victim->ip = ip;
+    victim->state = NET_ARP_INCOMPLETE;
+    victim->updated_ms = now;
+    victim->request_ms = now - NET_ARP_REQUEST_INTERVAL_MS; // 立即发送请求
+    return victim;
+}
+
+// 取得下一跳的MAC, 调用方需持有锁; *expire_ms为结果的有效期限
+// 未解析时填写广播地址并返回-1, 解析完成前数据仍以广播发送, 不丢弃也不缓存;
+// 需要发送ARP请求时*request为true
+static int net_arp_resolve(net_stack_t *stack, uint32_t ip, uint8_t *mac, uint32_t now,
+                           uint32_t *expire_ms, bool *request) {
+    net_arp_entry_t *e = net_arp_find(stack, ip, true, now);
+    
+    *request = false;
+    if (e->state == NET_ARP_REACHABLE && now - e->updated_ms < NET_ARP_MAX_AGE_MS) {
+        memcpy(mac, e->mac, 6);
+        *expire_ms = e->updated_ms + NET_ARP_MAX_AGE_MS;
+        return 0;
+    }
+    
+    e->state = NET_ARP_INCOMPLETE;
+    if (now - e->request_ms >= NET_ARP_REQUEST_INTERVAL_MS) {
+        e->request_ms = now;
+        *request = true;
+    }
+    memset(mac, 0xFF, 6);
+    *expire_ms = e->request_ms + NET_ARP_REQUEST_INTERVAL_MS;
+    return -1;
+}
+
+// 记录对方的MAC, create为false时只更新已有表项
+static void net_arp_update(net_stack_t *stack, uint32_t ip, const uint8_t *mac, bool create) {
+    uint32_t now = net_get_time_ms();
+    
+    if (ip == 0 || ip == stack->config.ip_addr) {
+        return;
+    }
+    
+    net_lock(stack);
+    net_arp_entry_t *e = net_arp_find(stack, ip, create, now);
+    if (e) {
+        if (e->state != NET_ARP_REACHABLE || memcmp(e->mac, mac, 6) != 0) {
+            stack->arp_gen++;
+        }
+        memcpy(e->mac, mac, 6);
+        e->state = NET_ARP_REACHABLE;
+        e->updated_ms = now;
+    }
+    net_lock_release(stack);
+}
+
+// 发送ARP请求(广播)或应答(单播给请求方)
+static void net_arp_send(net_stack_t *stack, uint16_t opcode, const uint8_t *dst_mac,
+                         uint32_t target_ip) {
+    uint8_t frame[ETH_FRAME_MIN] = {0};
+    eth_header_t *eth = (eth_header_t *)frame;
+    arp_header_t *arp = (arp_header_t *)(frame + sizeof(eth_header_t));
+    
+    if (dst_mac) {
+        memcpy(eth->dst_mac, dst_mac, 6);
+        memcpy(arp->target_mac, dst_mac, 6);
+    } else {
+        memset(eth->dst_mac, 0xFF, 6);
+    }
+    memcpy(eth->src_mac, stack->config.mac_addr, 6);
+    eth->eth_type = htons(ETH_TYPE_ARP);
+    
+    arp->hw_type = htons(ARP_HW_ETHER);
+    arp->proto_type = htons(ETH_TYPE_IPV4);
+    arp->hw_len = 6;
+    arp->proto_len = 4;
+    arp->opcode = htons(opcode);
+    memcpy(arp->sender_mac, stack->config.mac_addr, 6);
+    memcpy(arp->sender_ip, &stack->config.ip_addr, 4);
+    memcpy(arp->target_ip, &target_ip, 4);
+    
+    if (net_link_send(stack, frame, sizeof(frame)) < 0) {
+        NET_STAT_ADD(stack, tx_errors, 1);
+    } else {
+        NET_STAT_ADD(stack, tx_arp, 1);
+    }
+}
+
+// 处理收到的ARP帧, 格式错误返回-1
+static int arp_input(net_stack_t *stack, const uint8_t *frame, size_t len) {
+    if (len < sizeof(eth_header_t) + sizeof(arp_header_t)) {
         return -1;
     }
     
-    // 分配缓冲区: 以太网头 + IP头 + UDP头 + 数据
-    uint8_t packet[sizeof(eth_header_t) + sizeof(ip_header_t) + sizeof(udp_header_t) + length];
-    uint8_t *ptr = packet;
+    const arp_header_t *arp = (const arp_header_t *)(frame + sizeof(eth_header_t));
+    if (arp->hw_type != htons(ARP_HW_ETHER) || arp->proto_type != htons(ETH_TYPE_IPV4) ||
+        arp->hw_len != 6 || arp->proto_len != 4) {
+        return -1;
+    }
+    NET_STAT_ADD(stack, rx_arp, 1);
+    
+    uint32_t sender_ip, target_ip;
+    memcpy(&sender_ip, arp->sender_ip, 4);
+    memcpy(&target_ip, arp->target_ip, 4);
+    bool for_us = target_ip == stack->config.ip_addr;
+    
+    // 合并发送方地址(RFC 826): 已有表项总是更新, 询问本机时新建表项, 对方随后会发来数据
+    net_arp_update(stack, sender_ip, arp->sender_mac, for_us);
     
-    // 1. 以太网头
-    eth_header_t *eth = (eth_header_t *)ptr;
-    memset(eth->dst_mac, 0xFF, 6); // 广播地址(简化实现)
-    memcpy(eth->src_mac, g_net_wraper.config.mac_addr, 6);
+    if (for_us && arp->opcode == htons(ARP_REQUEST)) {
+        net_arp_send(stack, ARP_REPLY, arp->sender_mac, sender_ip);
+    }
+    return 0;
+}
+
+// 构建流的包头模板, 长度、ID和校验和字段为0; 调用方需持有锁
+// 返回需要发送ARP请求的下一跳地址, 不需要时返回0
+static uint32_t net_flow_build(net_stack_t *stack, net_flow_t *flow, uint32_t dest_ip,
+                               uint16_t src_port, uint16_t dest_port, uint32_t now) {
+    const net_config_t *cfg = &stack->config;
+    uint32_t arp_ip = 0;
+    eth_header_t *eth = (eth_header_t *)flow->header;
+    ip_header_t *ip = (ip_header_t *)(flow->header + sizeof(eth_header_t));
+    udp_header_t *udp = (udp_header_t *)(flow->header + sizeof(eth_header_t) + sizeof(ip_header_t));
+    
+    memset(flow->header, 0, sizeof(flow->header));
+    flow->expires = false;
+    
+    // 以太网头
+    bool multicast = net_ip_is_multicast(dest_ip);
+    if (multicast) {
+        // 多播MAC: 01:00:5e + 组地址低23位(RFC 1112)
+        const uint8_t *group = (const uint8_t *)&dest_ip;
+        eth->dst_mac[0] = 0x01;
+        eth->dst_mac[1] = 0x00;
+        eth->dst_mac[2] = 0x5E;
+        eth->dst_mac[3] = group[1] & 0x7F;
+        eth->dst_mac[4] = group[2];
+        eth->dst_mac[5] = group[3];
+    } else if (dest_ip == cfg->ip_addr) {
+        memcpy(eth->dst_mac, cfg->mac_addr, 6); // 发给本机
+    } else if (dest_ip == 0xFFFFFFFF || dest_ip == (cfg->ip_addr | ~cfg->netmask)) {
+        memset(eth->dst_mac, 0xFF, 6); // 广播地址
+    } else {
+        // 子网外的地址经网关转发, 解析下一跳的MAC
+        uint32_t next_hop = dest_ip;
+        if (((dest_ip ^ cfg->ip_addr) & cfg->netmask) != 0 && cfg->gateway != 0) {
+            next_hop = cfg->gateway;
+        }
+        
+        bool request;
+        net_arp_resolve(stack, next_hop, eth->dst_mac, now, &flow->expire_ms, &request);
+        flow->expires = true;
+        if (request) {
+            arp_ip = next_hop;
+        }
+    }
+    memcpy(eth->src_mac, stack->config.mac_addr, 6);
     eth->eth_type = htons(ETH_TYPE_IPV4);
-    ptr += sizeof(eth_header_t);
     
-    // 2. IP头
-    ip_header_t *ip = (ip_header_t *)ptr;
+    // IP头
     ip->ver_ihl = 0x45; // IPv4, 5字(20字节)头部
-    ip->tos = 0;
-    ip->total_length = htons(sizeof(ip_header_t) + sizeof(udp_header_t) + length);
-    ip->id = 0;
-    ip->flags_frag = 0;
-    ip->ttl = 64;
+    ip->ttl = multicast ? NET_MCAST_TTL : 64;
     ip->protocol = IP_PROTO_UDP;
-    ip->src_ip = g_net_wraper.config.ip_addr;
+    ip->src_ip = stack->config.ip_addr;
     ip->dst_ip = dest_ip;
-    ip->checksum = 0;
-    ip->checksum = ip_checksum(ip, sizeof(ip_header_t));
-    ptr += sizeof(ip_header_t);
+    flow->ip_sum = net_checksum_add(0, ip, sizeof(ip_header_t));
     
-    // 3. UDP头
-    udp_header_t *udp = (udp_header_t *)ptr;
+    // UDP头, 长度和校验和逐包填写
     udp->src_port = htons(src_port);
     udp->dst_port = htons(dest_port);
-    udp->length = htons(sizeof(udp_header_t) + length);
-    udp->checksum = 0; // 可选，简化实现不计算
-    ptr += sizeof(udp_header_t);
     
-    // 4. 数据
-    memcpy(ptr, data, length);
+    // 伪首部: 源/目的地址、协议号和UDP长度, 长度与UDP头中的长度字段逐包加入
+    flow->udp_sum = net_checksum_add(0, &ip->src_ip, 8) + htons(IP_PROTO_UDP) +
+                    udp->src_port + udp->dst_port;
     
-    // 发送整个数据包
-    return net_send(&g_net_wraper.net_device, packet, sizeof(packet));
+    flow->dst_ip = dest_ip;
+    flow->src_port = src_port;
+    flow->dst_port = dest_port;
+    flow->arp_gen = stack->arp_gen;
+    flow->valid = true;
+    return arp_ip;
 }
 
-// 接收UDP数据包(非阻塞)
-int udp_receive(uint32_t *src_ip, uint16_t *src_port, uint16_t *dst_port,
-               uint8_t *buffer, size_t buf_size, int timeout_ms) {
-    if (!g_net_wraper.initialized) {
+// 取得流的包头模板副本, 未命中、邻居表变化或解析结果过期时重建缓存项
+static void net_flow_get(net_stack_t *stack, net_flow_t *out, uint32_t dest_ip,
+                         uint16_t src_port, uint16_t dest_port) {
+    uint32_t key = dest_ip ^ ((uint32_t)src_port << 16 | dest_port);
+    net_flow_t *flow = &stack->flow_cache[(key * 2654435761u) >> 16 & (NET_FLOW_CACHE_SIZE - 1)];
+    uint32_t arp_ip = 0;
+    
+    net_lock(stack);
+    bool stale = !flow->valid || flow->dst_ip != dest_ip ||
+                 flow->src_port != src_port || flow->dst_port != dest_port ||
+                 flow->arp_gen != stack->arp_gen;
+    // 只有经邻居表解析的流需要读取时间
+    if (!stale && flow->expires) {
+        stale = (int32_t)(net_get_time_ms() - flow->expire_ms) >= 0;
+    }
+    if (stale) {
+        arp_ip = net_flow_build(stack, flow, dest_ip, src_port, dest_port, net_get_time_ms());
+    }
+    memcpy(out, flow, sizeof(*out));
+    net_lock_release(stack);
+    
+    if (arp_ip) {
+        net_arp_send(stack, ARP_REQUEST, NULL, arp_ip);
+    }
+}
+
+// 在模板的反码和上加入长度、ID和分片字段(RFC 1624增量更新), 返回IP头校验和
+static inline uint16_t ip_checksum_patch(uint32_t sum, uint16_t total_length, uint16_t id,
+                                         uint16_t flags_frag) {
+    return net_checksum_finish(sum + total_length + id + flags_frag);
+}
+
+#if NET_UDP_CHECKSUM
+// 在模板的反码和上加入两处长度和数据, 返回UDP校验和; 结果为0时发送0xFFFF(RFC 768)
+static inline uint16_t udp_checksum_patch(uint32_t sum, uint16_t udp_length,
+                                          const uint8_t *data, size_t len) {
+    uint16_t check = net_checksum_finish(net_checksum_add(sum + udp_length * 2u, data, len));
+    return check ? check : 0xFFFF;
+}
+#endif
+
+// 按IP分片发送一个数据报, frame为包头已填写的完整帧, ip_len为IP数据长度
+// 第一片之后各分片的包头临时写在前一片数据的末尾, 发送后恢复, 数据不拷贝
+static int ip_send_fragments(net_stack_t *stack, uint8_t *frame, size_t ip_len, uint32_t ip_sum) {
+    const size_t hdr_len = sizeof(eth_header_t) + sizeof(ip_header_t);
+    uint8_t header[sizeof(eth_header_t) + sizeof(ip_header_t)];
+    uint8_t saved[sizeof(eth_header_t) + sizeof(ip_header_t)];
+    
+    memcpy(header, frame, hdr_len);
+    
+    for (size_t offset = 0; offset < ip_len; offset += NET_IP_FRAG_SIZE) {
+        size_t chunk = ip_len - offset < NET_IP_FRAG_SIZE ? ip_len - offset : NET_IP_FRAG_SIZE;
+        uint8_t *start = frame + offset;
+        
+        if (offset > 0) {
+            memcpy(saved, start, hdr_len);
+        }
+        memcpy(start, header, hdr_len);
+        
+        ip_header_t *ip = (ip_header_t *)(start + sizeof(eth_header_t));
+        ip->total_length = htons(sizeof(ip_header_t) + chunk);
+        ip->flags_frag = htons((uint16_t)(offset / 8) | (offset + chunk < ip_len ? IP_FLAG_MF : 0));
+        ip->checksum = ip_checksum_patch(ip_sum, ip->total_length, ip->id, ip->flags_frag);
+        
+        int ret = net_link_send(stack, start, hdr_len + chunk);
+        
+        if (offset > 0) {
+            memcpy(start, saved, hdr_len);
+        }
+        if (ret < 0) {
+            return -1;
+        }
+        NET_STAT_ADD(stack, tx_fragments, 1);
+    }
+    
+    return 0;
+}
+
+// 批量发送同一个流的UDP数据包
+int udp_send_batch(net_stack_t *stack, uint32_t dest_ip, uint16_t src_port, uint16_t dest_port,
+                   net_pbuf_t *const *pkts, int count) {
+    net_flow_t flow;
+    int sent = 0;
+    
+    stack = net_stack_get(stack);
+    if (!stack->initialized) {
         NET_LOGE("net warper not initialized");
         return -1;
     }
     
-    uint8_t packet[NET_MTU_MAX];
-    uint32_t start_time = net_get_time_ms(); // 需要实现获取当前时间的函数
+    net_flow_get(stack, &flow, dest_ip, src_port, dest_port);
+    uint16_t id = __atomic_fetch_add(&stack->ip_id, (uint16_t)count, __ATOMIC_RELAXED);
     
-    while (1) {
-        int ret = net_receive_pool(&g_net_wraper.net_device, packet, sizeof(packet));
-        if (ret <= 0) {
-            if (net_get_time_ms() - start_time > timeout_ms) {
-                return -1; // 超时
+    for (int i = 0; i < count; i++) {
+        net_pbuf_t *p = pkts[i];
+        size_t length = p->len;
+        
+        // 包头在payload前的保留空间内填写
+        uint8_t *hdr = net_pbuf_push(p, NET_UDP_HEADROOM);
+        if (!hdr) {
+            NET_LOGE("pbuf headroom too small");
+            break;
+        }
+        memcpy(hdr, flow.header, NET_UDP_HEADROOM);
+        
+        ip_header_t *ip = (ip_header_t *)(hdr + sizeof(eth_header_t));
+        udp_header_t *udp = (udp_header_t *)(hdr + sizeof(eth_header_t) + sizeof(ip_header_t));
+        ip->total_length = htons(sizeof(ip_header_t) + sizeof(udp_header_t) + length);
+        ip->id = htons((uint16_t)(id + i));
+        udp->length = htons(sizeof(udp_header_t) + length);
+#if NET_UDP_CHECKSUM
+        udp->checksum = udp_checksum_patch(flow.udp_sum, udp->length,
+                                           hdr + NET_UDP_HEADROOM, length);
+#endif
+        
+        // 设备层没有批量接口, 逐帧提交
+        int ret;
+        if (sizeof(udp_header_t) + length <= NET_IP_FRAG_SIZE) {
+            ip->checksum = ip_checksum_patch(flow.ip_sum, ip->total_length, ip->id, 0);
+            ret = net_link_send(stack, p->payload, p->len);
+        } else {
+            ret = ip_send_fragments(stack, hdr, sizeof(udp_header_t) + length, flow.ip_sum);
+        }
+        
+        net_pbuf_pull(p, NET_UDP_HEADROOM);
+        if (ret < 0) {
+            NET_STAT_ADD(stack, tx_errors, 1);
+            break;
+        }
+        NET_STAT_ADD(stack, tx_packets, 1);
+        NET_STAT_ADD(stack, tx_bytes, length);
+        sent++;
+    }
+    
+    return (sent == 0 && count > 0) ? -1 : sent;
+}
+
+// 解析一帧UDP数据包, 成功返回0, 通过pbuf的payload/len给出UDP数据
+// 帧位于p->payload, 长度为p->len
+static int udp_parse_frame(net_stack_t *stack, net_pbuf_t *p) {
+    if (p->len < sizeof(eth_header_t) + sizeof(ip_header_t) + sizeof(udp_header_t)) {
+        return -1;
+    }
+    
+    // 解析以太网头
+    if (eth_input(p->payload) < 0) {
+        return -1;
+    }
+    
+    // 解析IP头
+    if (udp_input(p->payload) < 0) {
+        return -1;
+    }
+    
+    ip_header_t *ip = (ip_header_t *)(p->payload + sizeof(eth_header_t));
+    // 检查目的IP是否匹配, 多播包在分发时按加入的组过滤
+    if (ip->dst_ip != stack->config.ip_addr && !net_ip_is_multicast(ip->dst_ip)) {
+        NET_LOGW_RATELIMIT("Not for us: %u.%u.%u.%u",
+               (ip->dst_ip >> 24) & 0xFF, (ip->dst_ip >> 16) & 0xFF,
+               (ip->dst_ip >> 8) & 0xFF, ip->dst_ip & 0xFF);
+        return -1; // 不是发给我们的
+    }
+    
+    // 解析UDP头
+    size_t ip_header_len = (ip->ver_ihl & 0xF) * 4;
+    udp_header_t *udp = (udp_header_t *)((uint8_t *)ip + ip_header_len);
+    size_t udp_len = ntohs(udp->length);
+    if (udp_len < sizeof(udp_header_t) ||
+        sizeof(eth_header_t) + ip_header_len + udp_len > p->len) {
+        return -1; // 长度不合法
+    }
+    
+#if NET_CHECKSUM_VERIFY
+    // IP头校验和; UDP校验和为0表示发送方未计算
+    if (ip_header_len < sizeof(ip_header_t) ||
+        net_checksum_finish(net_checksum_add(0, ip, ip_header_len)) != 0 ||
+        (udp->checksum != 0 &&
+         net_checksum_finish(net_checksum_add(net_checksum_add(0, &ip->src_ip, 8) +
+                                              htons(IP_PROTO_UDP) + udp->length,
+                                              udp, udp_len)) != 0)) {
+        NET_STAT_ADD(stack, rx_bad_checksum, 1);
+        NET_LOGW_RATELIMIT("Bad checksum from %u.%u.%u.%u",
+               ip->src_ip & 0xFF, (ip->src_ip >> 8) & 0xFF,
+               (ip->src_ip >> 16) & 0xFF, (ip->src_ip >> 24) & 0xFF);
+        return -1;
+    }
+#endif
+    
+    // 提取源信息
+    p->src_ip = ip->src_ip;
+    p->dst_ip = ip->dst_ip;
+    p->src_port = ntohs(udp->src_port);
+    p->dst_port = ntohs(udp->dst_port);
+    
+    // 提取数据
+    p->payload = (uint8_t *)udp + sizeof(udp_header_t);
+    p->len = udp_len - sizeof(udp_header_t);
+    
+    return 0;
+}
+
+static inline uint32_t net_socket_hash(uint16_t port) {
+    return (port * 2654435761u) >> (32 - NET_SOCKET_HASH_BITS);
+}
+
+// 按端口查找socket, 调用方需持有锁
+static net_socket_t *net_socket_lookup(net_stack_t *stack, uint16_t port) {
+    if (port == 0) {
+        return stack->socket_wildcard;
+    }
+    
+    for (net_socket_t *sock = stack->socket_hash[net_socket_hash(port)]; sock; sock = sock->hash_next) {
+        if (sock->port == port) {
+            return sock;
+        }
+    }
+    return NULL;
+}
+
+// 单生产者/单消费者队列: 入队方持有锁, 出队方只有端口所有者
+static bool net_socket_enqueue(net_socket_t *sock, net_pbuf_t *p) {
+    uint32_t head = sock->head;
+    uint32_t tail = __atomic_load_n(&sock->tail, __ATOMIC_ACQUIRE);
+    
+    if (head - tail >= NET_SOCKET_QUEUE_LEN) {
+        sock->drops++;
+        return false; // 队列满
+    }
+    
+    sock->queue[head % NET_SOCKET_QUEUE_LEN] = p;
+    __atomic_store_n(&sock->head, head + 1, __ATOMIC_RELEASE);
+#if NET_USE_ASYNC_TASK
+    net_sem_post(sock->sem);
+#endif
+    return true;
+}
+
+static net_pbuf_t *net_socket_dequeue(net_socket_t *sock) {
+    uint32_t tail = sock->tail;
+    uint32_t head = __atomic_load_n(&sock->head, __ATOMIC_ACQUIRE);
+    
+    if (tail == head) {
+        return NULL;
+    }
+    
+    net_pbuf_t *p = sock->queue[tail % NET_SOCKET_QUEUE_LEN];
+    __atomic_store_n(&sock->tail, tail + 1, __ATOMIC_RELEASE);
+    return p;
+}
+
+// 取出队列中最多max个数据包
+static int net_socket_dequeue_burst(net_socket_t *sock, net_pbuf_t **pkts, int max) {
+    int count = 0;
+    
+    while (count < max && (pkts[count] = net_socket_dequeue(sock)) != NULL) {
+        count++;
+    }
+    return count;
+}
+
+// 多播包交给加入该组和端口的所有成员, 第一个成员使用原缓冲, 其余成员各得一份拷贝
+// 调用方需持有锁, 返回入队的份数
+static int net_mcast_deliver(net_stack_t *stack, net_pbuf_t *p, bool *overflow) {
+    int queued = 0;
+    
+    for (int i = 0; i < NET_MCAST_MAX; i++) {
+        net_mcast_member_t *m = &stack->mcast_members[i];
+        if (!m->used || m->group != p->dst_ip || m->port != p->dst_port) {
+            continue;
+        }
+        
+        net_socket_t *sock = net_socket_lookup(stack, m->local_port);
+        if (!sock) {
+            continue;
+        }
+        
+        net_pbuf_t *q = p;
+        if (queued > 0) {
+            q = net_pbuf_alloc(&stack->pool, p->len);
+            if (!q) {
+                NET_STAT_ADD(stack, rx_no_buffer, 1);
+                continue;
+            }
+            memcpy(q->payload, p->payload, p->len);
+            q->src_ip = p->src_ip;
+            q->dst_ip = p->dst_ip;
+            q->src_port = p->src_port;
+            q->dst_port = p->dst_port;
+        }
+        
+        if (net_socket_enqueue(sock, q)) {
+            queued++;
+        } else {
+            *overflow = true;
+            if (q != p) {
+                net_pbuf_free(q);
+            }
+        }
+    }
+    
+    return queued;
+}
+
+// 把数据包交给目的端口的所有者, 没有所有者时交给通配socket
+static void net_socket_deliver(net_stack_t *stack, net_pbuf_t *p) {
+    net_socket_t *sock = NULL;
+    size_t len = p->len;
+    int queued;
+    bool overflow = false;
+    
+    net_lock(stack);
+    if (net_ip_is_multicast(p->dst_ip)) {
+        queued = net_mcast_deliver(stack, p, &overflow);
+    } else {
+        sock = net_socket_lookup(stack, p->dst_port);
+        if (!sock) {
+            sock = stack->socket_wildcard;
+        }
+        queued = sock && net_socket_enqueue(sock, p);
+        overflow = sock && !queued;
+    }
+    net_lock_release(stack);
+    
+    if (queued) {
+        NET_STAT_ADD(stack, rx_packets, queued);
+        NET_STAT_ADD(stack, rx_bytes, len * queued);
+        // 先更新序号再检查等待方, 与udp_wait的顺序相反, 保证不会错过唤醒
+        __atomic_add_fetch(&stack->rx_seq, 1, __ATOMIC_SEQ_CST);
+#if NET_USE_ASYNC_TASK
+        if (__atomic_load_n(&stack->rx_waiters, __ATOMIC_SEQ_CST)) {
+            net_sem_post(stack->rx_event);
+        }
+#endif
+    } else {
+        if (overflow) {
+            NET_STAT_ADD(stack, rx_queue_full, 1);
+            NET_LOGW_RATELIMIT("Socket %u queue full", sock ? sock->port : p->dst_port);
+        } else {
+            NET_STAT_ADD(stack, rx_no_socket, 1);
+            NET_LOGD("No socket for port %u", p->dst_port);
+        }
+        net_pbuf_free(p);
+    }
+}
+
+int udp_bind(net_stack_t *stack, uint16_t port) {
+    net_socket_t *sock = NULL;
+    int ret = 0;
+    
+    stack = net_stack_get(stack);
+    if (!stack->initialized) {
+        NET_LOGE("net warper not initialized");
+        return -1;
+    }
+    
+    net_lock(stack);
+    if (net_socket_lookup(stack, port)) {
+        net_lock_release(stack);
+        return -1; // 已被绑定
+    }
+    
+    for (int i = 0; i < NET_SOCKET_MAX; i++) {
+        if (!stack->sockets[i].used) {
+            sock = &stack->sockets[i];
+            break;
+        }
+    }
+    
+    if (sock) {
+        sock->port = port;
+        sock->head = 0;
+        sock->tail = 0;
+        sock->drops = 0;
+#if NET_USE_ASYNC_TASK
+        if (!sock->sem) {
+            sock->sem = net_create_sem();
+        }
+        if (!sock->sem) {
+            sock = NULL;
+        }
+#endif
+    }
+    
+    if (sock) {
+        sock->used = true;
+        if (port == 0) {
+            stack->socket_wildcard = sock;
+        } else {
+            uint32_t bucket = net_socket_hash(port);
+            sock->hash_next = stack->socket_hash[bucket];
+            stack->socket_hash[bucket] = sock;
+        }
+    } else {
+        ret = -1;
+    }
+    net_lock_release(stack);
+    
+    if (ret < 0) {
+        NET_LOGE("No free socket for port %u", port);
+    }
+    return ret;
+}
+
+void udp_unbind(net_stack_t *stack, uint16_t port) {
+    net_pbuf_t *p;
+    
+    stack = net_stack_get(stack);
+    if (!stack->initialized) {
+        return;
+    }
+    
+    net_lock(stack);
+    net_socket_t *sock = net_socket_lookup(stack, port);
+    if (!sock) {
+        net_lock_release(stack);
+        return;
+    }
+    
+    if (port == 0) {
+        stack->socket_wildcard = NULL;
+    } else {
+        net_socket_t **link = &stack->socket_hash[net_socket_hash(port)];
+        while (*link != sock) {
+            link = &(*link)->hash_next;
+        }
+        *link = sock->hash_next;
+    }
+    sock->hash_next = NULL;
+    sock->used = false;
+    
+    // 释放未读取的数据
+    while ((p = net_socket_dequeue(sock)) != NULL) {
+        net_pbuf_free(p);
+    }
+    net_lock_release(stack);
+}
+
+int udp_join_group(net_stack_t *stack, uint32_t group, uint16_t port, uint16_t local_port) {
+    net_mcast_member_t *slot = NULL;
+    
+    stack = net_stack_get(stack);
+    
+    if (!net_ip_is_multicast(group) || !net_socket_get(stack, local_port)) {
+        return -1;
+    }
+    
+    net_lock(stack);
+    for (int i = 0; i < NET_MCAST_MAX; i++) {
+        net_mcast_member_t *m = &stack->mcast_members[i];
+        if (m->used && m->group == group && m->port == port && m->local_port == local_port) {
+            net_lock_release(stack);
+            return 0; // 已加入
+        }
+        if (!m->used && !slot) {
+            slot = m;
+        }
+    }
+    
+    if (slot) {
+        slot->group = group;
+        slot->port = port;
+        slot->local_port = local_port;
+        slot->used = true;
+    }
+    net_lock_release(stack);
+    
+    if (!slot) {
+        NET_LOGE("No free multicast membership for port %u", port);
+        return -1;
+    }
+    return 0;
+}
+
+void udp_leave_group(net_stack_t *stack, uint32_t group, uint16_t port, uint16_t local_port) {
+    stack = net_stack_get(stack);
+    net_lock(stack);
+    for (int i = 0; i < NET_MCAST_MAX; i++) {
+        net_mcast_member_t *m = &stack->mcast_members[i];
+        if (m->used && m->group == group && m->port == port && m->local_port == local_port) {
+            m->used = false;
+        }
+    }
+    net_lock_release(stack);
+}
+
+// 是否为IPv4分片(MF置位或偏移不为0)
+static inline bool ip_is_fragment(const net_pbuf_t *p) {
+    const eth_header_t *eth = (const eth_header_t *)p->payload;
+    const ip_header_t *ip = (const ip_header_t *)(p->payload + sizeof(eth_header_t));
+    
+    return p->len >= sizeof(eth_header_t) + sizeof(ip_header_t) &&
+           eth->eth_type == htons(ETH_TYPE_IPV4) &&
+           (ip->flags_frag & htons(IP_FLAG_MF | IP_OFFSET_MASK)) != 0;
+}
+
+int net_frame_udp_port(const uint8_t *frame, size_t len) {
+    const eth_header_t *eth = (const eth_header_t *)frame;
+    const ip_header_t *ip = (const ip_header_t *)(frame + sizeof(eth_header_t));
+
+    if (len < sizeof(eth_header_t) + sizeof(ip_header_t) ||
+        eth->eth_type != htons(ETH_TYPE_IPV4) || ip->protocol != IP_PROTO_UDP) {
+        return -1;
+    }
+    if (ip->flags_frag & htons(IP_FLAG_MF | IP_OFFSET_MASK)) {
+        return 0;
+    }
+
+    size_t ip_header_len = (ip->ver_ihl & 0xF) * 4;
+    if (len < sizeof(eth_header_t) + ip_header_len + sizeof(udp_header_t)) {
+        return -1;
+    }
+    const udp_header_t *udp = (const udp_header_t *)((const uint8_t *)ip + ip_header_len);
+    return ntohs(udp->dst_port);
+}
+
+#if NET_IP_REASS_MAX > 0
+// 读取方释放重组完成的数据报时归还表项
+static void ip_reass_free(net_pbuf_t *p) {
+    net_ip_reass_t *r = (net_ip_reass_t *)p;
+    __atomic_store_n(&r->state, IP_REASS_FREE, __ATOMIC_RELEASE);
+}
+
+// 放弃正在重组的数据报
+static inline void ip_reass_drop(net_stack_t *stack, net_ip_reass_t *r) {
+    r->state = IP_REASS_FREE;
+    NET_STAT_ADD(stack, rx_reass_failed, 1);
+}
+
+// 把分片放入重组表, 数据报到齐时通过*out返回完整的帧; 分片格式错误返回-1
+// 分片的数据已拷贝, 调用方负责释放分片
+static int ip_reass_input(net_stack_t *stack, net_pbuf_t *p, net_pbuf_t **out) {
+    ip_header_t *ip = (ip_header_t *)(p->payload + sizeof(eth_header_t));
+    size_t ip_header_len = (ip->ver_ihl & 0xF) * 4;
+    size_t total_length = ntohs(ip->total_length);
+    uint16_t frag = ntohs(ip->flags_frag);
+    size_t offset = (size_t)(frag & IP_OFFSET_MASK) * 8;
+    bool more = (frag & IP_FLAG_MF) != 0;
+    
+    *out = NULL;
+    NET_STAT_ADD(stack, rx_fragments, 1);
+    
+    if (ip_header_len < sizeof(ip_header_t) || total_length < ip_header_len ||
+        sizeof(eth_header_t) + total_length > p->len) {
+        return -1;
+    }
+    size_t len = total_length - ip_header_len;
+    if (more && (len == 0 || len % 8 != 0)) {
+        return -1; // 非最后一片的长度必须是8的倍数
+    }
+    if (ip->dst_ip != stack->config.ip_addr && !net_ip_is_multicast(ip->dst_ip)) {
+        return -1;
+    }
+#if NET_CHECKSUM_VERIFY
+    if (net_checksum_finish(net_checksum_add(0, ip, ip_header_len)) != 0) {
+        NET_STAT_ADD(stack, rx_bad_checksum, 1);
+        return -1;
+    }
+#endif
+    
+    // 查找所属的数据报, 同时回收超时的表项
+    uint32_t now = net_get_time_ms();
+    net_ip_reass_t *r = NULL;
+    net_ip_reass_t *slot = NULL;
+    net_ip_reass_t *oldest = NULL;
+    for (int i = 0; i < NET_IP_REASS_MAX; i++) {
+        net_ip_reass_t *e = &stack->ip_reass[i];
+        uint8_t state = __atomic_load_n(&e->state, __ATOMIC_ACQUIRE);
+        
+        if (state == IP_REASS_ACTIVE && now - e->start_ms >= NET_IP_REASS_TIMEOUT_MS) {
+            ip_reass_drop(stack, e);
+            state = IP_REASS_FREE;
+        }
+        if (state == IP_REASS_ACTIVE) {
+            if (e->id == ip->id && e->src_ip == ip->src_ip && e->dst_ip == ip->dst_ip) {
+                r = e;
+                break;
+            }
+            if (!oldest || now - e->start_ms > now - oldest->start_ms) {
+                oldest = e;
             }
+        } else if (state == IP_REASS_FREE && !slot) {
+            slot = e;
+        }
+    }
+    
+    if (!r) {
+        // 表满时放弃最早开始的数据报, 所有表项都在等待读取时丢弃分片
+        if (!slot && oldest) {
+            ip_reass_drop(stack, oldest);
+            slot = oldest;
+        }
+        if (!slot) {
+            NET_STAT_ADD(stack, rx_reass_failed, 1);
+            return 0;
+        }
+        r = slot;
+        memset(r->map, 0, sizeof(r->map));
+        r->id = ip->id;
+        r->src_ip = ip->src_ip;
+        r->dst_ip = ip->dst_ip;
+        r->start_ms = now;
+        r->total = 0;
+        r->units = 0;
+        r->state = IP_REASS_ACTIVE;
+    }
+    
+    if (offset + len > NET_IP_REASS_SIZE) {
+        NET_LOGW_RATELIMIT("Datagram exceeds NET_IP_REASS_SIZE");
+        ip_reass_drop(stack, r);
+        return 0;
+    }
+    
+    // 最后一片确定总长度, 与已收到的分片矛盾时放弃整个数据报
+    if (!more) {
+        if (r->total && r->total != offset + len) {
+            ip_reass_drop(stack, r);
+            return -1;
+        }
+        r->total = offset + len;
+    }
+    if (r->total && offset + len > r->total) {
+        ip_reass_drop(stack, r);
+        return -1;
+    }
+    
+    // 第一片提供包头(不含IP选项), 各分片数据按偏移写入
+    uint8_t *data = r->buf + sizeof(eth_header_t) + sizeof(ip_header_t);
+    if (offset == 0) {
+        memcpy(r->buf, p->payload, sizeof(eth_header_t) + sizeof(ip_header_t));
+    }
+    memcpy(data + offset, (uint8_t *)ip + ip_header_len, len);
+    for (size_t u = offset / 8; u < (offset + len + 7) / 8; u++) {
+        if (!(r->map[u / 8] & (1u << (u % 8)))) {
+            r->map[u / 8] |= 1u << (u % 8);
+            r->units++;
+        }
+    }
+    
+    if (!r->total || r->units != (r->total + 7) / 8) {
+        return 0;
+    }
+    
+    // 到齐: 改写为未分片的IP头, 作为一帧交给UDP解析
+    ip_header_t *hdr = (ip_header_t *)(r->buf + sizeof(eth_header_t));
+    hdr->ver_ihl = 0x45;
+    hdr->total_length = htons(sizeof(ip_header_t) + r->total);
+    hdr->flags_frag = 0;
+    hdr->checksum = 0;
+    hdr->checksum = net_checksum_finish(net_checksum_add(0, hdr, sizeof(ip_header_t)));
+    
+    net_pbuf_init(&r->pbuf, r->buf, sizeof(r->buf), 0);
+    r->pbuf.len = sizeof(eth_header_t) + sizeof(ip_header_t) + r->total;
+    r->pbuf.flags = NET_PBUF_FLAG_CUSTOM;
+    r->pbuf.custom_free = ip_reass_free;
+    r->state = IP_REASS_DELIVERED;
+    NET_STAT_ADD(stack, rx_reassembled, 1);
+    *out = &r->pbuf;
+    return 0;
+}
+#else
+// 不重组时丢弃分片
+static int ip_reass_input(net_stack_t *stack, net_pbuf_t *p, net_pbuf_t **out) {
+    (void)p;
+    *out = NULL;
+    NET_STAT_ADD(stack, rx_fragments, 1);
+    NET_STAT_ADD(stack, rx_reass_failed, 1);
+    return 0;
+}
+#endif
+
+// 取出设备中已到达的帧, 解析一次后按目的端口分发, 返回取出的帧数
+static int net_rx_dispatch(net_stack_t *stack, int budget) {
+    int count = 0;
+    
+    while (count < budget) {
+        net_pbuf_t *p = net_pbuf_alloc(&stack->pool, 0);
+        if (!p) {
+            // 缓冲耗尽, 丢弃帧避免设备队列阻塞
+            if (net_link_receive(stack, stack->discard, sizeof(stack->discard)) <= 0) {
+                break;
+            }
+            NET_STAT_ADD(stack, rx_frames, 1);
+            NET_STAT_ADD(stack, rx_no_buffer, 1);
+            count++;
             continue;
         }
         
-        // 解析以太网头
-        if (eth_input(packet) < 0) {
+        int ret = net_link_receive(stack, p->buf, p->size);
+        if (ret <= 0) {
+            net_pbuf_free(p);
+            break;
+        }
+        count++;
+        NET_STAT_ADD(stack, rx_frames, 1);
+        
+        p->payload = p->buf;
+        p->len = ret;
+        
+        // ARP在接收路径上直接处理, 不进入socket队列
+        if (p->len >= sizeof(eth_header_t) &&
+            ((eth_header_t *)p->payload)->eth_type == htons(ETH_TYPE_ARP)) {
+            if (arp_input(stack, p->payload, p->len) < 0) {
+                NET_STAT_ADD(stack, rx_invalid, 1);
+            }
+            net_pbuf_free(p);
             continue;
         }
         
-        // 解析IP头
-        if (udp_input(packet) < 0) {
+        // 分片放入重组表, 数据报到齐后作为一个完整的帧继续解析
+        // 所有表项都在等待读取时分片被丢弃并计入rx_reass_failed, 接收不会停顿
+        if (ip_is_fragment(p)) {
+            net_pbuf_t *whole;
+            if (ip_reass_input(stack, p, &whole) < 0) {
+                NET_STAT_ADD(stack, rx_invalid, 1);
+            }
+            net_pbuf_free(p);
+            if (!whole) {
+                continue;
+            }
+            p = whole;
+        }
+        
+        if (udp_parse_frame(stack, p) < 0) {
+            NET_STAT_ADD(stack, rx_invalid, 1);
+            net_pbuf_free(p);
             continue;
         }
         
-        ip_header_t *ip = (ip_header_t *)(packet + sizeof(eth_header_t));
-        // 检查目的IP是否匹配
-        if (ip->dst_ip != g_net_wraper.config.ip_addr) {
-            NET_LOGW("Not for us: %u.%u.%u.%u", 
-                   (ip->dst_ip >> 24) & 0xFF, (ip->dst_ip >> 16) & 0xFF,
-                   (ip->dst_ip >> 8) & 0xFF, ip->dst_ip & 0xFF);
-            continue; // 不是发给我们的
+        net_socket_deliver(stack, p);
+    }
+    
+    return count;
+}
+
+// 取得端口的socket, 未绑定的端口自动绑定
+static net_socket_t *net_socket_get(net_stack_t *stack, uint16_t port) {
+    net_lock(stack);
+    net_socket_t *sock = net_socket_lookup(stack, port);
+    net_lock_release(stack);
+    
+    if (!sock) {
+        // 同时被其他调用者绑定时bind失败, 仍可取得其socket
+        udp_bind(stack, port);
+        net_lock(stack);
+        sock = net_socket_lookup(stack, port);
+        net_lock_release(stack);
+    }
+    return sock;
+}
+
+// 批量接收UDP数据包
+int udp_receive_burst(net_stack_t *stack, uint16_t port, net_pbuf_t **pkts, int max, int timeout_ms) {
+    stack = net_stack_get(stack);
+    if (!stack->initialized) {
+        NET_LOGE("net warper not initialized");
+        return -1;
+    }
+    
+    net_socket_t *sock = net_socket_get(stack, port);
+    if (!sock) {
+        return -1;
+    }
+    
+    uint32_t start_time = net_get_time_ms(); // 需要实现获取当前时间的函数
+    
+    while (1) {
+        int count = net_socket_dequeue_burst(sock, pkts, max);
+#if !NET_USE_ASYNC_TASK
+        // 队列为空时轮询设备, 其他端口的数据放入各自的队列而不是丢弃
+        // 在超时检查之前轮询, timeout_ms为0时也能取得已到达的帧
+        if (count == 0 && net_rx_dispatch(stack, NET_SOCKET_QUEUE_LEN) > 0) {
+            count = net_socket_dequeue_burst(sock, pkts, max);
+        }
+#endif
+        if (count > 0) {
+            return count;
         }
         
-        // 解析UDP头
-        udp_header_t *udp = (udp_header_t *)((uint8_t *)ip + (ip->ver_ihl & 0xF) * 4);
+        uint32_t elapsed = net_get_time_ms() - start_time;
+        if (elapsed >= (uint32_t)timeout_ms) {
+            return -1; // 超时
+        }
         
-        // 检查目的端口是否匹配(简化实现，接收所有UDP包)
-        if (dst_port && ntohs(udp->dst_port) != *dst_port) {
-            NET_LOGW("Destination port mismatch: %u %u", ntohs(udp->dst_port), *dst_port);
-            continue; // 端口不匹配
+#if NET_USE_ASYNC_TASK
+        // 阻塞等待接收任务唤醒, 不占用CPU; 有等待钩子时需要定时返回以运行钩子
+        uint32_t wait_ms = timeout_ms - elapsed;
+        if (stack->idle_hook && wait_ms > NET_LINK_POLL_MS) {
+            wait_ms = NET_LINK_POLL_MS;
         }
+        net_sem_wait_timeout(sock->sem, wait_ms);
+#endif
         
-        // 提取源信息
-        if (src_ip) *src_ip = ip->src_ip;
-        if (src_port) *src_port = ntohs(udp->src_port);
-        if (dst_port) *dst_port = ntohs(udp->dst_port);
+        // 让同一线程中的其他使用者运行, 钩子内的接收不会再次进入钩子
+        if (stack->idle_hook) {
+            net_idle_hook_t hook = stack->idle_hook;
+            stack->idle_hook = NULL;
+            hook(stack->idle_arg);
+            stack->idle_hook = hook;
+        }
+    }
+}
+
+uint32_t udp_rx_seq(net_stack_t *stack) {
+    return __atomic_load_n(&net_stack_get(stack)->rx_seq, __ATOMIC_SEQ_CST);
+}
+
+// 等待任意端口有新数据
+int udp_wait(net_stack_t *stack, uint32_t seq, int timeout_ms) {
+    stack = net_stack_get(stack);
+    if (!stack->initialized) {
+        NET_LOGE("net warper not initialized");
+        return -1;
+    }
+    
+    uint32_t start_time = net_get_time_ms();
+    
+    while (1) {
+#if !NET_USE_ASYNC_TASK
+        // 轮询设备, 分发到各端口的数据使序号变化
+        net_rx_dispatch(stack, NET_SOCKET_QUEUE_LEN);
+#endif
+        if (__atomic_load_n(&stack->rx_seq, __ATOMIC_SEQ_CST) != seq) {
+            return 0;
+        }
         
-        // 提取数据
-        size_t data_len = ntohs(udp->length) - sizeof(udp_header_t);
-        if (data_len > buf_size) {
-            data_len = buf_size; // 防止缓冲区溢出
+        uint32_t elapsed = net_get_time_ms() - start_time;
+        if (elapsed >= (uint32_t)timeout_ms) {
+            return -1; // 超时
         }
         
-        uint8_t *data = (uint8_t *)udp + sizeof(udp_header_t);
-        memcpy(buffer, data, data_len);
+#if NET_USE_ASYNC_TASK
+        uint32_t wait_ms = timeout_ms - elapsed;
+        if (stack->idle_hook && wait_ms > NET_LINK_POLL_MS) {
+            wait_ms = NET_LINK_POLL_MS;
+        }
+        // 登记后再次检查序号, 之后入队的数据一定会释放信号量
+        __atomic_add_fetch(&stack->rx_waiters, 1, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&stack->rx_seq, __ATOMIC_SEQ_CST) == seq) {
+            net_sem_wait_timeout(stack->rx_event, wait_ms);
+        }
+        __atomic_sub_fetch(&stack->rx_waiters, 1, __ATOMIC_SEQ_CST);
+#endif
         
-        return data_len;
+        if (stack->idle_hook) {
+            net_idle_hook_t hook = stack->idle_hook;
+            stack->idle_hook = NULL;
+            hook(stack->idle_arg);
+            stack->idle_hook = hook;
+        }
     }
-}
\ No newline at end of file
+}
+
+void udp_get_stats(net_stack_t *stack, net_udp_stats_t *stats) {
+    stack = net_stack_get(stack);
+    stats->tx_bytes = __atomic_load_n(&stack->stats.tx_bytes, __ATOMIC_RELAXED);
+    stats->rx_bytes = __atomic_load_n(&stack->stats.rx_bytes, __ATOMIC_RELAXED);
+    stats->tx_packets = __atomic_load_n(&stack->stats.tx_packets, __ATOMIC_RELAXED);
+    stats->tx_errors = __atomic_load_n(&stack->stats.tx_errors, __ATOMIC_RELAXED);
+    stats->rx_frames = __atomic_load_n(&stack->stats.rx_frames, __ATOMIC_RELAXED);
+    stats->rx_packets = __atomic_load_n(&stack->stats.rx_packets, __ATOMIC_RELAXED);
+    stats->rx_invalid = __atomic_load_n(&stack->stats.rx_invalid, __ATOMIC_RELAXED);
+    stats->rx_no_socket = __atomic_load_n(&stack->stats.rx_no_socket, __ATOMIC_RELAXED);
+    stats->rx_queue_full = __atomic_load_n(&stack->stats.rx_queue_full, __ATOMIC_RELAXED);
+    stats->rx_no_buffer = __atomic_load_n(&stack->stats.rx_no_buffer, __ATOMIC_RELAXED);
+    stats->rx_bad_checksum = __atomic_load_n(&stack->stats.rx_bad_checksum, __ATOMIC_RELAXED);
+    stats->tx_fragments = __atomic_load_n(&stack->stats.tx_fragments, __ATOMIC_RELAXED);
+    stats->rx_fragments = __atomic_load_n(&stack->stats.rx_fragments, __ATOMIC_RELAXED);
+    stats->rx_reassembled = __atomic_load_n(&stack->stats.rx_reassembled, __ATOMIC_RELAXED);
+    stats->rx_reass_failed = __atomic_load_n(&stack->stats.rx_reass_failed, __ATOMIC_RELAXED);
+    stats->tx_arp = __atomic_load_n(&stack->stats.tx_arp, __ATOMIC_RELAXED);
+    stats->rx_arp = __atomic_load_n(&stack->stats.rx_arp, __ATOMIC_RELAXED);
+}
+
+void udp_reset_stats(net_stack_t *stack) {
+    stack = net_stack_get(stack);
+    memset(&stack->stats, 0, sizeof(stack->stats));
+}
+
+void udp_release_burst(net_pbuf_t **pkts, int count) {
+    for (int i = 0; i < count; i++) {
+        net_pbuf_free(pkts[i]);
+    }
+}
+
+// 接收UDP数据包(非阻塞)
+int udp_receive(net_stack_t *stack, uint32_t *src_ip, uint16_t *src_port, uint16_t *dst_port,
+               uint8_t *buffer, size_t buf_size, int timeout_ms) {
+    net_pbuf_t *p;
+    
+    if (udp_receive_burst(stack, dst_port ? *dst_port : 0, &p, 1, timeout_ms) < 1) {
+        return -1;
+    }
+    
+    // 提取源信息
+    if (src_ip) *src_ip = p->src_ip;
+    if (src_port) *src_port = p->src_port;
+    if (dst_port) *dst_port = p->dst_port;
+    
+    // 提取数据
+    size_t data_len = p->len;
+    if (data_len > buf_size) {
+        data_len = buf_size; // 防止缓冲区溢出
+    }
+    memcpy(buffer, p->payload, data_len);
+    net_pbuf_free(p);
+    
+    return data_len;
+}
@@ -1,117 +1,575 @@
 #include "tftp.h"
 #include "net_wrapper.h"
 #include <string.h>
-
-// 全局状态
-typedef struct {
-    uint16_t next_local_port;
-} tftp_global_state_t;
-
-static tftp_global_state_t tftp_state = {
-    .next_local_port = 49152  // 从动态端口范围开始
-};
+#include <stdio.h>
 
 void tftp_init_default_options(tftp_options_t* options) {
     if (options) {
         options->block_size = TFTP_DEFAULT_BLOCK_SIZE;
+        options->window_size = TFTP_DEFAULT_WINDOW_SIZE;
         options->timeout_ms = TFTP_DEFAULT_TIMEOUT_MS;
         options->transfer_size = 0;  // 未知
+        options->has_tsize = false;
+        options->rollover = 0;
+        options->multicast = false;
+        options->mcast_master = false;
+        options->mcast_port = 0;
+        options->mcast_ip = 0;
         options->wait_oack = false;
         options->retries = TFTP_DEFAULT_RETRIES;
     }
 }
 
+// 端口由协议栈实例分配, 不同实例(线程)之间不共享状态
+uint16_t tftp_alloc_local_port(net_stack_t* stack) {
+    return udp_alloc_port(stack);
+}
+
 int tftp_send_packet(tftp_session_t* session, tftp_opcode_t opcode, 
                     const void* data, size_t data_len) {
-    uint8_t packet[TFTP_PACKET_MAX_SIZE];
+    uint16_t header[2];
+    net_iovec_t iov[2];
+    
+    header[0] = htons(opcode);
+    header[1] = htons(session->block_num);
+    iov[0].base = (const uint8_t*)header;
+    iov[0].len = (opcode == TFTP_DATA || opcode == TFTP_ACK) ? 4 : 2;
+    iov[1].base = (const uint8_t*)data;
+    iov[1].len = data ? data_len : 0;
+    
+    // 超过一帧的数据由udp_sendv分片发送
+    return udp_sendv(session->stack, session->peer_ip, session->local_port, session->peer_port,
+                     iov, 2);
+}
+
+int tftp_receive_packet(tftp_session_t* session, tftp_opcode_t* opcode,
+                       void* data, size_t buf_size, size_t* data_len, int timeout_ms) {
+    net_pbuf_t* p;
+    uint32_t start_time = net_get_time_ms();
+    uint32_t elapsed = 0;
+    
+    tftp_stats_tick();
+    
+    while (1) {
+        // 数据留在缓冲池中, 验证后只拷贝一次到调用方缓冲
+        if (udp_receive_burst(session->stack, session->local_port, &p, 1, timeout_ms - (int)elapsed) < 1) {
+            return -1;
+        }
+        
+        // 验证源IP和端口(peer_port为0时接受对端的第一个TID)
+        if (p->src_ip == session->peer_ip &&
+            (session->peer_port == 0 || p->src_port == session->peer_port)) {
+            break;
+        }
+        
+        // 其他传输的包: 通知对方TID错误(RFC 1350), 在原截止时间内继续等待
+        NET_LOGW_RATELIMIT("Unknown TID %u.%u.%u.%u:%u",
+                 (p->src_ip >> 24) & 0xFF, (p->src_ip >> 16) & 0xFF,
+                 (p->src_ip >> 8) & 0xFF, p->src_ip & 0xFF, p->src_port);
+        tftp_send_error_from(session->stack, session->local_port, p->src_ip, p->src_port,
+                             TFTP_ERR_UNKNOWN_ID, "Unknown transfer ID");
+        TFTP_STAT_ADD(session, wrong_peer, 1);
+        net_pbuf_free(p);
+        
+        elapsed = net_get_time_ms() - start_time;
+        if (elapsed >= (uint32_t)timeout_ms) {
+            return -1; // 超时
+        }
+    }
+    
+    if (session->peer_port == 0) {
+        session->peer_port = p->src_port;
+    }
+
+    NET_LOGD("Received packet from %u.%u.%u.%u:%u",
+             (p->src_ip >> 24) & 0xFF, (p->src_ip >> 16) & 0xFF,
+             (p->src_ip >> 8) & 0xFF, p->src_ip & 0xFF,
+             p->src_port);
+    
+    int ret = -1;
+    if (p->len >= 2) {
+        *opcode = ntohs(*(uint16_t*)p->payload);
+        NET_LOGD("Received opcode: %u", *opcode);
+        
+        switch (*opcode) {
+        case TFTP_DATA:
+        case TFTP_ACK:
+        case TFTP_OACK:
+        case TFTP_ERROR:
+            if (data && data_len) {
+                // 重组后的数据报可能超过调用方缓冲, 不截断
+                if (p->len - 2 > buf_size) {
+                    NET_LOGW_RATELIMIT("Oversized packet: %u bytes", (unsigned)p->len);
+                    break;
+                }
+                *data_len = p->len - 2;
+                memcpy(data, p->payload + 2, *data_len);
+            }
+            ret = 0;
+            break;
+        default:
+            break; // 不支持的包类型
+        }
+    }
+    
+    net_pbuf_free(p);
+    return ret;
+}
+
+int tftp_send_error(net_stack_t* stack, uint32_t ip, uint16_t port,
+                    tftp_error_t code, const char* message) {
+    return tftp_send_error_from(stack, 0, ip, port, code, message);
+}
+
+int tftp_send_error_from(net_stack_t* stack, uint16_t local_port, uint32_t ip, uint16_t port,
+                         tftp_error_t code, const char* message) {
+    uint8_t packet[4 + 128]; // 错误消息最大长度128
     uint16_t* p = (uint16_t*)packet;
+    size_t msg_len = strnlen(message, 127);
+    
+    *p++ = htons(TFTP_ERROR);
+    *p++ = htons(code);
+    memcpy(p, message, msg_len);
+    packet[4 + msg_len] = '\0';
+    
+    return udp_send(stack, ip, local_port, port, packet, 4 + msg_len + 1);
+}
+
+int tftp_send_ack(tftp_session_t* session, uint16_t block_num) {
+    uint16_t ack_packet[2] = {htons(TFTP_ACK), htons(block_num)};
+    return udp_send(session->stack, session->peer_ip, session->local_port, session->peer_port,
+                   (uint8_t*)ack_packet, sizeof(ack_packet));
+}
+
+tftp_stats_t g_tftp_stats;
+
+static tftp_stats_hook_t g_stats_hook = NULL;
+static void* g_stats_hook_arg = NULL;
+static uint32_t g_stats_interval_ms = 0;
+static uint32_t g_stats_last_ms = 0;
+
+void tftp_get_stats(tftp_stats_t* stats) {
+    stats->tx_bytes = __atomic_load_n(&g_tftp_stats.tx_bytes, __ATOMIC_RELAXED);
+    stats->rx_bytes = __atomic_load_n(&g_tftp_stats.rx_bytes, __ATOMIC_RELAXED);
+    stats->tx_blocks = __atomic_load_n(&g_tftp_stats.tx_blocks, __ATOMIC_RELAXED);
+    stats->rx_blocks = __atomic_load_n(&g_tftp_stats.rx_blocks, __ATOMIC_RELAXED);
+    stats->retransmits = __atomic_load_n(&g_tftp_stats.retransmits, __ATOMIC_RELAXED);
+    stats->timeouts = __atomic_load_n(&g_tftp_stats.timeouts, __ATOMIC_RELAXED);
+    stats->out_of_order = __atomic_load_n(&g_tftp_stats.out_of_order, __ATOMIC_RELAXED);
+    stats->dup_acks = __atomic_load_n(&g_tftp_stats.dup_acks, __ATOMIC_RELAXED);
+    stats->wrong_peer = __atomic_load_n(&g_tftp_stats.wrong_peer, __ATOMIC_RELAXED);
+    for (int i = 0; i < TFTP_RTT_HIST_BUCKETS; i++) {
+        stats->rtt_hist[i] = __atomic_load_n(&g_tftp_stats.rtt_hist[i], __ATOMIC_RELAXED);
+    }
+}
+
+void tftp_reset_stats(void) {
+    memset(&g_tftp_stats, 0, sizeof(g_tftp_stats));
+}
+
+void tftp_set_stats_hook(tftp_stats_hook_t hook, void* arg, uint32_t interval_ms) {
+    g_stats_hook = NULL;
+    g_stats_hook_arg = arg;
+    g_stats_interval_ms = interval_ms;
+    g_stats_last_ms = net_get_time_ms();
+    g_stats_hook = hook;
+}
+
+// 到达间隔时调用统计钩子, 由接收路径和服务器轮询调用
+void tftp_stats_tick(void) {
+    tftp_stats_hook_t hook = g_stats_hook;
+    if (!hook) {
+        return;
+    }
+
+    uint32_t now = net_get_time_ms();
+    uint32_t last = __atomic_load_n(&g_stats_last_ms, __ATOMIC_RELAXED);
+    if (now - last < g_stats_interval_ms ||
+        !__atomic_compare_exchange_n(&g_stats_last_ms, &last, now, false,
+                                     __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        return; // 未到间隔, 或其他线程已经处理
+    }
+
+    tftp_stats_t stats;
+    tftp_get_stats(&stats);
+    hook(&stats, g_stats_hook_arg);
+}
+
+void tftp_stats_log(const tftp_stats_t* stats, void* arg) {
+    NET_LOGI("tftp: tx %u blk/%llu B, rx %u blk/%llu B, rexmit %u, timeout %u, ooo %u, dupack %u, wrong peer %u",
+             stats->tx_blocks, (unsigned long long)stats->tx_bytes,
+             stats->rx_blocks, (unsigned long long)stats->rx_bytes,
+             stats->retransmits, stats->timeouts, stats->out_of_order,
+             stats->dup_acks, stats->wrong_peer);
+    NET_LOGI("tftp: rtt <1ms %u, <2ms %u, <4ms %u, <8ms %u, <16ms %u, <32ms %u, <64ms %u, >=64ms %u",
+             stats->rtt_hist[0], stats->rtt_hist[1], stats->rtt_hist[2], stats->rtt_hist[3],
+             stats->rtt_hist[4], stats->rtt_hist[5], stats->rtt_hist[6],
+             stats->rtt_hist[7] + stats->rtt_hist[8] + stats->rtt_hist[9] + stats->rtt_hist[10] +
+             stats->rtt_hist[11] + stats->rtt_hist[12] + stats->rtt_hist[13] + stats->rtt_hist[14] +
+             stats->rtt_hist[15]);
+}
+
+// RTT样本所在的直方图桶
+static inline uint32_t tftp_rtt_bucket(uint32_t rtt_ms) {
+    uint32_t bucket = 0;
+    while (rtt_ms && bucket < TFTP_RTT_HIST_BUCKETS - 1) {
+        rtt_ms >>= 1;
+        bucket++;
+    }
+    return bucket;
+}
+
+// 清除RTT估计, 每次新传输开始时调用
+void tftp_rtt_reset(tftp_session_t* session) {
+    session->srtt_us = 0;
+    session->rttvar_us = 0;
+    session->rto_ms = 0;
+    session->rtt_valid = false;
+    session->rtt_timing = false;
+    session->retry_count = 0;
+}
+
+// 开始对块seq计时, 已在计时时不重新开始
+void tftp_rtt_start(tftp_session_t* session, uint32_t seq) {
+    if (session->rtt_timing) {
+        return;
+    }
+    session->rtt_timing = true;
+    session->rtt_seq = seq;
+    session->rtt_start_ms = net_get_time_ms();
+}
+
+// 收到覆盖块seq的确认, 更新SRTT/RTTVAR并重新计算RTO(RFC 6298)
+void tftp_rtt_sample(tftp_session_t* session, uint32_t seq) {
+    if (!session->rtt_timing || (int32_t)(seq - session->rtt_seq) < 0) {
+        return;
+    }
+    session->rtt_timing = false;
     
-    *p++ = htons(opcode);
+    uint32_t rtt_ms = net_get_time_ms() - session->rtt_start_ms;
+    uint32_t r = rtt_ms * 1000;
     
-    if (opcode == TFTP_DATA || opcode == TFTP_ACK) {
-        *p++ = htons(session->block_num);
+    TFTP_STAT_ADD(session, rtt_hist[tftp_rtt_bucket(rtt_ms)], 1);
+    
+    if (!session->rtt_valid) {
+        session->srtt_us = r;
+        session->rttvar_us = r / 2;
+        session->rtt_valid = true;
+    } else {
+        uint32_t err = r > session->srtt_us ? r - session->srtt_us : session->srtt_us - r;
+        session->rttvar_us = session->rttvar_us - session->rttvar_us / 4 + err / 4;
+        session->srtt_us = session->srtt_us - session->srtt_us / 8 + r / 8;
     }
     
-    if (data && data_len > 0) {
-        memcpy(p, data, data_len);
+    // 时钟粒度为1ms
+    uint32_t var = 4 * session->rttvar_us;
+    uint32_t rto = (session->srtt_us + (var > 1000 ? var : 1000) + 999) / 1000;
+    if (rto < TFTP_RTO_MIN_MS) {
+        rto = TFTP_RTO_MIN_MS;
     }
+    session->rto_ms = rto < session->options.timeout_ms ? rto : session->options.timeout_ms;
+}
+
+// 超时: RTO加倍(以协商的timeout为上限), 放弃正在进行的计时(Karn算法)
+// RTO已达上限后连续超时retries次返回-1, 表示应放弃传输
+int tftp_rtt_backoff(tftp_session_t* session) {
+    uint32_t rto = tftp_rto(session);
+    
+    session->rtt_timing = false;
+    TFTP_STAT_ADD(session, timeouts, 1);
     
-    size_t packet_len = (opcode == TFTP_DATA || opcode == TFTP_ACK) ? 
-                       data_len + 4 : data_len + 2;
+    if (rto >= session->options.timeout_ms) {
+        if (++session->retry_count >= session->options.retries) {
+            return -1;
+        }
+    }
     
-    return udp_send(session->peer_ip, session->local_port, session->peer_port,
-                   packet, packet_len);
+    rto *= 2;
+    session->rto_ms = rto < session->options.timeout_ms ? rto : session->options.timeout_ms;
+    return 0;
 }
 
-int tftp_receive_packet(tftp_session_t* session, tftp_opcode_t* opcode,
-                       void* data, size_t* data_len, int timeout_ms) {
-    uint8_t packet[TFTP_PACKET_MAX_SIZE];
-    uint32_t src_ip;
-    uint16_t src_port;
-    uint16_t dst_port = session->local_port;
-    int ret;
-    
-    ret = udp_receive(&src_ip, &src_port, &dst_port, 
-                     packet, sizeof(packet), timeout_ms);
-    if (ret <= 0) return ret;
-    
-    // 验证源IP和端口
-    if (src_ip != session->peer_ip || src_port != session->peer_port) {
-        NET_LOGE("Invalid source IP or port");
-        // 打印内容
-        NET_LOGE("src_ip: %u.%u.%u.%u, src_port: %u, peer_ip: %u.%u.%u.%u, peer_port: %u",
-                 (src_ip >> 24) & 0xFF, (src_ip >> 16) & 0xFF,
-                 (src_ip >> 8) & 0xFF, src_ip & 0xFF,
-                 ntohs(src_port),
-                 (session->peer_ip >> 24) & 0xFF, (session->peer_ip >> 16) & 0xFF,
-                 (session->peer_ip >> 8) & 0xFF, session->peer_ip & 0xFF,
-                 ntohs(session->peer_port));
-
-        return -1; // 不是我们要的包
+// 每个缓存块: 包头空间 + TFTP头 + 数据
+static inline size_t tftp_window_stride(const tftp_window_t* w) {
+    return NET_UDP_HEADROOM + 4 + w->block_size;
+}
+
+int tftp_window_init(tftp_window_t* w, const tftp_options_t* options, bool sender) {
+    memset(w, 0, sizeof(*w));
+    w->block_size = options->block_size;
+    w->window_size = options->window_size ? options->window_size : 1;
+    w->rollover = options->rollover;
+    
+    if (!sender) {
+        return 0;
     }
+    
+    w->buffer = TFTP_MALLOC((size_t)w->window_size * tftp_window_stride(w));
+    w->lengths = TFTP_MALLOC(w->window_size * sizeof(size_t));
+    if (!w->buffer || !w->lengths) {
+        tftp_window_free(w);
+        return -1;
+    }
+    
+    return 0;
+}
 
-    NET_LOGD("Received packet from %u.%u.%u.%u:%u",
-             (src_ip >> 24) & 0xFF, (src_ip >> 16) & 0xFF,
-             (src_ip >> 8) & 0xFF, src_ip & 0xFF,
-             ntohs(src_port));
+int tftp_window_init_mapped(tftp_window_t* w, const tftp_options_t* options) {
+    memset(w, 0, sizeof(*w));
+    w->block_size = options->block_size;
+    w->window_size = options->window_size ? options->window_size : 1;
+    w->rollover = options->rollover;
     
-    uint16_t* p = (uint16_t*)packet;
-    *opcode = ntohs(*p++);
+    w->mapped = TFTP_MALLOC(w->window_size * sizeof(const uint8_t*));
+    w->lengths = TFTP_MALLOC(w->window_size * sizeof(size_t));
+    if (!w->mapped || !w->lengths) {
+        tftp_window_free(w);
+        return -1;
+    }
+    
+    // 缓冲池pbuf放不下的块先拷贝到缓存块, 再由udp_send_batch分片
+    if (4 + (size_t)w->block_size > NET_PBUF_BUF_SIZE - NET_UDP_HEADROOM) {
+        w->buffer = TFTP_MALLOC((size_t)w->window_size * tftp_window_stride(w));
+        if (!w->buffer) {
+            tftp_window_free(w);
+            return -1;
+        }
+    }
+    
+    return 0;
+}
 
-    NET_LOGD("Received opcode: %u", *opcode);
+void tftp_window_free(tftp_window_t* w) {
+    if (w->buffer) TFTP_FREE(w->buffer);
+    if (w->lengths) TFTP_FREE(w->lengths);
+    if (w->mapped) TFTP_FREE((void*)w->mapped);
+    w->buffer = NULL;
+    w->lengths = NULL;
+    w->mapped = NULL;
+}
+
+// 返回第n块在缓存中的DATA包地址, 之前保留NET_UDP_HEADROOM字节用于原地填写包头
+static inline uint8_t* tftp_window_slot(tftp_window_t* w, uint32_t n) {
+    return w->buffer + (size_t)((n - 1) % w->window_size) * tftp_window_stride(w) + NET_UDP_HEADROOM;
+}
+
+// 读取数据直到缓存满一个窗口
+int tftp_window_fill(tftp_window_t* w, tftp_get_data_callback read, void* user_data) {
+    while (!w->eof && w->filled < w->base + w->window_size) {
+        uint32_t n = w->filled + 1;
+        uint8_t* slot = tftp_window_slot(w, n);
+        
+        int bytes_read = read(user_data, slot + 4, w->block_size);
+        if (bytes_read < 0) {
+            return -1;
+        }
+        
+        *((uint16_t*)slot) = htons(TFTP_DATA);
+        *((uint16_t*)(slot + 2)) = htons(tftp_window_block(w, n));
+        w->lengths[(n - 1) % w->window_size] = bytes_read;
+        w->filled = n;
+        
+        if ((size_t)bytes_read < w->block_size) {
+            w->eof = true; // 最后一块(可能为空)
+        }
+    }
     
-    switch (*opcode) {
-    case TFTP_DATA:
-    case TFTP_ACK:
-    case TFTP_OACK:
-        if (data && data_len) {
-            *data_len = ret - 2;
-            memcpy(data, p, *data_len);
+    return 0;
+}
+
+// 引用填充: 只记录数据引用, 发送时再拷贝到发送帧
+int tftp_window_fill_mapped(tftp_window_t* w, tftp_map_data_callback map, void* user_data) {
+    while (!w->eof && w->filled < w->base + w->window_size) {
+        uint32_t n = w->filled + 1;
+        const uint8_t* data = NULL;
+        
+        int len = map(user_data, &data, w->block_size);
+        if (len < 0) {
+            return -1;
         }
-        break;
-    case TFTP_ERROR:
-        if (data && data_len) {
-            *data_len = ret - 2;
-            memcpy(data, p, *data_len);
+        
+        w->mapped[(n - 1) % w->window_size] = data;
+        w->lengths[(n - 1) % w->window_size] = len;
+        w->filled = n;
+        
+        if ((size_t)len < w->block_size) {
+            w->eof = true;
         }
-        break;
-    default:
-        return -1; // 不支持的包类型
     }
     
     return 0;
 }
 
-int tftp_send_error(uint32_t ip, uint16_t port, tftp_error_t code, const char* message) {
-    uint8_t packet[4 + 128]; // 错误消息最大长度128
-    uint16_t* p = (uint16_t*)packet;
+// 准备第n块的发送缓冲: 缓存块直接包装为pbuf, 引用的数据拷贝到缓冲池pbuf中
+// 超过一帧的引用块拷贝到缓存块, 返回的pbuf不是pbuf参数时由调用方释放
+static net_pbuf_t* tftp_window_prepare_block(net_stack_t* stack, tftp_window_t* w, uint32_t n,
+                                             net_pbuf_t* pbuf) {
+    uint32_t slot = (n - 1) % w->window_size;
     
-    *p++ = htons(TFTP_ERROR);
-    *p++ = htons(code);
-    strncpy((char*)p, message, 128);
+    if (w->mapped && w->buffer) {
+        uint8_t* packet = tftp_window_slot(w, n);
+        *((uint16_t*)packet) = htons(TFTP_DATA);
+        *((uint16_t*)(packet + 2)) = htons(tftp_window_block(w, n));
+        memcpy(packet + 4, w->mapped[slot], w->lengths[slot]);
+    }
+    
+    if (!w->mapped || w->buffer) {
+        // 数据已读入缓存块, 包头写入其前的保留空间后直接发送
+        uint8_t* packet = tftp_window_slot(w, n);
+        net_pbuf_init(pbuf, packet - NET_UDP_HEADROOM, tftp_window_stride(w), NET_UDP_HEADROOM);
+        pbuf->len = w->lengths[slot] + 4;
+        return pbuf;
+    }
+    
+    // TFTP头和引用的数据块一起直接写入发送帧
+    net_pbuf_t* p = udp_pbuf_alloc(stack, 4 + w->lengths[slot]);
+    if (!p) {
+        return NULL;
+    }
+    *((uint16_t*)p->payload) = htons(TFTP_DATA);
+    *((uint16_t*)(p->payload + 2)) = htons(tftp_window_block(w, n));
+    memcpy(p->payload + 4, w->mapped[slot], w->lengths[slot]);
+    return p;
+}
+
+// 发送所有已缓存但未发送的块, 返回发送的块数
+int tftp_window_send(tftp_session_t* session, tftp_window_t* w) {
+    return tftp_window_send_to(session, w, session->peer_ip, session->peer_port);
+}
+
+// 发送到指定地址(例如多播组), 其他与tftp_window_send相同
+int tftp_window_send_to(tftp_session_t* session, tftp_window_t* w, uint32_t ip, uint16_t port) {
+    net_pbuf_t bufs[NET_TX_BATCH_MAX];
+    net_pbuf_t* pkts[NET_TX_BATCH_MAX];
+    int count = 0;
+    
+    while (w->sent < w->filled) {
+        // 一批最多NET_TX_BATCH_MAX块, 使用同一个包头模板发送
+        int batch = 0;
+        while (batch < NET_TX_BATCH_MAX && w->sent + batch < w->filled) {
+            pkts[batch] = tftp_window_prepare_block(session->stack, w, w->sent + batch + 1, &bufs[batch]);
+            if (!pkts[batch]) {
+                break;
+            }
+            batch++;
+        }
+        
+        int ret = batch > 0 ? udp_send_batch(session->stack, ip, session->local_port, port, pkts, batch) : -1;
+        
+        for (int i = 0; i < batch; i++) {
+            if (pkts[i] != &bufs[i]) {
+                net_pbuf_free(pkts[i]);
+            }
+        }
+        
+        for (int i = 0; i < ret; i++) {
+            uint32_t n = w->sent + 1;
+            if (n > w->sent_max) {
+                w->sent_max = n;
+                tftp_rtt_start(session, n);
+            } else {
+                TFTP_STAT_ADD(session, retransmits, 1);
+                if (session->rtt_timing && n <= session->rtt_seq) {
+                    session->rtt_timing = false; // 计时的块被重传, 其确认无法区分(Karn算法)
+                }
+            }
+            TFTP_STAT_ADD(session, tx_blocks, 1);
+            TFTP_STAT_ADD(session, tx_bytes, w->lengths[(n - 1) % w->window_size]);
+            w->sent = n;
+            count++;
+        }
+        
+        if (ret < batch) {
+            return -1;
+        }
+    }
+    
+    return count;
+}
+
+// 发送端跳到逻辑块n之后: 之前的块视为已确认, 之后的块重新读取
+void tftp_window_seek(tftp_window_t* w, uint32_t n) {
+    w->base = n;
+    w->sent = n;
+    w->filled = n;
+    w->offset = (uint64_t)n * w->block_size;
+    w->eof = false;
+}
+
+// 报文块号block_num相对逻辑块号ref的有符号距离, 按回绕后的块号空间计算
+int32_t tftp_window_distance(const tftp_window_t* w, uint32_t ref, uint16_t block_num) {
+    if (w->rollover == 0) {
+        return (int16_t)(block_num - (uint16_t)ref);
+    }
+    
+    // 回绕到1时块号空间为1..65535, 块号0只用于ACK0
+    if (block_num == 0) {
+        return ref == 0 ? 0 : INT16_MIN;
+    }
+    int32_t d = (int32_t)block_num - tftp_window_block(w, ref);
+    if (d > 32767) {
+        d -= 65535;
+    } else if (d < -32767) {
+        d += 65535;
+    }
+    return d;
+}
+
+// 处理累计ACK, 返回1表示窗口前移, 0表示重复或无效的ACK
+int tftp_window_on_ack(tftp_window_t* w, uint16_t block_num) {
+    int32_t delta = tftp_window_distance(w, w->base, block_num);
+    
+    if (delta <= 0 || (uint32_t)delta > w->sent - w->base) {
+        return 0;
+    }
+    
+    for (int32_t i = 0; i < delta; i++) {
+        w->offset += w->lengths[(w->base + i) % w->window_size];
+    }
+    w->base += delta;
+    
+    // 接收端只在窗口末尾或检测到丢包时确认, 确认点落后于已发送位置说明有丢包
+    if (w->base < w->sent) {
+        tftp_window_rewind(w);
+    }
+    
+    return 1;
+}
+
+// 处理收到的DATA块, 返回1表示按序新数据(需交付), 0表示乱序或重复
+int tftp_window_on_data(tftp_window_t* w, uint16_t block_num, size_t len, bool* send_ack) {
+    int32_t delta = tftp_window_distance(w, w->base, block_num);
+    
+    *send_ack = false;
+    
+    if (!w->eof && delta == 1) {
+        w->base++;
+        w->offset += len;
+        w->since_ack++;
+        w->gap_acked = false;
+        
+        if (len < w->block_size) {
+            w->eof = true;
+        }
+        
+        if (w->eof || w->since_ack >= w->window_size) {
+            *send_ack = true;
+            w->since_ack = 0;
+        }
+        return 1;
+    }
+    
+    // 乱序或重复: 确认最后按序收到的块, 让发送端回退
+    // 同一轮乱序只确认一次; 块号不再递增说明发送端已重发, 需要再次确认
+    uint32_t n = w->base + delta;
+    if (!w->gap_acked || (int32_t)(n - w->last_ooo) <= 0) {
+        *send_ack = true;
+        w->gap_acked = true;
+        w->since_ack = 0;
+    }
+    w->last_ooo = n;
     
-    size_t len = 4 + strlen(message) + 1;
-    return udp_send(ip, 0, port, packet, len);
+    return 0;
 }
 
 int tftp_parse_options(const uint8_t* data, size_t len, tftp_options_t* options) {
@@ -129,15 +587,44 @@ int tftp_parse_options(const uint8_t* data, size_t len, tftp_options_t* options)
         if (strcasecmp(opt, "blksize") == 0) {
             uint16_t size = (uint16_t)atoi(val);
             if (size >= TFTP_MIN_BLOCK_SIZE && size <= TFTP_MAX_BLOCK_SIZE) {
-                options->block_size = size;
+                // 超过本地可接收的数据报长度时协商为较小的块
+                options->block_size = size > TFTP_BLOCK_SIZE_LIMIT ? TFTP_BLOCK_SIZE_LIMIT : size;
             }
         } else if (strcasecmp(opt, "timeout") == 0) {
             uint16_t timeout = (uint16_t)atoi(val);
             if (timeout >= 1 && timeout <= 255) {
                 options->timeout_ms = timeout * 1000;
             }
+        } else if (strcasecmp(opt, "windowsize") == 0) {
+            long window = atol(val);
+            if (window >= 1 && window <= 65535) {
+                // 超出本地缓存能力时协商为较小的窗口
+                options->window_size = window > TFTP_MAX_WINDOW_SIZE ?
+                                       TFTP_MAX_WINDOW_SIZE : (uint16_t)window;
+            }
+        } else if (strcasecmp(opt, "rollover") == 0) {
+            if (strcmp(val, "0") == 0 || strcmp(val, "1") == 0) {
+                options->rollover = (uint8_t)(val[0] - '0');
+            }
+        } else if (strcasecmp(opt, "multicast") == 0) {
+            // OACK中为"地址,端口,mc", 地址和端口可以省略(RFC 2090)
+            unsigned a, b, c, d, port, mc;
+            options->multicast = true;
+            if (sscanf(val, "%u.%u.%u.%u,%u,%u", &a, &b, &c, &d, &port, &mc) == 6 &&
+                a <= 255 && b <= 255 && c <= 255 && d <= 255 && port <= 65535) {
+                uint8_t* ip = (uint8_t*)&options->mcast_ip;
+                ip[0] = a;
+                ip[1] = b;
+                ip[2] = c;
+                ip[3] = d;
+                options->mcast_port = (uint16_t)port;
+                options->mcast_master = mc != 0;
+            } else if (sscanf(val, ",,%u", &mc) == 1) {
+                options->mcast_master = mc != 0;
+            }
         } else if (strcasecmp(opt, "tsize") == 0) {
-            options->transfer_size = (uint32_t)atol(val);
+            options->transfer_size = strtoull(val, NULL, 10);
+            options->has_tsize = true;
         }
     }
     
@@ -163,8 +650,38 @@ int tftp_build_options(const tftp_options_t* options, uint8_t* buffer, size_t ma
         count++;
     }
     
-    if (options->transfer_size > 0) {
-        int n = snprintf(p, end - p, "tsize%c%u%c", 0, options->transfer_size, 0);
+    if (options->window_size > TFTP_DEFAULT_WINDOW_SIZE) {
+        int n = snprintf(p, end - p, "windowsize%c%d%c", 0, options->window_size, 0);
+        if (n < 0 || p + n >= end) return -1;
+        p += n;
+        count++;
+    }
+    
+    if (options->rollover != 0) {
+        int n = snprintf(p, end - p, "rollover%c%u%c", 0, options->rollover, 0);
+        if (n < 0 || p + n >= end) return -1;
+        p += n;
+        count++;
+    }
+    
+    if (options->multicast) {
+        int n;
+        if (options->mcast_ip) {
+            const uint8_t* ip = (const uint8_t*)&options->mcast_ip;
+            n = snprintf(p, end - p, "multicast%c%u.%u.%u.%u,%u,%u%c", 0,
+                         ip[0], ip[1], ip[2], ip[3], options->mcast_port,
+                         options->mcast_master ? 1 : 0, 0);
+        } else {
+            n = snprintf(p, end - p, "multicast%c%c", 0, 0); // 请求中为空值
+        }
+        if (n < 0 || p + n >= end) return -1;
+        p += n;
+        count++;
+    }
+    
+    if (options->has_tsize || options->transfer_size > 0) {
+        int n = snprintf(p, end - p, "tsize%c%llu%c", 0,
+                         (unsigned long long)options->transfer_size, 0);
         if (n < 0 || p + n >= end) return -1;
         p += n;
         count++;
@@ -0,0 +1,464 @@
+#include "tftpcache.h"
+#include "net_wrapper.h"
+#include <string.h>
+
+_Static_assert(TFTP_CACHE_CHUNK_BLOCKS >= TFTP_MAX_WINDOW_SIZE,
+               "a window must not span more than two chunks");
+
+// 段状态, 读取者在锁外阻塞等待正在加载的段
+enum {
+    TFTP_CACHE_LOADING = 0,
+    TFTP_CACHE_READY,
+    TFTP_CACHE_FAILED,
+};
+
+struct tftp_cache_chunk {
+    tftp_cache_file_t* file;
+    uint32_t generation;
+    uint32_t block_size;
+    uint32_t index;             // 段序号, 起始偏移为index * block_size * TFTP_CACHE_CHUNK_BLOCKS
+    uint32_t refs;
+    uint32_t waiters;           // 等待加载完成的会话数, 持有锁时访问
+    int state;
+    void* loaded;               // 加载完成时按waiters释放
+    size_t size;                // 分配的数据大小
+    size_t len;                 // 有效数据长度, 小于size表示文件在此段内结束
+    tftp_cache_chunk_t* hash_next;
+    tftp_cache_chunk_t* lru_prev;
+    tftp_cache_chunk_t* lru_next;
+    uint8_t data[];
+};
+
+// 会话句柄: 引用最近访问的两个段, 覆盖窗口内所有块
+typedef struct {
+    tftp_cache_file_t* file;    // 读请求所属的文件, 写请求为NULL
+    void* backend;              // 后端提供者的句柄
+    tftp_cache_chunk_t* pinned[2];
+    bool write;
+    char name[TFTP_FILENAME_MAX]; // 写请求的文件名, 关闭时再次使缓存失效
+    tftp_cache_file_t own;      // 文件表满时使用的私有表项, 不与其他会话共用
+} tftp_cache_handle_t;
+
+static inline void tftp_cache_lock(tftp_cache_t* cache) {
+    while (__atomic_test_and_set(&cache->lock, __ATOMIC_ACQUIRE)) {
+    }
+}
+
+static inline void tftp_cache_unlock(tftp_cache_t* cache) {
+    __atomic_clear(&cache->lock, __ATOMIC_RELEASE);
+}
+
+static inline uint32_t tftp_cache_hash(const tftp_cache_file_t* file, uint32_t block_size, uint32_t index) {
+    uint32_t h = ((uint32_t)(uintptr_t)file >> 4) ^ (block_size << 16) ^ index;
+    return (h * 0x9E3779B1u) >> (32 - TFTP_CACHE_HASH_BITS);
+}
+
+static void tftp_cache_lru_remove(tftp_cache_t* cache, tftp_cache_chunk_t* c) {
+    if (c->lru_prev) c->lru_prev->lru_next = c->lru_next;
+    else cache->lru_head = c->lru_next;
+    if (c->lru_next) c->lru_next->lru_prev = c->lru_prev;
+    else cache->lru_tail = c->lru_prev;
+    c->lru_prev = c->lru_next = NULL;
+}
+
+static void tftp_cache_lru_push(tftp_cache_t* cache, tftp_cache_chunk_t* c) {
+    c->lru_prev = NULL;
+    c->lru_next = cache->lru_head;
+    if (cache->lru_head) cache->lru_head->lru_prev = c;
+    else cache->lru_tail = c;
+    cache->lru_head = c;
+}
+
+// 从哈希表和LRU(如果在其中)中移除并释放段, 调用时持有锁且段未被引用
+static void tftp_cache_free_chunk(tftp_cache_t* cache, tftp_cache_chunk_t* c) {
+    tftp_cache_chunk_t** pp = &cache->hash[tftp_cache_hash(c->file, c->block_size, c->index)];
+    while (*pp != c) {
+        pp = &(*pp)->hash_next;
+    }
+    *pp = c->hash_next;
+
+    if (cache->lru_head == c || c->lru_prev) {
+        tftp_cache_lru_remove(cache, c);
+    }
+    c->file->chunks--;
+    cache->stats.bytes -= c->size;
+    net_sem_destroy(c->loaded);
+    TFTP_FREE(c);
+}
+
+// 淘汰最久未使用的段, 直到加入need字节后不超过预算
+static void tftp_cache_evict(tftp_cache_t* cache, size_t need) {
+    while (cache->lru_tail && cache->stats.bytes + need > cache->budget) {
+        tftp_cache_free_chunk(cache, cache->lru_tail);
+        cache->stats.evictions++;
+    }
+}
+
+// 使文件已缓存的段失效, 仍被引用的段在释放时回收
+static void tftp_cache_invalidate(tftp_cache_t* cache, tftp_cache_file_t* file) {
+    file->generation++;
+    for (uint32_t i = 0; i < TFTP_CACHE_HASH_SIZE; i++) {
+        tftp_cache_chunk_t* c = cache->hash[i];
+        while (c) {
+            tftp_cache_chunk_t* next = c->hash_next;
+            if (c->file == file && c->refs == 0) {
+                tftp_cache_free_chunk(cache, c);
+            }
+            c = next;
+        }
+    }
+}
+
+static void tftp_cache_release(tftp_cache_t* cache, tftp_cache_chunk_t* c) {
+    tftp_cache_lock(cache);
+    if (--c->refs == 0) {
+        if (c->state != TFTP_CACHE_READY || c->generation != c->file->generation) {
+            tftp_cache_free_chunk(cache, c);
+        } else {
+            tftp_cache_lru_push(cache, c);
+            tftp_cache_evict(cache, 0);
+        }
+    }
+    tftp_cache_unlock(cache);
+}
+
+// 从后端读取一段, 后端的read可能每次只返回一部分
+static int tftp_cache_load(tftp_cache_t* cache, tftp_cache_handle_t* h, tftp_cache_chunk_t* c) {
+    uint64_t offset = (uint64_t)c->index * c->size;
+
+    c->len = 0;
+    while (c->len < c->size) {
+        int n = cache->backend->read(cache->backend_data, h->backend, offset + c->len,
+                                     c->data + c->len, c->size - c->len);
+        if (n < 0) {
+            return -1;
+        }
+        if (n == 0) {
+            break;
+        }
+        c->len += (size_t)n;
+    }
+    return 0;
+}
+
+// 加载结束, 设置状态并唤醒所有等待者
+static void tftp_cache_loaded(tftp_cache_t* cache, tftp_cache_chunk_t* c, int state) {
+    tftp_cache_lock(cache);
+    c->state = state;
+    uint32_t waiters = c->waiters;
+    c->waiters = 0;
+    tftp_cache_unlock(cache);
+
+    while (waiters--) {
+        net_sem_post(c->loaded);
+    }
+}
+
+// 取得并引用句柄所属文件的一段, 不在缓存中时从后端读取
+// 其他线程正在读取同一段时阻塞等待其完成, 同一段只读取一次
+static tftp_cache_chunk_t* tftp_cache_acquire(tftp_cache_t* cache, tftp_cache_handle_t* h,
+                                              uint32_t block_size, uint32_t index) {
+    tftp_cache_file_t* file = h->file;
+    uint32_t bucket = tftp_cache_hash(file, block_size, index);
+    tftp_cache_chunk_t* c;
+
+    tftp_cache_lock(cache);
+    for (c = cache->hash[bucket]; c; c = c->hash_next) {
+        if (c->file == file && c->generation == file->generation &&
+            c->block_size == block_size && c->index == index) {
+            break;
+        }
+    }
+
+    if (c) {
+        if (c->refs++ == 0) {
+            tftp_cache_lru_remove(cache, c);
+        }
+        cache->stats.hits++;
+        bool wait = c->state == TFTP_CACHE_LOADING;
+        if (wait) {
+            c->waiters++;
+        }
+        int state = c->state;
+        tftp_cache_unlock(cache);
+
+        // 持有引用, 等待期间段不会被释放
+        if (wait) {
+            net_sem_wait(c->loaded);
+            tftp_cache_lock(cache);
+            state = c->state;
+            tftp_cache_unlock(cache);
+        }
+        if (state != TFTP_CACHE_READY) {
+            tftp_cache_release(cache, c);
+            return NULL;
+        }
+        return c;
+    }
+
+    size_t size = (size_t)block_size * TFTP_CACHE_CHUNK_BLOCKS;
+    tftp_cache_evict(cache, size);
+    c = TFTP_MALLOC(sizeof(tftp_cache_chunk_t) + size);
+    if (!c) {
+        tftp_cache_unlock(cache);
+        return NULL;
+    }
+    memset(c, 0, sizeof(*c));
+    c->loaded = net_create_sem();
+    if (!c->loaded) {
+        TFTP_FREE(c);
+        tftp_cache_unlock(cache);
+        return NULL;
+    }
+    c->file = file;
+    c->generation = file->generation;
+    c->block_size = block_size;
+    c->index = index;
+    c->refs = 1;
+    c->state = TFTP_CACHE_LOADING;
+    c->size = size;
+    c->hash_next = cache->hash[bucket];
+    cache->hash[bucket] = c;
+    file->chunks++;
+    cache->stats.bytes += size;
+    cache->stats.misses++;
+    tftp_cache_unlock(cache);
+
+    // 在锁外读取, 不阻塞其他段的命中
+    int ret = tftp_cache_load(cache, h, c);
+    if (ret == 0) {
+        __atomic_fetch_add(&cache->stats.backend_bytes, c->len, __ATOMIC_RELAXED);
+    }
+    tftp_cache_loaded(cache, c, ret == 0 ? TFTP_CACHE_READY : TFTP_CACHE_FAILED);
+    if (ret < 0) {
+        tftp_cache_release(cache, c);
+        return NULL;
+    }
+    return c;
+}
+
+// 按文件名查找缓存的文件, 调用时持有锁
+static tftp_cache_file_t* tftp_cache_find_file(tftp_cache_t* cache, const char* filename) {
+    for (int i = 0; i < TFTP_CACHE_FILES; i++) {
+        tftp_cache_file_t* f = &cache->files[i];
+        if ((f->opens || f->chunks) && strcmp(f->name, filename) == 0) {
+            return f;
+        }
+    }
+    return NULL;
+}
+
+// 分配文件表项: 优先使用空闲表项, 否则回收没有会话打开的文件, 调用时持有锁
+static tftp_cache_file_t* tftp_cache_alloc_file(tftp_cache_t* cache) {
+    tftp_cache_file_t* idle = NULL;
+
+    for (int i = 0; i < TFTP_CACHE_FILES; i++) {
+        tftp_cache_file_t* f = &cache->files[i];
+        if (!f->opens && !f->chunks) {
+            memset(f, 0, sizeof(*f));
+            return f;
+        }
+        if (!f->opens && !idle) {
+            idle = f;
+        }
+    }
+
+    if (idle) {
+        // 没有会话打开时所有段都未被引用, 失效后全部释放
+        tftp_cache_invalidate(cache, idle);
+        memset(idle, 0, sizeof(*idle));
+    }
+    return idle;
+}
+
+static int tftp_cache_open(void* user_data, const char* filename, bool write, void** handle) {
+    tftp_cache_t* cache = (tftp_cache_t*)user_data;
+
+    tftp_cache_handle_t* h = TFTP_MALLOC(sizeof(tftp_cache_handle_t));
+    if (!h) {
+        return -1;
+    }
+    memset(h, 0, sizeof(*h));
+
+    if (cache->backend->open(cache->backend_data, filename, write, &h->backend) < 0) {
+        TFTP_FREE(h);
+        return -1;
+    }
+
+    tftp_cache_lock(cache);
+    tftp_cache_file_t* file = tftp_cache_find_file(cache, filename);
+    if (write) {
+        // 写入的文件不经过缓存, 已缓存的内容失效
+        h->write = true;
+        strncpy(h->name, filename, sizeof(h->name) - 1);
+        if (file) {
+            tftp_cache_invalidate(cache, file);
+        }
+    } else {
+        if (!file) {
+            file = tftp_cache_alloc_file(cache);
+            if (file) {
+                strncpy(file->name, filename, sizeof(file->name) - 1);
+            } else {
+                // 所有表项都有会话打开, 使用句柄私有的表项, 关闭时释放其所有段
+                file = &h->own;
+            }
+        }
+        file->opens++;
+        h->file = file;
+    }
+    tftp_cache_unlock(cache);
+
+    *handle = h;
+    return 0;
+}
+
+// 按块顺序读取时返回offset处最多max_size字节的引用, 同一句柄只引用最近的两个段
+static int tftp_cache_map(void* user_data, void* handle, uint64_t offset,
+                          const uint8_t** data, size_t max_size) {
+    tftp_cache_t* cache = (tftp_cache_t*)user_data;
+    tftp_cache_handle_t* h = (tftp_cache_handle_t*)handle;
+
+    if (!h->file || max_size == 0) {
+        return -1;
+    }
+
+    uint64_t chunk_size = (uint64_t)max_size * TFTP_CACHE_CHUNK_BLOCKS;
+    uint32_t index = (uint32_t)(offset / chunk_size);
+    tftp_cache_chunk_t* c = NULL;
+
+    for (int i = 0; i < 2; i++) {
+        if (h->pinned[i] && h->pinned[i]->block_size == max_size && h->pinned[i]->index == index) {
+            c = h->pinned[i];
+            break;
+        }
+    }
+
+    if (!c) {
+        c = tftp_cache_acquire(cache, h, (uint32_t)max_size, index);
+        if (!c) {
+            return -1;
+        }
+        if (h->pinned[1]) {
+            tftp_cache_release(cache, h->pinned[1]);
+        }
+        h->pinned[1] = h->pinned[0];
+        h->pinned[0] = c;
+    }
+
+    size_t pos = (size_t)(offset - (uint64_t)index * chunk_size);
+    if (pos >= c->len) {
+        *data = NULL;
+        return 0;
+    }
+
+    size_t len = c->len - pos < max_size ? c->len - pos : max_size;
+    *data = c->data + pos;
+    return (int)len;
+}
+
+static int tftp_cache_read(void* user_data, void* handle, uint64_t offset,
+                           uint8_t* buffer, size_t max_size) {
+    tftp_cache_handle_t* h = (tftp_cache_handle_t*)handle;
+
+    if (!h->file) {
+        return -1;
+    }
+
+    const uint8_t* data;
+    int len = tftp_cache_map(user_data, handle, offset, &data, max_size);
+    if (len > 0) {
+        memcpy(buffer, data, len);
+    }
+    return len;
+}
+
+static int tftp_cache_write(void* user_data, void* handle, uint64_t offset,
+                            const uint8_t* data, size_t size) {
+    tftp_cache_t* cache = (tftp_cache_t*)user_data;
+    tftp_cache_handle_t* h = (tftp_cache_handle_t*)handle;
+
+    if (!cache->backend->write) {
+        return -1;
+    }
+    return cache->backend->write(cache->backend_data, h->backend, offset, data, size);
+}
+
+static int tftp_cache_size(void* user_data, void* handle, uint64_t* size) {
+    tftp_cache_t* cache = (tftp_cache_t*)user_data;
+    tftp_cache_handle_t* h = (tftp_cache_handle_t*)handle;
+
+    if (!cache->backend->size) {
+        return -1;
+    }
+    return cache->backend->size(cache->backend_data, h->backend, size);
+}
+
+static void tftp_cache_close(void* user_data, void* handle) {
+    tftp_cache_t* cache = (tftp_cache_t*)user_data;
+    tftp_cache_handle_t* h = (tftp_cache_handle_t*)handle;
+
+    for (int i = 0; i < 2; i++) {
+        if (h->pinned[i]) {
+            tftp_cache_release(cache, h->pinned[i]);
+        }
+    }
+
+    if (cache->backend->close) {
+        cache->backend->close(cache->backend_data, h->backend);
+    }
+
+    tftp_cache_lock(cache);
+    if (h->file) {
+        h->file->opens--;
+        if (h->file == &h->own) {
+            tftp_cache_invalidate(cache, &h->own);
+        }
+    } else if (h->write) {
+        // 写入期间打开的读请求可能缓存了部分内容
+        tftp_cache_file_t* file = tftp_cache_find_file(cache, h->name);
+        if (file) {
+            tftp_cache_invalidate(cache, file);
+        }
+    }
+    tftp_cache_unlock(cache);
+    TFTP_FREE(h);
+}
+
+const tftp_server_provider_t tftp_cache_provider = {
+    .open = tftp_cache_open,
+    .read = tftp_cache_read,
+    .write = tftp_cache_write,
+    .close = tftp_cache_close,
+    .map = tftp_cache_map,
+    .size = tftp_cache_size
+};
+
+int tftp_cache_init(tftp_cache_t* cache, const tftp_server_provider_t* backend,
+                    void* backend_data, size_t budget) {
+    if (!cache || !backend || !backend->open || !backend->read) {
+        return -1;
+    }
+
+    memset(cache, 0, sizeof(*cache));
+    cache->backend = backend;
+    cache->backend_data = backend_data;
+    cache->budget = budget;
+    return 0;
+}
+
+void tftp_cache_deinit(tftp_cache_t* cache) {
+    tftp_cache_lock(cache);
+    for (uint32_t i = 0; i < TFTP_CACHE_HASH_SIZE; i++) {
+        while (cache->hash[i]) {
+            tftp_cache_free_chunk(cache, cache->hash[i]);
+        }
+    }
+    tftp_cache_unlock(cache);
+}
+
+void tftp_cache_get_stats(tftp_cache_t* cache, tftp_cache_stats_t* stats) {
+    tftp_cache_lock(cache);
+    *stats = cache->stats;
+    tftp_cache_unlock(cache);
+}
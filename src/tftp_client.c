@@ -2,199 +2,748 @@
 #include "net_wrapper.h"
 #include <string.h>
 
-static int tftp_send_request(tftp_session_t* session, tftp_opcode_t opcode,
-                            const char* filename, const char* mode) {
-    uint8_t packet[2 + 256 + 1 + 32 + 1 + 64]; // 文件名+模式+选项
+// 构建请求报文, 返回长度
+static int tftp_build_request(tftp_session_t* session, tftp_opcode_t opcode, const char* filename,
+                              const char* mode, uint8_t* packet, size_t size) {
     uint8_t* p = packet;
     
+    mode = mode ? mode : "octet";
+    if (strlen(filename) >= TFTP_FILENAME_MAX || strlen(mode) > 32) {
+        NET_LOGE("Filename too long");
+        return -1;
+    }
+    
     // 构建基本请求
     *((uint16_t*)p) = htons(opcode);
     p += 2;
     strcpy((char*)p, filename);
     p += strlen(filename) + 1;
-    strcpy((char*)p, mode ? mode : "octet");
-    p += strlen((char*)p) + 1;
+    strcpy((char*)p, mode);
+    p += strlen(mode) + 1;
     
     // 添加选项
-    int opt_len = tftp_build_options(&session->options, p, sizeof(packet) - (p - packet));
+    int opt_len = tftp_build_options(&session->options, p, size - (p - packet));
     if (opt_len > 0) {
         p += opt_len;
     }
+    return (int)(p - packet);
+}
+
+// 绑定本地端口, 未指定时分配动态端口并跳过已被其他传输绑定的端口
+// 指定的端口已被绑定时失败
+static int tftp_client_bind_port(tftp_session_t* session) {
+    if (session->local_port != 0) {
+        return udp_bind(session->stack, session->local_port);
+    }
     
-    return udp_send(session->peer_ip, session->local_port, session->peer_port,
-                   packet, p - packet);
+    for (int i = 0; i <= NET_SOCKET_MAX; i++) {
+        uint16_t port = tftp_alloc_local_port(session->stack);
+        if (udp_bind(session->stack, port) == 0) {
+            session->local_port = port;
+            return 0;
+        }
+    }
+    return -1;
 }
 
-int tftp_client_put(tftp_session_t* session, const char* filename, 
-                   tftp_get_data_callback get_data, void* user_data) {
-    // 发送WRQ请求
-    if (tftp_send_request(session, TFTP_WRQ, filename, "octet") < 0) {
+// 从已绑定的本地端口发送请求, 开始新的传输
+static int tftp_send_request_packet(tftp_session_t* session, const uint8_t* packet, size_t len) {
+    if (udp_send(session->stack, session->peer_ip, session->local_port, session->peer_port,
+                 packet, len) < 0) {
         return -1;
     }
     
-    // 等待ACK或OACK
-    tftp_opcode_t opcode;
-    uint8_t data[TFTP_PACKET_MAX_SIZE];
-    size_t data_len;
-    int ret = tftp_receive_packet(session, &opcode, data, &data_len, session->options.timeout_ms);
+    // 服务器会从新的端口应答(RFC 1350)，清零以便锁定其TID
+    session->peer_port = 0;
     
-    if (ret < 0) return -1;
+    // 新传输重新统计和估计RTT, 以请求到首个应答的时间作为第一个样本
+    memset(&session->stats, 0, sizeof(session->stats));
+    tftp_rtt_reset(session);
+    tftp_rtt_start(session, 0);
+    return 0;
+}
+
+static int tftp_send_request(tftp_session_t* session, tftp_opcode_t opcode,
+                            const char* filename, const char* mode) {
+    uint8_t packet[TFTP_CLIENT_REQUEST_SIZE];
+    int len = tftp_build_request(session, opcode, filename, mode, packet, sizeof(packet));
     
-    // 处理OACK
-    if (opcode == TFTP_OACK && session->options.wait_oack) {
-        tftp_options_t negotiated = session->options;
-        tftp_parse_options(data, data_len, &negotiated);
-        
-        // 发送ACK0确认选项
-        uint16_t ack_packet[2] = {htons(TFTP_ACK), htons(0)};
-        if (udp_send(session->peer_ip, session->local_port, session->peer_port,
-                    (uint8_t*)ack_packet, sizeof(ack_packet)) < 0) {
+    if (len < 0) {
+        return -1;
+    }
+    return tftp_send_request_packet(session, packet, len);
+}
+
+// 协商的选项恢复为默认值: 服务器未确认的选项视为拒绝(RFC 2347)
+static void tftp_client_default_options(tftp_options_t* options) {
+    options->block_size = TFTP_DEFAULT_BLOCK_SIZE;
+    options->window_size = TFTP_DEFAULT_WINDOW_SIZE;
+    options->rollover = 0;
+    options->transfer_size = 0;
+    options->has_tsize = false;
+}
+
+// 服务器未回应OACK时, 选项恢复为默认值
+static void tftp_client_reset_options(tftp_session_t* session) {
+    tftp_client_default_options(&session->options);
+}
+
+// 结束传输并释放本地端口
+static int tftp_client_finish(tftp_client_xfer_t* xfer, int result) {
+    tftp_session_t* session = xfer->session;
+    
+    tftp_window_free(&xfer->window);
+    udp_unbind(session->stack, session->local_port);
+    xfer->state = result == 0 ? TFTP_XFER_DONE : TFTP_XFER_FAILED;
+    return result;
+}
+
+static int tftp_client_start(tftp_client_xfer_t* xfer, tftp_session_t* session, tftp_opcode_t opcode,
+                             const char* filename) {
+    xfer->session = session;
+    xfer->server_port = session->peer_port;
+    xfer->attempts = 1;
+    
+    int len = tftp_build_request(session, opcode, filename, "octet", xfer->request, sizeof(xfer->request));
+    if (len < 0) {
+        xfer->state = TFTP_XFER_FAILED;
+        return -1;
+    }
+    xfer->request_len = len;
+    
+    // 端口未绑定成功时不能在结束时解绑, 它可能属于其他传输
+    if (tftp_client_bind_port(session) < 0) {
+        xfer->state = TFTP_XFER_FAILED;
+        return -1;
+    }
+    if (tftp_send_request_packet(session, xfer->request, xfer->request_len) < 0) {
+        tftp_client_finish(xfer, -1);
+        return -1;
+    }
+    xfer->last_ms = net_get_time_ms();
+    return 0;
+}
+
+int tftp_client_start_get(tftp_client_xfer_t* xfer, tftp_session_t* session, const char* filename,
+                          tftp_size_callback size_cb, tftp_data_callback data_cb, void* user_data) {
+    memset(xfer, 0, sizeof(*xfer));
+    xfer->size_cb = size_cb;
+    xfer->data_cb = data_cb;
+    xfer->user_data = user_data;
+    
+    // 以tsize 0请求服务器报告文件大小(RFC 2349)
+    session->options.transfer_size = 0;
+    session->options.has_tsize = true;
+    return tftp_client_start(xfer, session, TFTP_RRQ, filename);
+}
+
+int tftp_client_start_put(tftp_client_xfer_t* xfer, tftp_session_t* session, const char* filename,
+                          tftp_get_data_callback get_data, void* user_data) {
+    memset(xfer, 0, sizeof(*xfer));
+    xfer->write = true;
+    xfer->get_data = get_data;
+    xfer->user_data = user_data;
+    return tftp_client_start(xfer, session, TFTP_WRQ, filename);
+}
+
+// 发送窗口内尚未发送的块
+static int tftp_client_put_send(tftp_client_xfer_t* xfer) {
+    tftp_session_t* session = xfer->session;
+    
+    if (tftp_window_fill(&xfer->window, xfer->get_data, xfer->user_data) < 0 ||
+        tftp_window_send(session, &xfer->window) < 0) {
+        return -1;
+    }
+    session->block_num = tftp_window_block(&xfer->window, xfer->window.sent);
+    xfer->last_ms = net_get_time_ms();
+    return 0;
+}
+
+// 上传: 首个应答为OACK或ACK0, 之后处理数据块的确认
+static int tftp_client_put_input(tftp_client_xfer_t* xfer, uint16_t opcode,
+                                 const uint8_t* data, size_t data_len) {
+    tftp_session_t* session = xfer->session;
+    
+    if (xfer->state == TFTP_XFER_REQUEST) {
+        // 处理OACK, 对WRQ的OACK直接以DATA1应答
+        if (opcode == TFTP_OACK) {
+            // OACK中未出现的选项按默认值处理
+            tftp_options_t negotiated = session->options;
+            tftp_client_default_options(&negotiated);
+            tftp_parse_options(data, data_len, &negotiated);
+            session->options = negotiated;
+        } else if (opcode == TFTP_ACK && data_len >= 2 && ntohs(*(uint16_t*)data) == 0) {
+            tftp_client_reset_options(session);
+        } else {
+            NET_LOGE("Invalid first packet");
             return -1;
         }
         
-        session->options = negotiated;
-    } else if (opcode != TFTP_ACK) {
-        return -1;
+        // 开始发送数据
+        if (tftp_window_init(&xfer->window, &session->options, true) < 0) {
+            return -1;
+        }
+        xfer->state = TFTP_XFER_DATA;
+        session->retry_count = 0;
+        return tftp_client_put_send(xfer);
     }
     
-    // 开始发送数据
-    uint8_t buffer[session->options.block_size];
-    session->block_num = 1;
+    if (opcode == TFTP_ERROR) {
+        NET_LOGE("Received ERROR packet");
+        return -1;
+    }
+    if (opcode != TFTP_ACK || data_len < 2) {
+        return 0;
+    }
     
-    while (1) {
-        size_t bytes_read = get_data(user_data, buffer, session->options.block_size);
-        if (bytes_read == 0) break;
-        
+    if (tftp_window_on_ack(&xfer->window, ntohs(*(uint16_t*)data))) {
+        tftp_rtt_sample(session, xfer->window.base);
         session->retry_count = 0;
-        bool ack_received = false;
+        if (tftp_window_done(&xfer->window)) {
+            return 1; // 最后一个包已确认
+        }
+    } else {
+        TFTP_STAT_ADD(session, dup_acks, 1);
+    }
+    return tftp_client_put_send(xfer);
+}
+
+// 下载: 首个应答为OACK或DATA1, 之后按窗口接收数据块
+static int tftp_client_get_input(tftp_client_xfer_t* xfer, uint16_t opcode,
+                                 const uint8_t* data, size_t data_len) {
+    tftp_session_t* session = xfer->session;
+    
+    if (xfer->state == TFTP_XFER_REQUEST) {
+        NET_LOGD("Received opcode: %u, wait oack: %d", opcode, session->options.wait_oack);
         
-        while (session->retry_count < session->options.retries && !ack_received) {
-            if (tftp_send_packet(session, TFTP_DATA, buffer, bytes_read) < 0) {
+        if (opcode == TFTP_OACK) {
+            // OACK中未出现的选项按默认值处理
+            tftp_options_t negotiated = session->options;
+            tftp_client_default_options(&negotiated);
+            tftp_parse_options(data, data_len, &negotiated);
+            
+            NET_LOGD("Get OACK, Negotiated options: block_size=%u, timeout_ms=%u, window_size=%u",
+                     negotiated.block_size, negotiated.timeout_ms, negotiated.window_size);
+            
+            // 数据到达前通知文件大小, 接收方无法容纳时终止传输
+            if (negotiated.has_tsize && xfer->size_cb &&
+                xfer->size_cb(xfer->user_data, negotiated.transfer_size) != 0) {
+                tftp_send_error_from(session->stack, session->local_port, session->peer_ip,
+                                     session->peer_port, TFTP_ERR_DISK_FULL, "File too large");
                 return -1;
             }
             
-            ret = tftp_receive_packet(session, &opcode, data, &data_len, 
-                                     session->options.timeout_ms);
-            if (ret == 0 && opcode == TFTP_ACK && 
-                session->block_num == ntohs(*(uint16_t*)data)) {
-                ack_received = true;
-            } else {
-                session->retry_count++;
+            // 发送ACK0确认选项
+            if (tftp_send_ack(session, 0) < 0) {
+                NET_LOGE("Failed to send ACK0");
+                return -1;
             }
+            tftp_rtt_start(session, 1);
+            session->options = negotiated;
+        } else if (opcode == TFTP_DATA && data_len >= 2 && ntohs(*(uint16_t*)data) == 1) {
+            // 服务器忽略了选项, 直接发送了第一个数据块
+            tftp_client_reset_options(session);
+            NET_LOGD("GET First DATA without OACK");
+        } else {
+            NET_LOGE("Invalid first packet");
+            return -1;
         }
         
-        if (!ack_received) {
+        if (tftp_window_init(&xfer->window, &session->options, false) < 0) {
             return -1;
         }
-        
-        session->block_num++;
-        if (bytes_read < session->options.block_size) {
-            break; // 最后一个包
+        xfer->state = TFTP_XFER_DATA;
+        session->retry_count = 0;
+    }
+    
+    if (opcode == TFTP_ERROR) {
+        NET_LOGE("Received ERROR packet");
+        return -1;
+    }
+    if (opcode != TFTP_DATA || data_len < 2) {
+        return 0;
+    }
+    
+    tftp_window_t* window = &xfer->window;
+    bool send_ack;
+    uint16_t block_num = ntohs(*(uint16_t*)data);
+    
+    if (tftp_window_on_data(window, block_num, data_len - 2, &send_ack)) {
+        tftp_rtt_sample(session, window->base);
+        TFTP_STAT_ADD(session, rx_blocks, 1);
+        TFTP_STAT_ADD(session, rx_bytes, data_len - 2);
+        // 调用回调处理数据
+        if (xfer->data_cb(xfer->user_data, data + 2, data_len - 2) != 0) {
+            NET_LOGE("Data callback failed");
+            return -1;
+        }
+        session->block_num = block_num;
+        session->retry_count = 0;
+    } else {
+        TFTP_STAT_ADD(session, out_of_order, 1);
+    }
+    
+    // 窗口结束、最后一块或检测到丢包时发送ACK, 以ACK到下一个新块的时间作为RTT样本
+    if (send_ack) {
+        if (tftp_send_ack(session, tftp_window_block(window, window->base)) < 0) {
+            return -1;
         }
+        tftp_rtt_start(session, window->base + 1);
     }
     
+    if (window->eof) {
+        NET_LOGD("Last packet received");
+        return 1;
+    }
     return 0;
 }
 
-int tftp_client_get(tftp_session_t* session, const char* filename,
-                   tftp_data_callback data_cb, void* user_data) {
-    // 发送RRQ请求
-    if (tftp_send_request(session, TFTP_RRQ, filename, "octet") < 0) {
+// 处理一个到达本地端口的包, 返回1表示传输完成, -1表示失败
+static int tftp_client_input(tftp_client_xfer_t* xfer, net_pbuf_t* p) {
+    tftp_session_t* session = xfer->session;
+    
+    // 验证源IP和端口(peer_port为0时接受对端的第一个TID)
+    if (p->src_ip != session->peer_ip ||
+        (session->peer_port != 0 && p->src_port != session->peer_port)) {
+        // 其他传输的包: 通知对方TID错误(RFC 1350)
+        NET_LOGW_RATELIMIT("Unknown TID %u.%u.%u.%u:%u",
+                 (p->src_ip >> 24) & 0xFF, (p->src_ip >> 16) & 0xFF,
+                 (p->src_ip >> 8) & 0xFF, p->src_ip & 0xFF, p->src_port);
+        tftp_send_error_from(session->stack, session->local_port, p->src_ip, p->src_port,
+                             TFTP_ERR_UNKNOWN_ID, "Unknown transfer ID");
+        TFTP_STAT_ADD(session, wrong_peer, 1);
+        return 0;
+    }
+    if (p->len < 2) {
+        return 0;
+    }
+    
+    if (session->peer_port == 0) {
+        session->peer_port = p->src_port;
+    }
+    
+    uint16_t opcode = ntohs(*(uint16_t*)p->payload);
+    const uint8_t* data = p->payload + 2;
+    size_t data_len = p->len - 2;
+    
+    if (xfer->state == TFTP_XFER_REQUEST) {
+        tftp_rtt_sample(session, 0);
+    }
+    xfer->last_ms = net_get_time_ms();
+    
+    if (xfer->write) {
+        return tftp_client_put_input(xfer, opcode, data, data_len);
+    }
+    return tftp_client_get_input(xfer, opcode, data, data_len);
+}
+
+// 超时: 首个应答前重发请求, 之后退避并重发窗口(上传)或最后的确认(下载)
+static int tftp_client_timeout(tftp_client_xfer_t* xfer) {
+    tftp_session_t* session = xfer->session;
+    
+    xfer->last_ms = net_get_time_ms();
+    
+    if (xfer->state == TFTP_XFER_REQUEST) {
+        if (xfer->attempts >= session->options.retries) {
+            NET_LOGE("Failed to receive packet");
+            return -1;
+        }
+        xfer->attempts++;
+        TFTP_STAT_ADD(session, timeouts, 1);
+        session->rtt_timing = false; // 无法区分应答对应哪一次请求(Karn算法)
+        if (udp_send(session->stack, session->peer_ip, session->local_port, xfer->server_port,
+                     xfer->request, xfer->request_len) < 0) {
+            return -1;
+        }
+        return 0;
+    }
+    
+    if (tftp_rtt_backoff(session) < 0) {
+        return -1;
+    }
+    if (xfer->write) {
+        // 从最后确认的块开始重发
+        tftp_window_rewind(&xfer->window);
+        return tftp_client_put_send(xfer);
+    }
+    // 重新确认最后按序收到的块
+    return tftp_send_ack(session, tftp_window_block(&xfer->window, xfer->window.base));
+}
+
+static uint32_t tftp_client_timeout_ms(const tftp_client_xfer_t* xfer) {
+    if (xfer->state == TFTP_XFER_REQUEST) {
+        return xfer->session->options.timeout_ms;
+    }
+    return tftp_rto(xfer->session);
+}
+
+uint32_t tftp_client_next_timeout(const tftp_client_xfer_t* xfer) {
+    if (xfer->state >= TFTP_XFER_DONE) {
+        return 0;
+    }
+    
+    uint32_t elapsed = net_get_time_ms() - xfer->last_ms;
+    uint32_t timeout = tftp_client_timeout_ms(xfer);
+    return elapsed < timeout ? timeout - elapsed : 0;
+}
+
+// 最多等待timeout_ms直到本地端口有包, 处理所有已到达的包和到期的超时
+static int tftp_client_advance(tftp_client_xfer_t* xfer, int timeout_ms) {
+    tftp_session_t* session = xfer->session;
+    net_pbuf_t* pkts[NET_RX_BATCH_MAX];
+    int ret = 0;
+    int n;
+    
+    if (xfer->state >= TFTP_XFER_DONE) {
+        return xfer->state == TFTP_XFER_DONE ? 0 : -1;
+    }
+    
+    tftp_stats_tick();
+    
+    // 不足一批时队列已空
+    do {
+        n = udp_receive_burst(session->stack, session->local_port, pkts, NET_RX_BATCH_MAX, timeout_ms);
+        for (int i = 0; i < n && ret == 0; i++) {
+            ret = tftp_client_input(xfer, pkts[i]);
+        }
+        if (n > 0) {
+            udp_release_burst(pkts, n);
+        }
+        timeout_ms = 0;
+    } while (ret == 0 && n == NET_RX_BATCH_MAX);
+    
+    if (ret == 0 && tftp_client_next_timeout(xfer) == 0) {
+        ret = tftp_client_timeout(xfer);
+    }
+    
+    if (ret != 0) {
+        return tftp_client_finish(xfer, ret > 0 ? 0 : -1);
+    }
+    return 1;
+}
+
+int tftp_client_step(tftp_client_xfer_t* xfer) {
+    return tftp_client_advance(xfer, 0);
+}
+
+void tftp_client_cancel(tftp_client_xfer_t* xfer) {
+    tftp_session_t* session = xfer->session;
+    
+    if (xfer->state >= TFTP_XFER_DONE) {
+        return;
+    }
+    if (session->peer_port != 0) {
+        tftp_send_error_from(session->stack, session->local_port, session->peer_ip,
+                             session->peer_port, TFTP_ERR_NOT_DEFINED, "Transfer cancelled");
+    }
+    tftp_client_finish(xfer, -1);
+}
+
+void tftp_client_loop_init(tftp_client_loop_t* loop, net_stack_t* stack) {
+    memset(loop, 0, sizeof(*loop));
+    loop->stack = stack;
+}
+
+int tftp_client_loop_add(tftp_client_loop_t* loop, tftp_client_xfer_t* xfer,
+                         tftp_xfer_done_callback done_cb, void* user_data) {
+    if (!xfer->session || xfer->session->stack != loop->stack) {
         return -1;
     }
     
-    // 等待DATA或OACK
+    xfer->done_cb = done_cb;
+    xfer->done_arg = user_data;
+    xfer->next = loop->head;
+    loop->head = xfer;
+    loop->count++;
+    return 0;
+}
+
+// 推进所有传输一次, 结束的传输移出循环后再回调(回调中可以加入新的传输)
+// 返回距离最早的超时的毫秒数
+static uint32_t tftp_client_loop_run(tftp_client_loop_t* loop, uint32_t wait_ms) {
+    tftp_client_xfer_t** link = &loop->head;
+    
+    while (*link) {
+        tftp_client_xfer_t* xfer = *link;
+        int ret = tftp_client_step(xfer);
+        
+        if (ret > 0) {
+            uint32_t timeout = tftp_client_next_timeout(xfer);
+            if (timeout < wait_ms) {
+                wait_ms = timeout;
+            }
+            link = &xfer->next;
+            continue;
+        }
+        
+        *link = xfer->next;
+        xfer->next = NULL;
+        loop->count--;
+        if (xfer->done_cb) {
+            xfer->done_cb(xfer, ret, xfer->done_arg);
+        }
+        wait_ms = 0; // 回调中加入的传输在下一轮推进
+    }
+    return wait_ms;
+}
+
+int tftp_client_loop_poll(tftp_client_loop_t* loop, int timeout_ms) {
+    // 先取得序号再逐个端口接收, 之后到达的包使udp_wait立即返回, 由下一次调用处理
+    uint32_t seq = udp_rx_seq(loop->stack);
+    uint32_t wait_ms = tftp_client_loop_run(loop, timeout_ms > 0 ? (uint32_t)timeout_ms : 0);
+    
+    if (loop->count > 0 && wait_ms > 0) {
+        udp_wait(loop->stack, seq, (int)wait_ms);
+    }
+    return loop->count;
+}
+
+// 多播下载: 按块号记录收到的块, 主客户端确认已连续收到的位置, 其他成员只接收
+static int tftp_client_do_get_multicast(tftp_session_t* session, const char* filename,
+                                        tftp_size_callback size_cb, tftp_write_callback write_cb,
+                                        void* user_data) {
+    // 请求多播和文件大小, 多播传输由主客户端逐块确认
+    session->options.multicast = true;
+    session->options.mcast_master = false;
+    session->options.mcast_port = 0;
+    session->options.mcast_ip = 0;
+    session->options.window_size = TFTP_DEFAULT_WINDOW_SIZE;
+    session->options.transfer_size = 0;
+    session->options.has_tsize = true;
+    
+    // 请求或首个应答丢失时重发请求, 服务器对已加入的成员会再次回应OACK
     tftp_opcode_t opcode;
     uint8_t data[TFTP_PACKET_MAX_SIZE];
     size_t data_len;
-    int ret = tftp_receive_packet(session, &opcode, data, &data_len, 
-                                 session->options.timeout_ms);
-    
-    if (ret < 0) {
-        NET_LOGE("Failed to receive packet");
-        return -1;
+    uint16_t server_port = session->peer_port;
+    uint8_t attempts = 0;
+    while (1) {
+        session->peer_port = server_port;
+        if (tftp_send_request(session, TFTP_RRQ, filename, "octet") < 0) {
+            return -1;
+        }
+        if (tftp_receive_packet(session, &opcode, data, sizeof(data), &data_len,
+                                session->options.timeout_ms) == 0) {
+            break;
+        }
+        if (++attempts >= session->options.retries) {
+            NET_LOGE("Failed to receive packet");
+            return -1;
+        }
     }
-
-    NET_LOGD("Received opcode: %u, wait oack: %d", opcode, session->options.wait_oack);
+    tftp_rtt_sample(session, 0);
     
-    // 处理OACK
-    if (opcode == TFTP_OACK && session->options.wait_oack) {
+    bool master = true; // 单播时本客户端即为确认方
+    if (opcode == TFTP_OACK) {
+        // 加入已有传输时以服务器的参数为准, OACK中未出现的选项按默认值处理
         tftp_options_t negotiated = session->options;
+        tftp_client_default_options(&negotiated);
+        negotiated.multicast = false;
         tftp_parse_options(data, data_len, &negotiated);
-
-        NET_LOGD("Get OACK, Negotiated options: block_size=%u, timeout_ms=%u",
-                 negotiated.block_size, negotiated.timeout_ms);
         
-        // 发送ACK0确认选项
-        uint16_t ack_packet[2] = {htons(TFTP_ACK), htons(0)};
-        if (udp_send(session->peer_ip, session->local_port, session->peer_port,
-                    (uint8_t*)ack_packet, sizeof(ack_packet)) < 0) {
-            NET_LOGE("Failed to send ACK0");
+        if (negotiated.multicast &&
+            (!negotiated.has_tsize || !net_ip_is_multicast(negotiated.mcast_ip) ||
+             udp_join_group(session->stack, negotiated.mcast_ip, negotiated.mcast_port,
+                            session->local_port) < 0)) {
+            tftp_send_error_from(session->stack, session->local_port, session->peer_ip,
+                                 session->peer_port, TFTP_ERR_OPTION_NEGOTIATION, "Multicast not usable");
             return -1;
         }
-        
         session->options = negotiated;
-        session->block_num = 1;
-        NET_LOGD("Waiting for DATA or ACK");
-    } else if (opcode != TFTP_DATA || ntohs(*(uint16_t*)data) != 0) {
-        NET_HEX_DUMP(data, data_len);
+        master = !negotiated.multicast || negotiated.mcast_master;
+        
+        if (negotiated.has_tsize && size_cb &&
+            size_cb(user_data, negotiated.transfer_size) != 0) {
+            tftp_send_error_from(session->stack, session->local_port, session->peer_ip,
+                                 session->peer_port, TFTP_ERR_DISK_FULL, "File too large");
+            return -1;
+        }
+        
+        if (master) {
+            if (tftp_send_ack(session, 0) < 0) {
+                return -1;
+            }
+            tftp_rtt_start(session, 1);
+        }
+        opcode = TFTP_ACK; // 无数据需要处理
+    } else if (opcode == TFTP_DATA && ntohs(*(uint16_t*)data) == 1) {
+        // 服务器忽略了选项, 按单播接收
+        tftp_client_reset_options(session);
+        session->options.multicast = false;
+    } else {
         NET_LOGE("Invalid first packet");
         return -1;
     }
-    else if (opcode == TFTP_DATA && !session->options.wait_oack) {
-        session->block_num = 0;
-        NET_LOGD("GET Fisrt DATA without OACK");
-    }
-    else {
-        session->block_num = 1;
-        NET_LOGD("GET DATA");
-    }
     
-    // 开始接收数据
-    // session->block_num = 1;
-    bool last_packet = false;
+    tftp_window_t window;           // base为已连续收到的块数
+    uint8_t* received = NULL;       // 多播: 各块是否已收到
+    uint32_t last = 0;              // 多播: 最后一块的逻辑块号
+    uint32_t count = 0;             // 多播: 已收到的块数
+    uint32_t highest = 0;           // 收到的最大块号, 作为换算回绕块号的参照
+    uint16_t block_size = session->options.block_size;
+    int ret = -1;
     
-    while (!last_packet) {
-        // 处理数据包
-        if (opcode == TFTP_DATA) {
-            NET_LOGD("Received DATA block %u", session->block_num);
-            NET_HEX_DUMP(data, data_len);
+    tftp_window_init(&window, &session->options, false);
+    if (session->options.multicast) {
+        last = (uint32_t)(session->options.transfer_size / block_size) + 1;
+        received = TFTP_MALLOC(last / 8 + 1);
+        if (!received) {
+            return -1;
+        }
+        memset(received, 0, last / 8 + 1);
+    }
+    session->retry_count = 0;
+    
+    while (1) {
+        if (opcode == TFTP_DATA && data_len >= 2) {
             uint16_t block_num = ntohs(*(uint16_t*)data);
-            if (block_num == session->block_num) {
-                // 调用回调处理数据
-                if (data_cb(user_data, data + 2, data_len - 2) != 0) {
-                    NET_LOGE("Data callback failed");
-                    return -1;
+            uint32_t n = highest + tftp_window_distance(&window, highest, block_num);
+            size_t len = data_len - 2;
+            bool fresh = false;
+            bool done;
+            
+            if (received) {
+                // 组中的块可能乱序到达, 按块号写入各自的位置
+                if (n >= 1 && n <= last && !(received[n / 8] & (1u << (n % 8)))) {
+                    if (write_cb(user_data, (uint64_t)(n - 1) * block_size, data + 2, len) != 0) {
+                        NET_LOGE("Data callback failed");
+                        break;
+                    }
+                    received[n / 8] |= 1u << (n % 8);
+                    count++;
+                    fresh = true;
+                    if (n > highest) {
+                        highest = n;
+                    }
                 }
-                
-                // 发送ACK
-                uint16_t ack_packet[2] = {htons(TFTP_ACK), htons(session->block_num)};
-                if (udp_send(session->peer_ip, session->local_port, session->peer_port,
-                            (uint8_t*)ack_packet, sizeof(ack_packet)) < 0) {
-                    return -1;
+                while (window.base < last &&
+                       (received[(window.base + 1) / 8] & (1u << ((window.base + 1) % 8)))) {
+                    window.base++;
                 }
-                
-                // 检查是否为最后一个包
-                if (data_len - 2 < session->options.block_size) {
-                    last_packet = true;
-                    NET_LOGD("Last packet received");
-                } else {
-                    session->block_num++;
+                done = count == last;
+            } else {
+                if (!window.eof && n == window.base + 1) {
+                    if (write_cb(user_data, window.offset, data + 2, len) != 0) {
+                        NET_LOGE("Data callback failed");
+                        break;
+                    }
+                    window.base = n;
+                    window.offset += len;
+                    window.eof = len < block_size;
+                    highest = n;
+                    fresh = true;
+                }
+                done = window.eof;
+            }
+            
+            if (fresh) {
+                tftp_rtt_sample(session, window.base);
+                TFTP_STAT_ADD(session, rx_blocks, 1);
+                TFTP_STAT_ADD(session, rx_bytes, len);
+                session->block_num = block_num;
+                session->retry_count = 0;
+            } else {
+                TFTP_STAT_ADD(session, out_of_order, 1);
+            }
+            
+            // 主客户端每块都确认已连续收到的位置; 其他成员收齐后确认最后一块, 通知服务器退出
+            if (master || done) {
+                if (tftp_send_ack(session, tftp_window_block(&window, window.base)) < 0) {
+                    break;
                 }
+                tftp_rtt_start(session, window.base + 1);
+            }
+            
+            if (done) {
+                ret = 0;
+                break;
+            }
+        } else if (opcode == TFTP_OACK) {
+            // 被指定为新的主客户端: 确认已连续收到的位置, 服务器从该处继续发送
+            tftp_options_t update = session->options;
+            update.mcast_master = false;
+            tftp_parse_options(data, data_len, &update);
+            if (update.mcast_master && !master) {
+                master = true;
+                session->options.mcast_master = true;
+                tftp_rtt_reset(session);
+            }
+            if (master) {
+                if (tftp_send_ack(session, tftp_window_block(&window, window.base)) < 0) {
+                    break;
+                }
+                tftp_rtt_start(session, window.base + 1);
             }
         } else if (opcode == TFTP_ERROR) {
             NET_LOGE("Received ERROR packet");
-            return -1;
+            break;
         }
         
-        // 接收下一个包
-        if (!last_packet) {
-            NET_LOGD("Waiting for next packet");
-            ret = tftp_receive_packet(session, &opcode, data, &data_len, 
-                                     session->options.timeout_ms);
-            if (ret < 0) return -1;
+        // 非主客户端不发送确认, 等待完整的超时时间
+        if (tftp_receive_packet(session, &opcode, data, sizeof(data), &data_len,
+                                master ? tftp_rto(session) : session->options.timeout_ms) < 0) {
+            if (tftp_rtt_backoff(session) < 0) {
+                break;
+            }
+            opcode = TFTP_ACK; // 无数据需要处理
+            if (master && tftp_send_ack(session, tftp_window_block(&window, window.base)) < 0) {
+                break;
+            }
         }
     }
     
-    return 0;
-}
\ No newline at end of file
+    if (received) {
+        TFTP_FREE(received);
+    }
+    return ret;
+}
+
+// 推进单个传输直到结束, 只有一个端口时直接在该端口上等待到下一次超时
+static int tftp_client_run(tftp_client_xfer_t* xfer) {
+    int ret;
+    
+    while ((ret = tftp_client_advance(xfer, (int)tftp_client_next_timeout(xfer))) > 0) {
+    }
+    return ret;
+}
+
+int tftp_client_put(tftp_session_t* session, const char* filename, 
+                   tftp_get_data_callback get_data, void* user_data) {
+    tftp_client_xfer_t xfer;
+    
+    if (tftp_client_start_put(&xfer, session, filename, get_data, user_data) < 0) {
+        return -1;
+    }
+    return tftp_client_run(&xfer);
+}
+
+int tftp_client_get(tftp_session_t* session, const char* filename,
+                   tftp_data_callback data_cb, void* user_data) {
+    return tftp_client_get_sized(session, filename, NULL, data_cb, user_data);
+}
+
+int tftp_client_get_sized(tftp_session_t* session, const char* filename,
+                          tftp_size_callback size_cb, tftp_data_callback data_cb,
+                          void* user_data) {
+    tftp_client_xfer_t xfer;
+    
+    if (tftp_client_start_get(&xfer, session, filename, size_cb, data_cb, user_data) < 0) {
+        return -1;
+    }
+    return tftp_client_run(&xfer);
+}
+
+int tftp_client_get_multicast(tftp_session_t* session, const char* filename,
+                              tftp_size_callback size_cb, tftp_write_callback write_cb,
+                              void* user_data) {
+    if (tftp_client_bind_port(session) < 0) {
+        return -1;
+    }
+    int ret = tftp_client_do_get_multicast(session, filename, size_cb, write_cb, user_data);
+    if (session->options.multicast) {
+        udp_leave_group(session->stack, session->options.mcast_ip, session->options.mcast_port,
+                        session->local_port);
+    }
+    udp_unbind(session->stack, session->local_port);
+    return ret;
+}
@@ -0,0 +1,190 @@
+#include "tftpmmap.h"
+#include "net_wrapper.h"
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// 映射文件句柄
+// 写请求写入同目录下的临时文件, sync时改名替换目标文件
+// 正在被读请求映射的旧文件不会被截断, 映射页始终有效
+typedef struct {
+    int fd;
+    uint8_t* base;      // 映射起始地址(空文件为NULL)
+    size_t size;        // 文件大小
+    bool write;
+    char path[TFTP_FILENAME_MAX * 2];
+    char temp[TFTP_FILENAME_MAX * 2 + 8];   // 写请求的临时文件, 改名后为空
+} tftp_mmap_file_t;
+
+// 拒绝绝对路径和包含".."的路径, 防止访问根目录之外的文件
+static bool tftp_mmap_path_valid(const char* filename) {
+    if (filename[0] == '/' || filename[0] == '\0') {
+        return false;
+    }
+
+    for (const char* p = filename; *p; p++) {
+        if (p[0] == '.' && p[1] == '.' &&
+            (p == filename || p[-1] == '/') && (p[2] == '/' || p[2] == '\0')) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static int tftp_mmap_open(void* user_data, const char* filename, bool write, void** handle) {
+    const char* root = (const char*)user_data;
+
+    if (!tftp_mmap_path_valid(filename)) {
+        NET_LOGW("Rejected path: %s", filename);
+        return -1;
+    }
+
+    tftp_mmap_file_t* file = TFTP_MALLOC(sizeof(tftp_mmap_file_t));
+    if (!file) {
+        return -1;
+    }
+    memset(file, 0, sizeof(*file));
+
+    int n = snprintf(file->path, sizeof(file->path), "%s%s%s", root ? root : "",
+                     (root && root[0]) ? "/" : "", filename);
+    if (n < 0 || (size_t)n >= sizeof(file->path)) {
+        TFTP_FREE(file);
+        return -1;
+    }
+
+    file->write = write;
+    if (write) {
+        snprintf(file->temp, sizeof(file->temp), "%s.XXXXXX", file->path);
+        file->fd = mkstemp(file->temp);
+        if (file->fd >= 0 && fchmod(file->fd, 0644) < 0) {
+            close(file->fd);
+            unlink(file->temp);
+            file->fd = -1;
+        }
+    } else {
+        file->fd = open(file->path, O_RDONLY);
+    }
+    if (file->fd < 0) {
+        TFTP_FREE(file);
+        return -1;
+    }
+
+    if (!write) {
+        struct stat st;
+        if (fstat(file->fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+            close(file->fd);
+            TFTP_FREE(file);
+            return -1;
+        }
+
+        file->size = (size_t)st.st_size;
+        if (file->size > 0) {
+            void* base = mmap(NULL, file->size, PROT_READ, MAP_SHARED, file->fd, 0);
+            if (base == MAP_FAILED) {
+                close(file->fd);
+                TFTP_FREE(file);
+                return -1;
+            }
+            // 顺序读取, 让内核提前预读
+            madvise(base, file->size, MADV_SEQUENTIAL);
+            file->base = base;
+        }
+    }
+
+    *handle = file;
+    return 0;
+}
+
+static int tftp_mmap_map(void* user_data, void* handle, uint64_t offset,
+                         const uint8_t** data, size_t max_size) {
+    tftp_mmap_file_t* file = (tftp_mmap_file_t*)handle;
+
+    if (offset >= file->size) {
+        *data = NULL;
+        return 0;
+    }
+
+    size_t len = file->size - offset;
+    if (len > max_size) {
+        len = max_size;
+    }
+
+    *data = file->base + offset;
+    return (int)len;
+}
+
+static int tftp_mmap_read(void* user_data, void* handle, uint64_t offset,
+                          uint8_t* buffer, size_t max_size) {
+    const uint8_t* data;
+    int len = tftp_mmap_map(user_data, handle, offset, &data, max_size);
+
+    if (len > 0) {
+        memcpy(buffer, data, len);
+    }
+    return len;
+}
+
+static int tftp_mmap_write(void* user_data, void* handle, uint64_t offset,
+                           const uint8_t* data, size_t size) {
+    tftp_mmap_file_t* file = (tftp_mmap_file_t*)handle;
+    size_t written = 0;
+
+    while (written < size) {
+        ssize_t n = pwrite(file->fd, data + written, size - written, (off_t)(offset + written));
+        if (n <= 0) {
+            return -1;
+        }
+        written += n;
+    }
+
+    return (int)written;
+}
+
+static int tftp_mmap_size(void* user_data, void* handle, uint64_t* size) {
+    tftp_mmap_file_t* file = (tftp_mmap_file_t*)handle;
+
+    *size = file->size;
+    return 0;
+}
+
+static int tftp_mmap_sync(void* user_data, void* handle) {
+    tftp_mmap_file_t* file = (tftp_mmap_file_t*)handle;
+
+    if (!file->write || !file->temp[0]) {
+        return 0;
+    }
+    if (fsync(file->fd) < 0 || rename(file->temp, file->path) < 0) {
+        return -1;
+    }
+    file->temp[0] = '\0';
+    return 0;
+}
+
+static void tftp_mmap_close(void* user_data, void* handle) {
+    tftp_mmap_file_t* file = (tftp_mmap_file_t*)handle;
+
+    if (file->base) {
+        munmap(file->base, file->size);
+    }
+    close(file->fd);
+    // 未完成的上传不替换目标文件
+    if (file->write && file->temp[0]) {
+        unlink(file->temp);
+    }
+    TFTP_FREE(file);
+}
+
+const tftp_server_provider_t tftp_mmap_provider = {
+    .open = tftp_mmap_open,
+    .read = tftp_mmap_read,
+    .write = tftp_mmap_write,
+    .close = tftp_mmap_close,
+    .map = tftp_mmap_map,
+    .size = tftp_mmap_size,
+    .sync = tftp_mmap_sync
+};
@@ -2,205 +2,1003 @@
 #include "net_wrapper.h"
 #include <string.h>
 
-static int tftp_handle_read(tftp_session_t* session, const char* filename,
-                          tftp_server_read_cb read_cb, void* user_data) {
-    uint8_t data_packet[4 + TFTP_MAX_BLOCK_SIZE];
-    uint16_t block_num = 1;
-    bool last_packet = false;
-    
-    while (!last_packet) {
-        // 读取数据
-        size_t bytes_read = read_cb(user_data, filename, 
-                                   data_packet + 4, session->options.block_size);
-        if (bytes_read == 0) break;
-        
-        // 构建DATA包
-        *((uint16_t*)data_packet) = htons(TFTP_DATA);
-        *((uint16_t*)(data_packet + 2)) = htons(block_num);
-        
-        // 发送并等待ACK
-        int retry = 0;
-        bool ack_received = false;
-        
-        while (retry < session->options.retries && !ack_received) {
-            if (udp_send(session->peer_ip, session->local_port, session->peer_port,
-                        data_packet, bytes_read + 4) < 0) {
-                return -1;
+// 单次poll最多处理的包数, 防止持续到达的流量使poll无法返回
+#define TFTP_SERVER_POLL_BUDGET     (TFTP_SERVER_MAX_SESSIONS * 2)
+
+static tftp_server_t g_tftp_server;
+static bool g_tftp_server_initialized = false;
+
+static tftp_server_session_t* tftp_server_find_session(tftp_server_t* server, uint16_t local_port) {
+    for (int i = 0; i < TFTP_SERVER_MAX_SESSIONS; i++) {
+        tftp_server_session_t* s = &server->sessions[i];
+        if (s->state != TFTP_SERVER_SESSION_FREE && s->session.local_port == local_port) {
+            return s;
+        }
+    }
+    return NULL;
+}
+
+static tftp_server_session_t* tftp_server_find_peer(tftp_server_t* server,
+                                                    uint32_t peer_ip, uint16_t peer_port) {
+    for (int i = 0; i < TFTP_SERVER_MAX_SESSIONS; i++) {
+        tftp_server_session_t* s = &server->sessions[i];
+        if (s->state != TFTP_SERVER_SESSION_FREE &&
+            s->session.peer_ip == peer_ip && s->session.peer_port == peer_port) {
+            return s;
+        }
+    }
+    return NULL;
+}
+
+static uint16_t tftp_server_alloc_port(tftp_server_t* server) {
+    // 跳过仍被会话占用的端口
+    for (int i = 0; i <= TFTP_SERVER_MAX_SESSIONS; i++) {
+        uint16_t port = tftp_alloc_local_port(server->stack);
+        if (port != server->port && !tftp_server_find_session(server, port)) {
+            return port;
+        }
+    }
+    return 0;
+}
+
+static tftp_server_session_t* tftp_server_alloc_session(tftp_server_t* server) {
+    for (int i = 0; i < TFTP_SERVER_MAX_SESSIONS; i++) {
+        if (server->sessions[i].state == TFTP_SERVER_SESSION_FREE) {
+            return &server->sessions[i];
+        }
+    }
+    return NULL;
+}
+
+// 查找多播成员, session_port为0时在所有多播传输中查找
+static tftp_server_mcast_client_t* tftp_server_mcast_find(tftp_server_t* server, uint16_t session_port,
+                                                          uint32_t ip, uint16_t port) {
+    for (int i = 0; i < TFTP_SERVER_MCAST_CLIENTS; i++) {
+        tftp_server_mcast_client_t* c = &server->mcast_clients[i];
+        if (c->session_port != 0 && (session_port == 0 || c->session_port == session_port) &&
+            c->ip == ip && c->port == port) {
+            return c;
+        }
+    }
+    return NULL;
+}
+
+static int tftp_server_mcast_add(tftp_server_t* server, uint16_t session_port,
+                                 uint32_t ip, uint16_t port) {
+    for (int i = 0; i < TFTP_SERVER_MCAST_CLIENTS; i++) {
+        tftp_server_mcast_client_t* c = &server->mcast_clients[i];
+        if (c->session_port == 0) {
+            c->ip = ip;
+            c->port = port;
+            c->session_port = session_port;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+// 同一文件正在进行的多播传输
+static tftp_server_session_t* tftp_server_find_mcast(tftp_server_t* server, const char* filename) {
+    for (int i = 0; i < TFTP_SERVER_MAX_SESSIONS; i++) {
+        tftp_server_session_t* s = &server->sessions[i];
+        if (s->state == TFTP_SERVER_SESSION_READ && s->multicast &&
+            strcmp(s->filename, filename) == 0) {
+            return s;
+        }
+    }
+    return NULL;
+}
+
+static void tftp_server_close_session(tftp_server_t* server, tftp_server_session_t* s) {
+    if (s->multicast) {
+        for (int i = 0; i < TFTP_SERVER_MCAST_CLIENTS; i++) {
+            if (server->mcast_clients[i].session_port == s->session.local_port) {
+                server->mcast_clients[i].session_port = 0;
             }
-            
-            tftp_opcode_t opcode;
-            uint8_t ack_data[4];
-            size_t ack_len;
-            
-            if (tftp_receive_packet(session, &opcode, ack_data, &ack_len,
-                                   session->options.timeout_ms) == 0 &&
-                opcode == TFTP_ACK && 
-                ntohs(*(uint16_t*)ack_data) == block_num) {
-                ack_received = true;
-            } else {
-                retry++;
+        }
+    }
+    if (s->handle && server->provider->close) {
+        server->provider->close(server->provider_data, s->handle);
+    }
+    tftp_window_free(&s->window);
+    memset(s, 0, sizeof(*s));
+    server->active_sessions--;
+}
+
+// 发送s->packet中已构建好的包
+static int tftp_server_transmit(tftp_server_session_t* s) {
+    s->last_send_ms = net_get_time_ms();
+    return udp_send(s->session.stack, s->session.peer_ip, s->session.local_port,
+                    s->session.peer_port, s->packet, s->packet_len);
+}
+
+static void tftp_server_send_error(tftp_server_session_t* s, tftp_error_t code, const char* message) {
+    uint8_t packet[2 + TFTP_SERVER_CTRL_PACKET_SIZE];
+    size_t msg_len = strlen(message);
+
+    if (msg_len > TFTP_SERVER_CTRL_PACKET_SIZE - 1) {
+        msg_len = TFTP_SERVER_CTRL_PACKET_SIZE - 1;
+    }
+
+    *((uint16_t*)packet) = htons(code);
+    memcpy(packet + 2, message, msg_len);
+    packet[2 + msg_len] = '\0';
+
+    tftp_send_packet(&s->session, TFTP_ERROR, packet, msg_len + 3);
+}
+
+// 旧式回调适配: 句柄即文件名, 读写按顺序进行, 忽略偏移
+static int tftp_server_legacy_open(void* user_data, const char* filename, bool write, void** handle) {
+    tftp_server_t* server = (tftp_server_t*)user_data;
+
+    // 未提供对应回调的操作不支持
+    if ((write && !server->write_cb) || (!write && !server->read_cb)) {
+        return -1;
+    }
+
+    *handle = (void*)filename;
+    return 0;
+}
+
+static int tftp_server_legacy_read(void* user_data, void* handle, uint64_t offset,
+                                   uint8_t* buffer, size_t max_size) {
+    tftp_server_t* server = (tftp_server_t*)user_data;
+    return server->read_cb(server->user_data, (const char*)handle, buffer, max_size);
+}
+
+static int tftp_server_legacy_write(void* user_data, void* handle, uint64_t offset,
+                                    const uint8_t* data, size_t size) {
+    tftp_server_t* server = (tftp_server_t*)user_data;
+    return server->write_cb(server->user_data, (const char*)handle, data, size) == 0 ? (int)size : -1;
+}
+
+static const tftp_server_provider_t tftp_server_legacy_provider = {
+    .open = tftp_server_legacy_open,
+    .read = tftp_server_legacy_read,
+    .write = tftp_server_legacy_write,
+    .close = NULL
+};
+
+typedef struct {
+    tftp_server_t* server;
+    tftp_server_session_t* s;
+} tftp_server_read_ctx_t;
+
+static int tftp_server_read_block(void* user_data, uint8_t* buffer, size_t max_size) {
+    tftp_server_read_ctx_t* ctx = (tftp_server_read_ctx_t*)user_data;
+    tftp_server_session_t* s = ctx->s;
+
+    int bytes_read = ctx->server->provider->read(ctx->server->provider_data, s->handle,
+                                                 s->offset, buffer, max_size);
+    if (bytes_read > 0) {
+        s->offset += bytes_read;
+    }
+    return bytes_read;
+}
+
+static int tftp_server_map_block(void* user_data, const uint8_t** data, size_t max_size) {
+    tftp_server_read_ctx_t* ctx = (tftp_server_read_ctx_t*)user_data;
+    tftp_server_session_t* s = ctx->s;
+
+    int len = ctx->server->provider->map(ctx->server->provider_data, s->handle,
+                                         s->offset, data, max_size);
+    if (len > 0) {
+        s->offset += len;
+    }
+    return len;
+}
+
+// 填充并发送窗口内的数据块
+static int tftp_server_pump_read(tftp_server_t* server, tftp_server_session_t* s) {
+    tftp_server_read_ctx_t ctx = { .server = server, .s = s };
+    int ret;
+
+    if (s->window.mapped) {
+        ret = tftp_window_fill_mapped(&s->window, tftp_server_map_block, &ctx);
+    } else {
+        ret = tftp_window_fill(&s->window, tftp_server_read_block, &ctx);
+    }
+
+    if (ret < 0) {
+        if (s->window.filled == 0) {
+            tftp_server_send_error(s, TFTP_ERR_FILE_NOT_FOUND, "File not found");
+        } else {
+            tftp_server_send_error(s, TFTP_ERR_NOT_DEFINED, "Read failed");
+        }
+        return -1;
+    }
+
+    int count;
+    if (s->multicast) {
+        count = tftp_window_send_to(&s->session, &s->window, server->mcast_ip, s->mcast_port);
+    } else {
+        count = tftp_window_send(&s->session, &s->window);
+    }
+    if (count > 0) {
+        s->last_send_ms = net_get_time_ms();
+        s->session.block_num = tftp_window_block(&s->window, s->window.sent);
+    }
+
+    return count < 0 ? -1 : 0;
+}
+
+static int tftp_server_send_ack(tftp_server_session_t* s, uint16_t block_num) {
+    *((uint16_t*)s->packet) = htons(TFTP_ACK);
+    *((uint16_t*)(s->packet + 2)) = htons(block_num);
+    s->packet_len = 4;
+    s->session.block_num = block_num;
+
+    return tftp_server_transmit(s);
+}
+
+// 构建多播传输的OACK, master表示接收方是否为主客户端, 返回包长度
+static int tftp_server_mcast_oack(tftp_server_session_t* s, bool master,
+                                  uint8_t* packet, size_t size) {
+    tftp_options_t options = s->session.options;
+    options.mcast_master = master;
+
+    *((uint16_t*)packet) = htons(TFTP_OACK);
+    int len = tftp_build_options(&options, packet + 2, size - 2);
+    return len > 0 ? len + 2 : -1;
+}
+
+// 主客户端完成或放弃: 移出成员表, 由下一个成员接替, 没有成员时结束传输
+// 新的主客户端收到OACK后确认已连续收到的位置, 从该处继续发送
+static void tftp_server_mcast_next(tftp_server_t* server, tftp_server_session_t* s) {
+    tftp_server_mcast_client_t* c = tftp_server_mcast_find(server, s->session.local_port,
+                                                           s->session.peer_ip, s->session.peer_port);
+    if (c) {
+        c->session_port = 0;
+    }
+
+    c = NULL;
+    for (int i = 0; i < TFTP_SERVER_MCAST_CLIENTS; i++) {
+        if (server->mcast_clients[i].session_port == s->session.local_port) {
+            c = &server->mcast_clients[i];
+            break;
+        }
+    }
+    if (!c) {
+        tftp_server_close_session(server, s);
+        return;
+    }
+
+    s->session.peer_ip = c->ip;
+    s->session.peer_port = c->port;
+    tftp_rtt_reset(&s->session);
+
+    int len = tftp_server_mcast_oack(s, true, s->packet, sizeof(s->packet));
+    if (len < 0) {
+        tftp_server_close_session(server, s);
+        return;
+    }
+    s->packet_len = len;
+    s->oack_pending = true;
+    tftp_server_transmit(s);
+    tftp_rtt_start(&s->session, 0);
+}
+
+// 加入已有的多播传输: 记录成员并回应OACK, 成员在成为主客户端之前不需要确认
+static int tftp_server_mcast_join(tftp_server_t* server, tftp_server_session_t* group,
+                                  uint32_t client_ip, uint16_t client_port) {
+    uint8_t packet[TFTP_SERVER_CTRL_PACKET_SIZE];
+
+    if (!tftp_server_mcast_find(server, group->session.local_port, client_ip, client_port) &&
+        tftp_server_mcast_add(server, group->session.local_port, client_ip, client_port) < 0) {
+        return -1;
+    }
+
+    int len = tftp_server_mcast_oack(group, false, packet, sizeof(packet));
+    if (len > 0) {
+        udp_send(server->stack, client_ip, group->session.local_port, client_port, packet, len);
+    }
+    return 0;
+}
+
+static void tftp_server_handle_request(tftp_server_t* server, uint16_t opcode,
+                                       uint32_t client_ip, uint16_t client_port,
+                                       uint8_t* packet, size_t len) {
+    // 重传的请求, 会话已存在
+    if (tftp_server_find_peer(server, client_ip, client_port)) {
+        return;
+    }
+
+    // 多播成员重传的请求: 可能没有收到OACK, 再次回应
+    tftp_server_mcast_client_t* member = tftp_server_mcast_find(server, 0, client_ip, client_port);
+    if (member) {
+        tftp_server_session_t* group = tftp_server_find_session(server, member->session_port);
+        if (group) {
+            tftp_server_mcast_join(server, group, client_ip, client_port);
+        }
+        return;
+    }
+
+    // 解析请求: 文件名和模式都必须以'\0'结尾
+    char* filename = (char*)(packet + 2);
+    char* end = (char*)packet + len;
+    char* filename_end = memchr(filename, '\0', end - filename);
+    if (!filename_end || filename_end - filename >= TFTP_FILENAME_MAX) {
+        tftp_send_error(server->stack, client_ip, client_port, TFTP_ERR_ILLEGAL_OP, "Malformed request");
+        return;
+    }
+    char* mode = filename_end + 1;
+    char* mode_end = mode < end ? memchr(mode, '\0', end - mode) : NULL;
+    if (!mode_end) {
+        tftp_send_error(server->stack, client_ip, client_port, TFTP_ERR_ILLEGAL_OP, "Malformed request");
+        return;
+    }
+
+    if ((opcode == TFTP_RRQ && !server->provider->read) ||
+        (opcode == TFTP_WRQ && !server->provider->write)) {
+        tftp_send_error(server->stack, client_ip, client_port, TFTP_ERR_ACCESS_VIOLATION,
+                        "Operation not supported");
+        return;
+    }
+
+    tftp_server_session_t* s = tftp_server_alloc_session(server);
+    uint16_t local_port = tftp_server_alloc_port(server);
+    if (!s || !local_port) {
+        tftp_send_error(server->stack, client_ip, client_port, TFTP_ERR_NOT_DEFINED, "Server busy");
+        return;
+    }
+
+    // 初始化会话, 每个传输使用新的本地端口(RFC 1350)
+    memset(s, 0, sizeof(*s));
+    s->session.stack = server->stack;
+    s->session.peer_ip = client_ip;
+    s->session.peer_port = client_port;
+    s->session.local_port = local_port;
+    tftp_init_default_options(&s->session.options);
+    memcpy(s->filename, filename, filename_end - filename + 1);
+
+    // 检查并处理选项
+    const char* options = mode_end + 1;
+    bool has_options = options < end;
+    if (has_options) {
+        tftp_parse_options((const uint8_t*)options, end - options, &s->session.options);
+    }
+
+    // 多播选项: 同一文件已有多播传输时加入该传输, 否则开始新的多播传输
+    if (s->session.options.multicast) {
+        tftp_server_session_t* group = NULL;
+        if (opcode == TFTP_RRQ && server->mcast_ip && server->provider->size) {
+            group = tftp_server_find_mcast(server, s->filename);
+            if (group && tftp_server_mcast_join(server, group, client_ip, client_port) == 0) {
+                memset(s, 0, sizeof(*s));
+                return;
             }
         }
-        
-        if (!ack_received) {
-            return -1;
+        if (group || opcode != TFTP_RRQ || !server->mcast_ip || !server->provider->size) {
+            s->session.options.multicast = false; // 不支持或成员已满, 按单播传输
+        } else {
+            s->session.options.has_tsize = true; // 客户端按文件大小记录收到的块
         }
-        
-        if (bytes_read < session->options.block_size) {
-            last_packet = true;
+    }
+
+    int ret;
+    if (server->provider->open &&
+        server->provider->open(server->provider_data, s->filename,
+                               opcode == TFTP_WRQ, &s->handle) < 0) {
+        if (opcode == TFTP_RRQ) {
+            tftp_send_error(server->stack, client_ip, client_port,
+                            TFTP_ERR_FILE_NOT_FOUND, "File not found");
         } else {
-            block_num++;
+            tftp_send_error(server->stack, client_ip, client_port,
+                            TFTP_ERR_ACCESS_VIOLATION, "Access violation");
         }
+        memset(s, 0, sizeof(*s));
+        return;
+    }
+
+    s->state = (opcode == TFTP_RRQ) ? TFTP_SERVER_SESSION_READ : TFTP_SERVER_SESSION_WRITE;
+    server->active_sessions++;
+
+    // 读请求的tsize填写实际文件大小(RFC 2349), 无法获取时不在OACK中回应
+    if (opcode == TFTP_RRQ && s->session.options.has_tsize) {
+        uint64_t size;
+        if (server->provider->size &&
+            server->provider->size(server->provider_data, s->handle, &size) == 0) {
+            s->session.options.transfer_size = size;
+        } else {
+            s->session.options.transfer_size = 0;
+            s->session.options.has_tsize = false;
+        }
+    }
+
+    // 开始多播传输, 请求者为第一个主客户端; 主客户端逐块确认, 使用停等方式
+    if (s->session.options.multicast) {
+        if (!s->session.options.has_tsize ||
+            tftp_server_mcast_add(server, local_port, client_ip, client_port) < 0) {
+            s->session.options.multicast = false;
+        } else {
+            s->multicast = true;
+            s->mcast_port = server->mcast_port + (uint16_t)(s - server->sessions);
+            s->mcast_last = (uint32_t)(s->session.options.transfer_size /
+                                       s->session.options.block_size) + 1;
+            s->session.options.window_size = 1;
+            s->session.options.mcast_ip = server->mcast_ip;
+            s->session.options.mcast_port = s->mcast_port;
+            s->session.options.mcast_master = true;
+        }
+    }
+
+    // 引用的数据逐块拷贝到发送帧, 超过一帧的块由窗口拷贝到缓存后分片发送
+    if (opcode == TFTP_RRQ && server->provider->map) {
+        ret = tftp_window_init_mapped(&s->window, &s->session.options);
+    } else {
+        ret = tftp_window_init(&s->window, &s->session.options, opcode == TFTP_RRQ);
+    }
+    if (ret < 0) {
+        tftp_send_error(server->stack, client_ip, client_port, TFTP_ERR_DISK_FULL, "Out of memory");
+        tftp_server_close_session(server, s);
+        return;
+    }
+
+    // 发送OACK
+    int oack_len = 0;
+    if (has_options) {
+        oack_len = tftp_build_options(&s->session.options, s->packet + 2, sizeof(s->packet) - 2);
+    }
+    if (oack_len > 0) {
+        *((uint16_t*)s->packet) = htons(TFTP_OACK);
+        s->packet_len = oack_len + 2;
+        s->oack_pending = true;
+        tftp_server_transmit(s);
+        tftp_rtt_start(&s->session, 0);
+        return;
+    }
+
+    if (opcode == TFTP_RRQ) {
+        if (tftp_server_pump_read(server, s) < 0) {
+            tftp_server_close_session(server, s);
+        }
+    } else {
+        // 发送ACK0
+        tftp_server_send_ack(s, 0);
+        tftp_rtt_start(&s->session, 1);
     }
-    
-    return 0;
 }
 
-static int tftp_handle_write(tftp_session_t* session, const char* filename,
-                           tftp_server_write_cb write_cb, void* user_data) {
-    // 发送ACK0
-    uint16_t ack_packet[2] = {htons(TFTP_ACK), htons(0)};
-    if (udp_send(session->peer_ip, session->local_port, session->peer_port,
-                (uint8_t*)ack_packet, sizeof(ack_packet)) < 0) {
-        return -1;
+// 多播传输中ACK的逻辑块号: 以曾经发送的最大块为参照换算回绕的块号
+static uint32_t tftp_server_mcast_block(const tftp_server_session_t* s, uint16_t block_num) {
+    const tftp_window_t* w = &s->window;
+    int64_t n = (int64_t)w->sent_max + tftp_window_distance(w, w->sent_max, block_num);
+
+    if (n > w->sent_max) {
+        n -= w->rollover ? 65535 : 65536; // 成员不会确认尚未发送的块
     }
-    
-    uint16_t expected_block = 1;
-    bool transfer_complete = false;
-    
-    while (!transfer_complete) {
-        tftp_opcode_t opcode;
-        uint8_t data_packet[4 + TFTP_MAX_BLOCK_SIZE];
-        size_t data_len;
-        
-        // 接收数据包
-        if (tftp_receive_packet(session, &opcode, data_packet, &data_len,
-                               session->options.timeout_ms) < 0) {
-            return -1;
+    if (n < 0) {
+        n = 0;
+    }
+    return n > s->mcast_last ? s->mcast_last : (uint32_t)n;
+}
+
+// 多播传输中主客户端的ACK: 新的主客户端可能已从组中收到后面的块,
+// 确认点不在窗口内时直接跳到该处; 确认到最后一块时由下一个成员接替
+static void tftp_server_mcast_ack(tftp_server_t* server, tftp_server_session_t* s,
+                                  uint16_t block_num) {
+    tftp_window_t* w = &s->window;
+    uint32_t n = tftp_server_mcast_block(s, block_num);
+
+    if (s->oack_pending) {
+        tftp_rtt_sample(&s->session, 0);
+        s->oack_pending = false;
+        tftp_window_seek(w, n);
+        s->offset = w->offset;
+    } else if (n > w->base && n <= w->sent) {
+        tftp_window_on_ack(w, block_num);
+        tftp_rtt_sample(&s->session, w->base);
+    } else if (n > w->sent) {
+        tftp_window_seek(w, n);
+        s->offset = w->offset;
+    } else {
+        TFTP_STAT_ADD(&s->session, dup_acks, 1);
+        return;
+    }
+    s->session.retry_count = 0;
+
+    if (n >= s->mcast_last) {
+        tftp_server_mcast_next(server, s);
+        return;
+    }
+
+    if (tftp_server_pump_read(server, s) < 0) {
+        tftp_server_close_session(server, s);
+    }
+}
+
+static void tftp_server_handle_read(tftp_server_t* server, tftp_server_session_t* s,
+                                    uint16_t opcode, uint16_t block_num) {
+    if (opcode != TFTP_ACK) {
+        return;
+    }
+
+    if (s->multicast) {
+        tftp_server_mcast_ack(server, s, block_num);
+        return;
+    }
+
+    if (s->oack_pending) {
+        if (block_num != 0) {
+            return;
         }
-        
-        if (opcode == TFTP_DATA && 
-            ntohs(*(uint16_t*)data_packet) == expected_block) {
-            // 写入数据
-            if (write_cb(user_data, filename, data_packet + 2, data_len - 2) != 0) {
-                return -1;
+        tftp_rtt_sample(&s->session, 0);
+        s->oack_pending = false;
+    } else {
+        // 忽略重复的ACK, 避免"魔法师学徒"问题
+        if (!tftp_window_on_ack(&s->window, block_num)) {
+            TFTP_STAT_ADD(&s->session, dup_acks, 1);
+            return;
+        }
+        tftp_rtt_sample(&s->session, s->window.base);
+        s->session.retry_count = 0;
+        if (tftp_window_done(&s->window)) {
+            tftp_server_close_session(server, s);
+            return;
+        }
+    }
+
+    if (tftp_server_pump_read(server, s) < 0) {
+        tftp_server_close_session(server, s);
+    }
+}
+
+// 最后一块已写入: 提供者的sync完成后发送最后的ACK, 关闭文件后等待可能的重传
+// sync未完成时保持会话, 由tftp_server_check_timeouts再次调用
+static void tftp_server_finish_write(tftp_server_t* server, tftp_server_session_t* s) {
+    if (server->provider->sync) {
+        int ret = server->provider->sync(server->provider_data, s->handle);
+        if (ret == TFTP_PROVIDER_PENDING) {
+            s->sync_pending = true;
+            s->last_send_ms = net_get_time_ms();
+            return;
+        }
+        if (ret < 0) {
+            tftp_server_send_error(s, TFTP_ERR_DISK_FULL, "Write failed");
+            tftp_server_close_session(server, s);
+            return;
+        }
+    }
+
+    // 客户端收到最后的ACK即表示文件已保存
+    s->sync_pending = false;
+    tftp_server_send_ack(s, tftp_window_block(&s->window, s->window.base));
+    if (s->handle && server->provider->close) {
+        server->provider->close(server->provider_data, s->handle);
+    }
+    s->handle = NULL;
+    s->state = TFTP_SERVER_SESSION_DALLY;
+}
+
+static void tftp_server_handle_write(tftp_server_t* server, tftp_server_session_t* s,
+                                     uint16_t opcode, uint16_t block_num,
+                                     const uint8_t* data, size_t data_len) {
+    // 等待sync时忽略客户端重传的最后一块, 完成后才确认
+    if (opcode != TFTP_DATA || s->sync_pending) {
+        return;
+    }
+
+    // 按序的块先写入, 提供者暂时不能接收时不确认, 由客户端重传
+    if (!s->window.eof && tftp_window_distance(&s->window, s->window.base, block_num) == 1) {
+        int ret = server->provider->write(server->provider_data, s->handle, s->offset, data, data_len);
+        if (ret == TFTP_PROVIDER_PENDING) {
+            return;
+        }
+        if (ret != (int)data_len) {
+            tftp_server_send_error(s, TFTP_ERR_DISK_FULL, "Write failed");
+            tftp_server_close_session(server, s);
+            return;
+        }
+        s->offset += data_len;
+    }
+
+    bool send_ack;
+    if (tftp_window_on_data(&s->window, block_num, data_len, &send_ack)) {
+        tftp_rtt_sample(&s->session, s->window.base);
+        TFTP_STAT_ADD(&s->session, rx_blocks, 1);
+        TFTP_STAT_ADD(&s->session, rx_bytes, data_len);
+        s->oack_pending = false;
+        s->session.retry_count = 0;
+        s->last_send_ms = net_get_time_ms(); // 有进展时重新开始超时计时
+
+        if (s->window.eof) {
+            tftp_server_finish_write(server, s);
+            return;
+        }
+    } else {
+        TFTP_STAT_ADD(&s->session, out_of_order, 1);
+    }
+
+    if (send_ack) {
+        tftp_server_send_ack(s, tftp_window_block(&s->window, s->window.base));
+        tftp_rtt_start(&s->session, s->window.base + 1);
+    }
+}
+
+// 分片服务器: 选择处理请求的工作线程, 同一客户端的重传总是交给同一线程
+// 写请求交给0号, 其数据可能被IP分片, 而分片只会分流到0号实例
+static int tftp_server_shard_pick(const tftp_server_shard_t* shard, uint16_t opcode,
+                                  uint32_t client_ip, uint16_t client_port) {
+    if (opcode == TFTP_WRQ) {
+        return 0;
+    }
+    uint32_t h = (client_ip ^ ((uint32_t)client_port << 16 | client_port)) * 0x9E3779B1u;
+    return (int)(((uint64_t)h * (uint32_t)shard->worker_count) >> 32);
+}
+
+// 把请求转交给所属工作线程, 返回false时由当前线程处理
+// (会话端口取自当前线程的范围, 后续的包仍会分流回当前线程, 只是不再均衡)
+static bool tftp_server_shard_handoff(tftp_server_t* server, uint16_t opcode,
+                                      uint32_t client_ip, uint16_t client_port,
+                                      const uint8_t* packet, size_t len) {
+    int index = tftp_server_shard_pick(server->shard, opcode, client_ip, client_port);
+    if (index == server->shard_index || len > TFTP_SERVER_REQUEST_MAX) {
+        return false;
+    }
+
+    tftp_server_worker_t* w = &server->shard->workers[index];
+    bool queued = false;
+
+    while (__atomic_test_and_set(&w->lock, __ATOMIC_ACQUIRE)) {
+    }
+    uint32_t head = w->head;
+    if (head - __atomic_load_n(&w->tail, __ATOMIC_ACQUIRE) < TFTP_SERVER_HANDOFF_LEN) {
+        tftp_server_request_t* r = &w->requests[head & (TFTP_SERVER_HANDOFF_LEN - 1)];
+        r->ip = client_ip;
+        r->port = client_port;
+        r->len = (uint16_t)len;
+        memcpy(r->data, packet, len);
+        __atomic_store_n(&w->head, head + 1, __ATOMIC_RELEASE);
+        queued = true;
+    }
+    __atomic_clear(&w->lock, __ATOMIC_RELEASE);
+
+    if (!queued) {
+        NET_LOGW_RATELIMIT("Worker %d handoff queue full", index);
+    }
+    return queued;
+}
+
+// 处理其他工作线程转交来的请求
+static void tftp_server_shard_drain(tftp_server_t* server) {
+    tftp_server_worker_t* w = &server->shard->workers[server->shard_index];
+    uint32_t tail = w->tail;
+
+    while (tail != __atomic_load_n(&w->head, __ATOMIC_ACQUIRE)) {
+        tftp_server_request_t* r = &w->requests[tail & (TFTP_SERVER_HANDOFF_LEN - 1)];
+        tftp_server_handle_request(server, ntohs(*(uint16_t*)r->data), r->ip, r->port,
+                                   r->data, r->len);
+        __atomic_store_n(&w->tail, ++tail, __ATOMIC_RELEASE);
+    }
+}
+
+static void tftp_server_input(tftp_server_t* server, uint32_t client_ip, uint16_t client_port,
+                              uint16_t local_port, uint8_t* packet, size_t len) {
+    if (len < 2) {
+        return;
+    }
+
+    // 解析TFTP操作码
+    uint16_t opcode = ntohs(*(uint16_t*)packet);
+
+    if (local_port == server->port) {
+        if (opcode == TFTP_RRQ || opcode == TFTP_WRQ) {
+            if (!server->shard || !tftp_server_shard_handoff(server, opcode, client_ip, client_port,
+                                                             packet, len)) {
+                tftp_server_handle_request(server, opcode, client_ip, client_port, packet, len);
             }
-            
-            // 发送ACK
-            ack_packet[0] = htons(TFTP_ACK);
-            ack_packet[1] = htons(expected_block);
-            if (udp_send(session->peer_ip, session->local_port, session->peer_port,
-                        (uint8_t*)ack_packet, sizeof(ack_packet)) < 0) {
-                return -1;
+        } else {
+            // 不支持的TFTP操作
+            tftp_send_error(server->stack, client_ip, client_port, TFTP_ERR_ILLEGAL_OP, "Illegal operation");
+        }
+        return;
+    }
+
+    tftp_server_session_t* s = tftp_server_find_session(server, local_port);
+    if (!s) {
+        return;
+    }
+
+    if (client_ip != s->session.peer_ip || client_port != s->session.peer_port) {
+        // 多播传输的其他成员: 出错或已收齐时退出, 其余的包忽略
+        tftp_server_mcast_client_t* member = s->multicast ?
+            tftp_server_mcast_find(server, local_port, client_ip, client_port) : NULL;
+        if (member) {
+            if (opcode == TFTP_ERROR ||
+                (opcode == TFTP_ACK && len >= 4 &&
+                 tftp_server_mcast_block(s, ntohs(*(uint16_t*)(packet + 2))) >= s->mcast_last)) {
+                member->session_port = 0;
             }
-            
-            // 检查是否最后一个包
-            if (data_len - 2 < session->options.block_size) {
-                transfer_complete = true;
+            return;
+        }
+        tftp_send_error(server->stack, client_ip, client_port, TFTP_ERR_UNKNOWN_ID, "Unknown transfer ID");
+        TFTP_STAT_ADD(&s->session, wrong_peer, 1);
+        return;
+    }
+
+    if (opcode == TFTP_ERROR) {
+        NET_LOGW("Session %u aborted by peer", local_port);
+        if (s->multicast) {
+            tftp_server_mcast_next(server, s);
+        } else {
+            tftp_server_close_session(server, s);
+        }
+        return;
+    }
+
+    if (len < 4) {
+        return;
+    }
+
+    uint16_t block_num = ntohs(*(uint16_t*)(packet + 2));
+
+    if (s->state == TFTP_SERVER_SESSION_READ) {
+        tftp_server_handle_read(server, s, opcode, block_num);
+    } else {
+        tftp_server_handle_write(server, s, opcode, block_num, packet + 4, len - 4);
+    }
+}
+
+// 会话的超时时间: 传输中使用自适应RTO, 结束后等待完整的协商超时, 等待sync时定期检查
+static uint32_t tftp_server_session_timeout(const tftp_server_session_t* s) {
+    if (s->sync_pending) {
+        return TFTP_SERVER_SYNC_POLL_MS;
+    }
+    if (s->state == TFTP_SERVER_SESSION_DALLY) {
+        return s->session.options.timeout_ms;
+    }
+    return tftp_rto(&s->session);
+}
+
+// 距最近一个会话超时的时间, 用于限制poll的等待时间
+static int tftp_server_next_timeout(tftp_server_t* server, int timeout_ms) {
+    uint32_t now = net_get_time_ms();
+
+    for (int i = 0; i < TFTP_SERVER_MAX_SESSIONS && server->active_sessions > 0; i++) {
+        tftp_server_session_t* s = &server->sessions[i];
+        if (s->state == TFTP_SERVER_SESSION_FREE) {
+            continue;
+        }
+
+        uint32_t elapsed = now - s->last_send_ms;
+        uint32_t timeout = tftp_server_session_timeout(s);
+        int remain = elapsed < timeout ? (int)(timeout - elapsed) : 0;
+        if (remain < timeout_ms) {
+            timeout_ms = remain;
+        }
+    }
+
+    return timeout_ms;
+}
+
+static void tftp_server_check_timeouts(tftp_server_t* server) {
+    uint32_t now = net_get_time_ms();
+
+    for (int i = 0; i < TFTP_SERVER_MAX_SESSIONS && server->active_sessions > 0; i++) {
+        tftp_server_session_t* s = &server->sessions[i];
+        if (s->state == TFTP_SERVER_SESSION_FREE ||
+            now - s->last_send_ms < tftp_server_session_timeout(s)) {
+            continue;
+        }
+
+        if (s->sync_pending) {
+            tftp_server_finish_write(server, s);
+            continue;
+        }
+
+        if (s->state == TFTP_SERVER_SESSION_DALLY) {
+            tftp_server_close_session(server, s);
+            continue;
+        }
+
+        // 退避, RTO达到上限后仍连续超时则放弃
+        if (tftp_rtt_backoff(&s->session) < 0) {
+            NET_LOGW("Session %u timed out", s->session.local_port);
+            if (s->multicast) {
+                tftp_server_mcast_next(server, s); // 放弃当前主客户端
             } else {
-                expected_block++;
+                tftp_server_close_session(server, s);
             }
-        } else if (opcode == TFTP_ERROR) {
+            continue;
+        }
+
+        if (s->oack_pending) {
+            tftp_server_transmit(s);
+        } else if (s->state == TFTP_SERVER_SESSION_READ) {
+            // 回退到最后确认的块, 重发整个窗口
+            tftp_window_rewind(&s->window);
+            if (tftp_server_pump_read(server, s) < 0) {
+                tftp_server_close_session(server, s);
+            }
+        } else {
+            tftp_server_send_ack(s, tftp_window_block(&s->window, s->window.base));
+        }
+    }
+}
+
+int tftp_server_init(tftp_server_t* server,
+                     net_stack_t* stack,
+                     tftp_server_read_cb read_cb,
+                     tftp_server_write_cb write_cb,
+                     void* user_data) {
+    if (!server) return -1;
+
+    memset(server, 0, sizeof(*server));
+    server->stack = stack;
+    server->port = TFTP_DEFAULT_PORT;
+    server->provider = &tftp_server_legacy_provider;
+    server->provider_data = server;
+    server->read_cb = read_cb;
+    server->write_cb = write_cb;
+    server->user_data = user_data;
+
+    return 0;
+}
+
+int tftp_server_init_provider(tftp_server_t* server,
+                              net_stack_t* stack,
+                              const tftp_server_provider_t* provider,
+                              void* user_data) {
+    if (!server || !provider) return -1;
+
+    memset(server, 0, sizeof(*server));
+    server->stack = stack;
+    server->port = TFTP_DEFAULT_PORT;
+    server->provider = provider;
+    server->provider_data = user_data;
+
+    return 0;
+}
+
+void tftp_server_set_multicast(tftp_server_t* server, uint32_t group_ip, uint16_t base_port) {
+    server->mcast_ip = group_ip;
+    server->mcast_port = base_port;
+}
+
+int tftp_server_poll(tftp_server_t* server, int timeout_ms) {
+    int handled = 0;
+
+    if (server->shard) {
+        tftp_server_shard_drain(server);
+    }
+    timeout_ms = tftp_server_next_timeout(server, timeout_ms);
+
+    while (handled < TFTP_SERVER_POLL_BUDGET) {
+        net_pbuf_t* pkts[NET_RX_BATCH_MAX];
+
+        // 接收任意端口: 监听端口和所有会话端口; 数据在缓冲池中直接处理
+        int count = udp_receive_burst(server->stack, 0, pkts, NET_RX_BATCH_MAX, timeout_ms);
+        if (count <= 0) break;
+
+        for (int i = 0; i < count; i++) {
+            tftp_server_input(server, pkts[i]->src_ip, pkts[i]->src_port, pkts[i]->dst_port,
+                              pkts[i]->payload, pkts[i]->len);
+        }
+        udp_release_burst(pkts, count);
+
+        handled += count;
+        timeout_ms = 0; // 之后只处理已就绪的包
+    }
+
+    tftp_server_check_timeouts(server);
+    tftp_stats_tick();
+
+    return handled;
+}
+
+void tftp_server_deinit(tftp_server_t* server) {
+    for (int i = 0; i < TFTP_SERVER_MAX_SESSIONS; i++) {
+        if (server->sessions[i].state != TFTP_SERVER_SESSION_FREE) {
+            tftp_server_close_session(server, &server->sessions[i]);
+        }
+    }
+}
+
+static void tftp_server_worker_entry(void* arg) {
+    tftp_server_worker_t* w = (tftp_server_worker_t*)arg;
+
+    while (__atomic_load_n(&w->server.shard->running, __ATOMIC_ACQUIRE)) {
+        tftp_server_poll(&w->server, TFTP_SERVER_WORKER_POLL_MS);
+    }
+
+    tftp_server_deinit(&w->server);
+    net_sem_post(w->exited);
+}
+
+int tftp_server_shard_start(tftp_server_shard_t* shard, net_stack_t* const* stacks, int count,
+                            const tftp_server_provider_t* provider, void* user_data) {
+    if (!shard || !stacks || !provider || count <= 0 || count > TFTP_SERVER_MAX_WORKERS) {
+        return -1;
+    }
+
+    memset(shard, 0, sizeof(*shard));
+    shard->workers = TFTP_MALLOC(sizeof(tftp_server_worker_t) * (size_t)count);
+    if (!shard->workers) {
+        return -1;
+    }
+    memset(shard->workers, 0, sizeof(tftp_server_worker_t) * (size_t)count);
+    shard->port_span = (uint16_t)((TFTP_EPHEMERAL_PORT_MAX - TFTP_EPHEMERAL_PORT_MIN + 1) / count);
+    shard->worker_count = count;
+    shard->running = true;
+
+    // 先初始化所有工作线程再启动, 转交请求时目标线程必须已就绪
+    for (int i = 0; i < count; i++) {
+        tftp_server_worker_t* w = &shard->workers[i];
+        uint16_t port_min = (uint16_t)(TFTP_EPHEMERAL_PORT_MIN + i * shard->port_span);
+
+        tftp_server_init_provider(&w->server, stacks[i], provider, user_data);
+        w->server.shard = shard;
+        w->server.shard_index = i;
+        net_stack_set_port_range(stacks[i], port_min, (uint16_t)(port_min + shard->port_span - 1));
+
+        w->exited = net_create_sem();
+        if (!w->exited) {
+            tftp_server_shard_stop(shard);
             return -1;
         }
     }
-    
+
+    for (int i = 0; i < count; i++) {
+        tftp_server_worker_t* w = &shard->workers[i];
+        w->task = net_create_task(tftp_server_worker_entry, w);
+        if (!w->task) {
+            NET_LOGE("Failed to create worker %d", i);
+            tftp_server_shard_stop(shard);
+            return -1;
+        }
+    }
+
+    NET_LOGI("TFTP server started with %d workers, %u ports each", count, shard->port_span);
     return 0;
 }
 
-void tftp_server_process(tftp_server_read_cb read_cb, 
-                        tftp_server_write_cb write_cb,
-                        void* user_data) {
-    uint8_t packet[TFTP_PACKET_MAX_SIZE];
-    uint32_t client_ip;
-    uint16_t client_port, server_port;
-    
-    // 接收UDP包
-    int len = udp_receive(&client_ip, &client_port, &server_port, 
-                         packet, sizeof(packet), 100);
-    if (len <= 0) return;
-    
-    // 解析TFTP操作码
-    uint16_t opcode = ntohs(*(uint16_t*)packet);
-    
-    switch (opcode) {
-        case TFTP_RRQ: {
-            // 解析请求
-            char* filename = (char*)(packet + 2);
-            char* mode = filename + strlen(filename) + 1;
-            
-            // 初始化会话
-            tftp_session_t session = {
-                .peer_ip = client_ip,
-                .peer_port = client_port,
-                .local_port = server_port,
-                .block_num = 0,
-                .retry_count = 0
-            };
-            tftp_init_default_options(&session.options);
-            
-            // 检查并处理选项
-            const char* options = mode + strlen(mode) + 1;
-            if (options < (char*)packet + len) {
-                tftp_parse_options((uint8_t*)options, len - (options - (char*)packet), 
-                                  &session.options);
-                
-                // 发送OACK
-                uint8_t oack_packet[TFTP_PACKET_MAX_SIZE];
-                int oack_len = tftp_build_options(&session.options, oack_packet + 2, 
-                                                 sizeof(oack_packet) - 2);
-                if (oack_len > 0) {
-                    *((uint16_t*)oack_packet) = htons(TFTP_OACK);
-                    udp_send(client_ip, server_port, client_port, 
-                            oack_packet, oack_len + 2);
-                }
-            }
-            
-            // 处理读请求
-            tftp_handle_read(&session, filename, read_cb, user_data);
-            break;
+void tftp_server_shard_stop(tftp_server_shard_t* shard) {
+    if (!shard->workers) {
+        return;
+    }
+
+    __atomic_store_n(&shard->running, false, __ATOMIC_RELEASE);
+    for (int i = 0; i < shard->worker_count; i++) {
+        tftp_server_worker_t* w = &shard->workers[i];
+        if (w->task) {
+            net_sem_wait(w->exited);
         }
-        
-        case TFTP_WRQ: {
-            // 解析请求
-            char* filename = (char*)(packet + 2);
-            char* mode = filename + strlen(filename) + 1;
-            
-            // 初始化会话
-            tftp_session_t session = {
-                .peer_ip = client_ip,
-                .peer_port = client_port,
-                .local_port = server_port,
-                .block_num = 0,
-                .retry_count = 0
-            };
-            tftp_init_default_options(&session.options);
-            
-            // 检查并处理选项
-            const char* options = mode + strlen(mode) + 1;
-            if (options < (char*)packet + len) {
-                tftp_parse_options((uint8_t*)options, len - (options - (char*)packet), 
-                                  &session.options);
-                
-                // 发送OACK
-                uint8_t oack_packet[TFTP_PACKET_MAX_SIZE];
-                int oack_len = tftp_build_options(&session.options, oack_packet + 2, 
-                                                 sizeof(oack_packet) - 2);
-                if (oack_len > 0) {
-                    *((uint16_t*)oack_packet) = htons(TFTP_OACK);
-                    udp_send(client_ip, server_port, client_port, 
-                            oack_packet, oack_len + 2);
-                }
-            }
-            
-            // 处理写请求
-            tftp_handle_write(&session, filename, write_cb, user_data);
-            break;
+        if (w->exited) {
+            net_sem_destroy(w->exited);
         }
-        
-        default:
-            // 不支持的TFTP操作
-            tftp_send_error(client_ip, client_port, TFTP_ERR_ILLEGAL_OP, "Illegal operation");
-            break;
     }
-}
\ No newline at end of file
+
+    TFTP_FREE(shard->workers);
+    shard->workers = NULL;
+    shard->worker_count = 0;
+}
+
+int tftp_server_shard_steer(void* arg, const uint8_t* frame, size_t len) {
+    const tftp_server_shard_t* shard = (const tftp_server_shard_t*)arg;
+    int port = net_frame_udp_port(frame, len);
+
+    if (port < 0) {
+        return -1;
+    }
+    if (port < TFTP_EPHEMERAL_PORT_MIN || shard->worker_count == 0) {
+        return 0;
+    }
+
+    int index = (port - TFTP_EPHEMERAL_PORT_MIN) / shard->port_span;
+    return index < shard->worker_count ? index : 0;
+}
+
+void tftp_server_process(tftp_server_read_cb read_cb,
+                        tftp_server_write_cb write_cb,
+                        void* user_data) {
+    if (!g_tftp_server_initialized) {
+        tftp_server_init(&g_tftp_server, NULL, read_cb, write_cb, user_data);
+        g_tftp_server_initialized = true;
+    }
+
+    g_tftp_server.read_cb = read_cb;
+    g_tftp_server.write_cb = write_cb;
+    g_tftp_server.user_data = user_data;
+
+    tftp_server_poll(&g_tftp_server, 100);
+}
@@ -0,0 +1,431 @@
+#include "tftpwriteback.h"
+#include "net_wrapper.h"
+#include <string.h>
+
+_Static_assert(TFTP_WRITEBACK_BUFFERS >= 2, "a block may span two buffers");
+
+typedef struct tftp_writeback_handle tftp_writeback_handle_t;
+
+struct tftp_writeback_buf {
+    tftp_writeback_buf_t* next;
+    tftp_writeback_handle_t* owner;
+    uint64_t offset;            // 缓冲数据在文件中的起始偏移
+    size_t len;
+    uint8_t* data;              // 按TFTP_WRITEBACK_ALIGN对齐
+    void* mem;                  // 分配的内存
+};
+
+// 会话句柄: 当前正在填充的缓冲和空闲缓冲只由服务器线程访问,
+// pending/free_list/error在后台任务归还缓冲时更新, 需持有wb->lock
+struct tftp_writeback_handle {
+    void* backend;
+    bool write;
+    bool sync_requested;        // 已把sync_req排入队列
+    tftp_writeback_buf_t* current;
+    tftp_writeback_buf_t* free_list;
+    int allocated;              // 已分配的缓冲数
+    int pending;                // 已提交尚未写完的缓冲数(含sync_req)
+    bool error;                 // 后台写入或sync失败
+    void* done;                 // 每写完一个缓冲释放一次
+    tftp_writeback_buf_t sync_req;  // 排在最后一个缓冲之后, 后台任务据此调用后端的sync
+};
+
+static inline void tftp_writeback_lock(tftp_writeback_t* wb) {
+    while (__atomic_test_and_set(&wb->lock, __ATOMIC_ACQUIRE)) {
+    }
+}
+
+static inline void tftp_writeback_unlock(tftp_writeback_t* wb) {
+    __atomic_clear(&wb->lock, __ATOMIC_RELEASE);
+}
+
+// 按偏移写入整个缓冲, 后端每次可能只写入一部分
+static int tftp_writeback_flush(tftp_writeback_t* wb, tftp_writeback_buf_t* buf) {
+    size_t written = 0;
+
+    while (written < buf->len) {
+        int n = wb->backend->write(wb->backend_data, buf->owner->backend, buf->offset + written,
+                                   buf->data + written, buf->len - written);
+        if (n <= 0) {
+            return -1;
+        }
+        written += (size_t)n;
+    }
+    return 0;
+}
+
+static void tftp_writeback_entry(void* arg) {
+    tftp_writeback_t* wb = (tftp_writeback_t*)arg;
+
+    while (1) {
+        net_sem_wait(wb->wake);
+
+        tftp_writeback_lock(wb);
+        tftp_writeback_buf_t* buf = wb->queue_head;
+        wb->queue_head = wb->queue_tail = NULL;
+        bool running = wb->running;
+        tftp_writeback_unlock(wb);
+
+        // 按提交顺序写入, 同一文件的缓冲依次落盘, 之后才执行其sync
+        while (buf) {
+            tftp_writeback_buf_t* next = buf->next;
+            tftp_writeback_handle_t* h = buf->owner;
+            bool sync = buf == &h->sync_req;
+            int ret = -1;
+            if (!h->error) {
+                if (!sync) {
+                    ret = tftp_writeback_flush(wb, buf);
+                } else {
+                    ret = wb->backend->sync ? wb->backend->sync(wb->backend_data, h->backend) : 0;
+                }
+            }
+
+            tftp_writeback_lock(wb);
+            if (ret < 0) {
+                __atomic_store_n(&h->error, true, __ATOMIC_RELAXED);
+                wb->stats.errors++;
+            } else if (!sync) {
+                wb->stats.flushes++;
+                wb->stats.bytes += buf->len;
+            }
+            if (!sync) {
+                buf->next = h->free_list;
+                h->free_list = buf;
+            }
+            h->pending--;
+            // 在锁内通知: 解锁后关闭的会话可能立即释放句柄
+            net_sem_post(h->done);
+            tftp_writeback_unlock(wb);
+
+            buf = next;
+        }
+
+        if (!running) {
+            break;
+        }
+    }
+
+    net_sem_post(wb->exited);
+}
+
+// 把缓冲排入后台任务的队列
+static void tftp_writeback_queue(tftp_writeback_t* wb, tftp_writeback_handle_t* h, tftp_writeback_buf_t* buf) {
+    buf->next = NULL;
+    tftp_writeback_lock(wb);
+    if (wb->queue_tail) {
+        wb->queue_tail->next = buf;
+    } else {
+        wb->queue_head = buf;
+    }
+    wb->queue_tail = buf;
+    h->pending++;
+    tftp_writeback_unlock(wb);
+    net_sem_post(wb->wake);
+}
+
+// 提交当前缓冲, 由后台任务写入
+static void tftp_writeback_submit(tftp_writeback_t* wb, tftp_writeback_handle_t* h) {
+    tftp_writeback_buf_t* buf = h->current;
+
+    h->current = NULL;
+    if (!buf || buf->len == 0) {
+        if (buf) {
+            tftp_writeback_lock(wb);
+            buf->next = h->free_list;
+            h->free_list = buf;
+            tftp_writeback_unlock(wb);
+        }
+        return;
+    }
+
+    tftp_writeback_queue(wb, h, buf);
+}
+
+// 从offset开始写入size字节需要的新缓冲数, 当前缓冲须与offset连续
+static int tftp_writeback_needed(const tftp_writeback_handle_t* h, uint64_t offset, size_t size) {
+    const tftp_writeback_buf_t* buf = h->current;
+
+    if (buf) {
+        size_t room = TFTP_WRITEBACK_BUFFER_SIZE - (size_t)(buf->offset % TFTP_WRITEBACK_BUFFER_SIZE) - buf->len;
+        if (room >= size) {
+            return 0;
+        }
+        offset += room;
+        size -= room;
+    }
+    if (size == 0) {
+        return 0;
+    }
+    return (int)((offset + size - 1) / TFTP_WRITEBACK_BUFFER_SIZE - offset / TFTP_WRITEBACK_BUFFER_SIZE + 1);
+}
+
+// 当前可用的缓冲数: 空闲的和尚未分配的
+static int tftp_writeback_available(tftp_writeback_t* wb, const tftp_writeback_handle_t* h) {
+    int n = TFTP_WRITEBACK_BUFFERS - h->allocated;
+
+    tftp_writeback_lock(wb);
+    for (const tftp_writeback_buf_t* buf = h->free_list; buf; buf = buf->next) {
+        n++;
+    }
+    tftp_writeback_unlock(wb);
+    return n;
+}
+
+// 取得一个空闲缓冲, 调用前已确认有可用的缓冲
+static tftp_writeback_buf_t* tftp_writeback_get_buf(tftp_writeback_t* wb, tftp_writeback_handle_t* h) {
+    tftp_writeback_lock(wb);
+    tftp_writeback_buf_t* buf = h->free_list;
+    if (buf) {
+        h->free_list = buf->next;
+    }
+    tftp_writeback_unlock(wb);
+
+    if (buf || h->allocated >= TFTP_WRITEBACK_BUFFERS) {
+        return buf;
+    }
+
+    buf = TFTP_MALLOC(sizeof(tftp_writeback_buf_t));
+    void* mem = TFTP_MALLOC(TFTP_WRITEBACK_BUFFER_SIZE + TFTP_WRITEBACK_ALIGN);
+    if (!buf || !mem) {
+        if (buf) TFTP_FREE(buf);
+        if (mem) TFTP_FREE(mem);
+        return NULL;
+    }
+    memset(buf, 0, sizeof(*buf));
+    buf->owner = h;
+    buf->mem = mem;
+    buf->data = (uint8_t*)(((uintptr_t)mem + TFTP_WRITEBACK_ALIGN - 1) &
+                           ~(uintptr_t)(TFTP_WRITEBACK_ALIGN - 1));
+    h->allocated++;
+    return buf;
+}
+
+// 提交当前缓冲并等待所有缓冲写完, 返回后台写入是否出错
+static int tftp_writeback_drain(tftp_writeback_t* wb, tftp_writeback_handle_t* h) {
+    tftp_writeback_submit(wb, h);
+
+    while (1) {
+        tftp_writeback_lock(wb);
+        int pending = h->pending;
+        bool error = h->error;
+        tftp_writeback_unlock(wb);
+
+        if (pending == 0) {
+            return error ? -1 : 0;
+        }
+        net_sem_wait(h->done);
+    }
+}
+
+static int tftp_writeback_open(void* user_data, const char* filename, bool write, void** handle) {
+    tftp_writeback_t* wb = (tftp_writeback_t*)user_data;
+
+    tftp_writeback_handle_t* h = TFTP_MALLOC(sizeof(tftp_writeback_handle_t));
+    if (!h) {
+        return -1;
+    }
+    memset(h, 0, sizeof(*h));
+    h->write = write;
+
+    if (write) {
+        h->done = net_create_sem();
+        if (!h->done) {
+            TFTP_FREE(h);
+            return -1;
+        }
+    }
+
+    if (wb->backend->open(wb->backend_data, filename, write, &h->backend) < 0) {
+        if (h->done) {
+            net_sem_destroy(h->done);
+        }
+        TFTP_FREE(h);
+        return -1;
+    }
+
+    *handle = h;
+    return 0;
+}
+
+static int tftp_writeback_write(void* user_data, void* handle, uint64_t offset,
+                                const uint8_t* data, size_t size) {
+    tftp_writeback_t* wb = (tftp_writeback_t*)user_data;
+    tftp_writeback_handle_t* h = (tftp_writeback_handle_t*)handle;
+    size_t done = 0;
+
+    if (__atomic_load_n(&h->error, __ATOMIC_RELAXED)) {
+        return -1;
+    }
+
+    // 不连续的写入从新缓冲开始
+    if (h->current && h->current->offset + h->current->len != offset) {
+        tftp_writeback_submit(wb, h);
+    }
+
+    // 缓冲不够时不写入任何数据, 服务器不确认该块, 由客户端重传(背压)
+    int needed = tftp_writeback_needed(h, offset, size);
+    if (needed > TFTP_WRITEBACK_BUFFERS - (h->current ? 1 : 0)) {
+        return -1;
+    }
+    if (needed > tftp_writeback_available(wb, h)) {
+        tftp_writeback_lock(wb);
+        wb->stats.stalls++;
+        tftp_writeback_unlock(wb);
+        return TFTP_PROVIDER_PENDING;
+    }
+
+    while (done < size) {
+        tftp_writeback_buf_t* buf = h->current;
+
+        if (!buf) {
+            buf = tftp_writeback_get_buf(wb, h);
+            if (!buf) {
+                return -1;
+            }
+            buf->offset = offset + done;
+            buf->len = 0;
+            h->current = buf;
+        }
+
+        // 缓冲结束于对齐边界, 之后的写入都按缓冲大小对齐
+        size_t limit = TFTP_WRITEBACK_BUFFER_SIZE - (size_t)(buf->offset % TFTP_WRITEBACK_BUFFER_SIZE);
+        size_t n = limit - buf->len < size - done ? limit - buf->len : size - done;
+        memcpy(buf->data + buf->len, data + done, n);
+        buf->len += n;
+        done += n;
+
+        if (buf->len == limit) {
+            tftp_writeback_submit(wb, h);
+        }
+    }
+
+    return (int)size;
+}
+
+// 第一次调用时提交剩余数据和后端的sync, 都由后台任务完成前返回TFTP_PROVIDER_PENDING
+static int tftp_writeback_sync(void* user_data, void* handle) {
+    tftp_writeback_t* wb = (tftp_writeback_t*)user_data;
+    tftp_writeback_handle_t* h = (tftp_writeback_handle_t*)handle;
+
+    if (!h->write) {
+        return 0;
+    }
+    if (!h->sync_requested) {
+        tftp_writeback_submit(wb, h);
+        h->sync_req.owner = h;
+        h->sync_requested = true;
+        tftp_writeback_queue(wb, h, &h->sync_req);
+    }
+
+    tftp_writeback_lock(wb);
+    int pending = h->pending;
+    bool error = h->error;
+    tftp_writeback_unlock(wb);
+
+    if (pending > 0) {
+        return TFTP_PROVIDER_PENDING;
+    }
+    return error ? -1 : 0;
+}
+
+static int tftp_writeback_read(void* user_data, void* handle, uint64_t offset,
+                               uint8_t* buffer, size_t max_size) {
+    tftp_writeback_t* wb = (tftp_writeback_t*)user_data;
+    tftp_writeback_handle_t* h = (tftp_writeback_handle_t*)handle;
+
+    if (!wb->backend->read) {
+        return -1;
+    }
+    return wb->backend->read(wb->backend_data, h->backend, offset, buffer, max_size);
+}
+
+static int tftp_writeback_size(void* user_data, void* handle, uint64_t* size) {
+    tftp_writeback_t* wb = (tftp_writeback_t*)user_data;
+    tftp_writeback_handle_t* h = (tftp_writeback_handle_t*)handle;
+
+    if (!wb->backend->size) {
+        return -1;
+    }
+    return wb->backend->size(wb->backend_data, h->backend, size);
+}
+
+static void tftp_writeback_close(void* user_data, void* handle) {
+    tftp_writeback_t* wb = (tftp_writeback_t*)user_data;
+    tftp_writeback_handle_t* h = (tftp_writeback_handle_t*)handle;
+
+    // 中止的传输也写完已确认的数据, 后端关闭后不再访问句柄
+    if (h->write) {
+        tftp_writeback_drain(wb, h);
+        while (h->free_list) {
+            tftp_writeback_buf_t* buf = h->free_list;
+            h->free_list = buf->next;
+            TFTP_FREE(buf->mem);
+            TFTP_FREE(buf);
+        }
+        net_sem_destroy(h->done);
+    }
+
+    if (wb->backend->close) {
+        wb->backend->close(wb->backend_data, h->backend);
+    }
+    TFTP_FREE(h);
+}
+
+const tftp_server_provider_t tftp_writeback_provider = {
+    .open = tftp_writeback_open,
+    .read = tftp_writeback_read,
+    .write = tftp_writeback_write,
+    .close = tftp_writeback_close,
+    .size = tftp_writeback_size,
+    .sync = tftp_writeback_sync
+};
+
+int tftp_writeback_init(tftp_writeback_t* wb, const tftp_server_provider_t* backend, void* backend_data) {
+    if (!wb || !backend || !backend->open || !backend->write) {
+        return -1;
+    }
+
+    memset(wb, 0, sizeof(*wb));
+    wb->backend = backend;
+    wb->backend_data = backend_data;
+    wb->running = true;
+
+    wb->wake = net_create_sem();
+    wb->exited = net_create_sem();
+    if (!wb->wake || !wb->exited) {
+        if (wb->wake) net_sem_destroy(wb->wake);
+        if (wb->exited) net_sem_destroy(wb->exited);
+        return -1;
+    }
+
+    wb->task = net_create_task(tftp_writeback_entry, wb);
+    if (!wb->task) {
+        NET_LOGE("Failed to create writeback task");
+        net_sem_destroy(wb->wake);
+        net_sem_destroy(wb->exited);
+        return -1;
+    }
+    return 0;
+}
+
+void tftp_writeback_deinit(tftp_writeback_t* wb) {
+    if (!wb->task) {
+        return;
+    }
+
+    tftp_writeback_lock(wb);
+    wb->running = false;
+    tftp_writeback_unlock(wb);
+    net_sem_post(wb->wake);
+    net_sem_wait(wb->exited);
+
+    net_sem_destroy(wb->wake);
+    net_sem_destroy(wb->exited);
+    wb->task = NULL;
+}
+
+void tftp_writeback_get_stats(tftp_writeback_t* wb, tftp_writeback_stats_t* stats) {
+    tftp_writeback_lock(wb);
+    *stats = wb->stats;
+    tftp_writeback_unlock(wb);
+}
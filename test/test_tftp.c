@@ -1,10 +1,12 @@
 #include "tftp.h"
 #include "tftpclient.h"
 #include "tftpserver.h"
+#include "tftpwriteback.h"
 #include "net_wrapper.h"
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <unistd.h>
 
 // 测试文件内容
 static const char *test_download_file_content = "this is a test download file";
@@ -28,27 +30,57 @@ static net_config_t server_config = {
     .mac_addr = {0xAA, 0xBB, 0xCC, 0xDD, 0xEE, 0xFF}
 };
 
-// 文件操作回调函数
-static int read_file_cb(void *user_data, const char *filename, uint8_t *buffer, size_t max_size) {
-    FILE *fp = fopen(filename, "rb");
+// 文件提供者: 每个会话只打开一次文件, 按偏移顺序读写
+static int file_open_cb(void *user_data, const char *filename, bool write, void **handle) {
+    FILE *fp = fopen(filename, write ? "wb" : "rb");
     if (!fp) return -1;
     
-    size_t bytes_read = fread(buffer, 1, max_size, fp);
-    fclose(fp);
+    *handle = fp;
+    return 0;
+}
+
+static int file_read_cb(void *user_data, void *handle, uint64_t offset, uint8_t *buffer, size_t max_size) {
+    FILE *fp = (FILE *)handle;
     
-    return bytes_read;
+    // 顺序读取时文件位置已经正确, 只在重定位时seek
+    if ((uint64_t)ftell(fp) != offset && fseek(fp, (long)offset, SEEK_SET) != 0) {
+        return -1;
+    }
+    
+    size_t bytes_read = fread(buffer, 1, max_size, fp);
+    return ferror(fp) ? -1 : (int)bytes_read;
 }
 
-static int write_file_cb(void *user_data, const char *filename, const uint8_t *data, size_t size) {
-    FILE *fp = fopen(filename, "ab");
-    if (!fp) return -1;
+static int file_write_cb(void *user_data, void *handle, uint64_t offset, const uint8_t *data, size_t size) {
+    FILE *fp = (FILE *)handle;
+    
+    // 与读取相同, 只在偏移与文件位置不符时seek
+    if ((uint64_t)ftell(fp) != offset && fseek(fp, (long)offset, SEEK_SET) != 0) {
+        return -1;
+    }
     
     size_t bytes_written = fwrite(data, 1, size, fp);
-    fclose(fp);
+    return (bytes_written == size) ? (int)size : -1;
+}
+
+static int file_sync_cb(void *user_data, void *handle) {
+    FILE *fp = (FILE *)handle;
     
-    return (bytes_written == size) ? 0 : -1;
+    return (fflush(fp) == 0 && fsync(fileno(fp)) == 0) ? 0 : -1;
+}
+
+static void file_close_cb(void *user_data, void *handle) {
+    fclose((FILE *)handle);
 }
 
+static const tftp_server_provider_t file_provider = {
+    .open = file_open_cb,
+    .read = file_read_cb,
+    .write = file_write_cb,
+    .close = file_close_cb,
+    .sync = file_sync_cb
+};
+
 static int get_data_cb(void *user_data, uint8_t *buffer, size_t max_size) {
     const char **content = (const char **)user_data;
     static size_t pos = 0;
@@ -126,6 +158,7 @@ static int tftp_get_file(const char *filename, uint32_t server_ip, const char *m
         .retry_count = 0,
         .options = {
             .block_size = 1024,
+            .window_size = 4,
             .timeout_ms = TFTP_DEFAULT_TIMEOUT_MS,
             .transfer_size = 0,
             .wait_oack = true,
@@ -203,11 +236,20 @@ static void test_server(void) {
         return;
     }
     
+    // 上传的数据块合并后由后台任务写入文件, 不在确认路径上等待存储
+    static tftp_writeback_t writeback;
+    static tftp_server_t server;
+    if (tftp_writeback_init(&writeback, &file_provider, NULL) != 0) {
+        printf("Writeback init failed\n");
+        return;
+    }
+    tftp_server_init_provider(&server, NULL, &tftp_writeback_provider, &writeback);
+    
     printf("TFTP server running...\n");
     printf("Press Ctrl+C to stop the server\n");
     
     while (1) {
-        tftp_server_process(read_file_cb, write_file_cb, NULL);
+        tftp_server_poll(&server, 100);
     }
     
     printf("=== TFTP Server Test Complete ===\n");
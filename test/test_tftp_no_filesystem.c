@@ -1,8 +1,17 @@
 #include "tftp.h"
 #include "tftpclient.h"
 #include "tftpserver.h"
+#include "tftpcache.h"
+#include "tftpwriteback.h"
 #include "net_wrapper.h"
+#include "net_loopback.h"
 #include <string.h>
+#ifdef __unix__
+#include "tftpmmap.h"
+#include <stdio.h>
+#include <unistd.h>
+#include <dirent.h>
+#endif
 
 #define TEST_MALLOC(size)       malloc(size)
 #define TEST_FREE(ptr)          free(ptr)
@@ -96,17 +105,54 @@ static int get_data_cb(void *user_data, uint8_t *buffer, size_t max_size) {
     return to_copy;
 }
 
+// 下载缓冲: 服务器报告文件大小时一次分配到位, 否则按需倍增
+typedef struct {
+    uint8_t *data;
+    size_t size;
+    size_t capacity;
+} recv_buffer_t;
+
+static int recv_buffer_reserve(recv_buffer_t *buf, size_t capacity) {
+    // 多留一个字节存放'\0'
+    uint8_t *data = realloc(buf->data, capacity + 1);
+    if (!data) return -1;
+    
+    buf->data = data;
+    buf->capacity = capacity;
+    return 0;
+}
+
+static int size_cb(void *user_data, uint64_t size) {
+    if (size >= SIZE_MAX) return -1;
+    return recv_buffer_reserve((recv_buffer_t *)user_data, (size_t)size);
+}
+
 static int data_cb(void *user_data, const uint8_t *data, size_t size) {
-    uint8_t **buffer = (uint8_t **)user_data;
+    recv_buffer_t *buf = (recv_buffer_t *)user_data;
+    
+    if ((!buf->data || buf->size + size > buf->capacity) &&
+        recv_buffer_reserve(buf, (buf->size + size) * 2) != 0) {
+        return -1;
+    }
+    
+    memcpy(buf->data + buf->size, data, size);
+    buf->size += size;
+    buf->data[buf->size] = '\0';
     
-    // 追加数据到缓冲区
-    uint8_t *new_buffer = realloc(*buffer, (*buffer ? strlen((char *)*buffer) : 0) + size + 1);
-    if (!new_buffer) return -1;
+    return 0;
+}
+
+// 多播下载的块可能乱序到达, 按偏移写入预先分配的缓冲
+static int write_cb(void *user_data, uint64_t offset, const uint8_t *data, size_t size) {
+    recv_buffer_t *buf = (recv_buffer_t *)user_data;
     
-    *buffer = new_buffer;
-    memcpy(*buffer + (*buffer ? strlen((char *)*buffer) : 0), data, size);
-    (*buffer)[(*buffer ? strlen((char *)*buffer) : 0) + size] = '\0';
+    if (!buf->data || offset + size > buf->capacity) return -1;
     
+    memcpy(buf->data + offset, data, size);
+    if (offset + size > buf->size) {
+        buf->size = offset + size;
+        buf->data[buf->size] = '\0';
+    }
     return 0;
 }
 
@@ -152,6 +198,7 @@ static int tftp_get_file(const char *filename, uint32_t server_ip, const char *m
         .retry_count = 0,
         .options = {
             .block_size = 1024,
+            .window_size = 4,
             .timeout_ms = TFTP_DEFAULT_TIMEOUT_MS,
             .transfer_size = 0,
             .wait_oack = true,
@@ -159,14 +206,14 @@ static int tftp_get_file(const char *filename, uint32_t server_ip, const char *m
         }
     };
     
-    uint8_t *buffer = NULL;
-    int result = tftp_client_get(&session, filename, data_cb, &buffer);
+    recv_buffer_t buffer = {0};
+    int result = tftp_client_get_sized(&session, filename, size_cb, data_cb, &buffer);
     
     if (result == 0) {
-        result = write_file_cb(NULL, filename, buffer, strlen((char *)buffer));
+        result = write_file_cb(NULL, filename, buffer.data, buffer.size);
     }
     
-    TEST_FREE(buffer);
+    TEST_FREE(buffer.data);
     return result;
 }
 
@@ -230,11 +277,636 @@ static void test_server(void) {
     NET_LOGI("=== TFTP Server Test Complete ===");
 }
 
+// 内存文件提供者: 与回调共用文件表, 按偏移读写, 并报告文件大小(tsize)
+static int mem_open(void *user_data, const char *filename, bool write, void **handle) {
+    file_entry_t *file = NULL;
+    
+    for (size_t i = 0; i < file_count; i++) {
+        if (strcmp(file_system[i].name, filename) == 0) {
+            file = &file_system[i];
+            break;
+        }
+    }
+    
+    if (write) {
+        if (!file) {
+            if (file_count >= MAX_FILES) return -1;
+            file = &file_system[file_count++];
+            memset(file, 0, sizeof(*file));
+            strncpy(file->name, filename, sizeof(file->name) - 1);
+        }
+        file->size = 0; // 覆盖已有文件
+    } else if (!file) {
+        return -1;
+    }
+    
+    *handle = file;
+    return 0;
+}
+
+static int mem_read(void *user_data, void *handle, uint64_t offset,
+                    uint8_t *buffer, size_t max_size) {
+    file_entry_t *file = (file_entry_t *)handle;
+    
+    if (offset >= file->size) return 0;
+    
+    size_t to_copy = file->size - offset < max_size ? file->size - offset : max_size;
+    memcpy(buffer, file->data + offset, to_copy);
+    return to_copy;
+}
+
+static int mem_write(void *user_data, void *handle, uint64_t offset,
+                     const uint8_t *data, size_t size) {
+    file_entry_t *file = (file_entry_t *)handle;
+    
+    if (offset + size > file->size) {
+        uint8_t *new_data = realloc(file->data, offset + size);
+        if (!new_data) return -1;
+        file->data = new_data;
+        file->size = offset + size;
+    }
+    
+    memcpy(file->data + offset, data, size);
+    return size;
+}
+
+static int mem_size(void *user_data, void *handle, uint64_t *size) {
+    *size = ((file_entry_t *)handle)->size;
+    return 0;
+}
+
+static const tftp_server_provider_t mem_provider = {
+    .open = mem_open,
+    .read = mem_read,
+    .write = mem_write,
+    .size = mem_size
+};
+
+// 回环测试: 客户端和服务器在同一进程中各使用一个协议栈实例, 通过一对回环端点相连
+// 客户端使用默认协议栈, 服务器使用独立的实例; 客户端等待时轮询服务器
+// 服务器经延迟写提供者写入文件表, 上传完成时数据应已全部写入
+static void loop_server_poll(void *arg) {
+    tftp_server_poll((tftp_server_t *)arg, 0);
+}
+
+// 超过一帧的数据报经udp_send分片发送, 接收方重组后得到完整的数据
+#define TEST_UDP_LARGE_LEN      4000
+#define TEST_UDP_LARGE_PORT     7000
+
+static int test_udp_large(net_stack_t *server_stack) {
+    static uint8_t data[TEST_UDP_LARGE_LEN];
+    net_pbuf_t *p;
+    int result = -1;
+    
+    for (size_t i = 0; i < sizeof(data); i++) {
+        data[i] = (uint8_t)(i * 7);
+    }
+    udp_bind(server_stack, TEST_UDP_LARGE_PORT);
+    
+    // 链路有丢包, 任一分片丢失时整个数据报丢失, 重发几次
+    for (int attempt = 0; attempt < 8 && result != 0; attempt++) {
+        if (udp_send(NULL, server_config.ip_addr, TEST_UDP_LARGE_PORT, TEST_UDP_LARGE_PORT,
+                     data, sizeof(data)) != 0) {
+            break;
+        }
+        if (udp_receive_burst(server_stack, TEST_UDP_LARGE_PORT, &p, 1, 100) == 1) {
+            result = (p->len == sizeof(data) && memcmp(p->payload, data, sizeof(data)) == 0) ? 0 : -1;
+            udp_release_burst(&p, 1);
+            break;
+        }
+    }
+    
+    udp_unbind(server_stack, TEST_UDP_LARGE_PORT);
+    return result;
+}
+
+// 事件循环中结束的传输计数
+static void loop_done_cb(tftp_client_xfer_t *xfer, int result, void *user_data) {
+    if (result == 0) {
+        (*(int *)user_data)++;
+    }
+}
+
+// 在一个事件循环中同时下载多次, 使用小块使各传输交替推进
+#define TEST_LOOP_XFERS 4
+
+static int test_loop_parallel(void) {
+    static tftp_client_xfer_t xfers[TEST_LOOP_XFERS];
+    tftp_session_t sessions[TEST_LOOP_XFERS];
+    recv_buffer_t buffers[TEST_LOOP_XFERS];
+    tftp_client_loop_t client_loop;
+    int completed = 0;
+    int result = 0;
+    
+    memset(buffers, 0, sizeof(buffers));
+    tftp_client_loop_init(&client_loop, NULL);
+    for (int i = 0; i < TEST_LOOP_XFERS; i++) {
+        memset(&sessions[i], 0, sizeof(sessions[i]));
+        sessions[i].peer_ip = server_config.ip_addr;
+        sessions[i].peer_port = TFTP_DEFAULT_PORT;
+        tftp_init_default_options(&sessions[i].options);
+        sessions[i].options.block_size = 8;
+        if (tftp_client_start_get(&xfers[i], &sessions[i], test_download_filename,
+                                  size_cb, data_cb, &buffers[i]) != 0 ||
+            tftp_client_loop_add(&client_loop, &xfers[i], loop_done_cb, &completed) != 0) {
+            NET_LOGE("Failed to start transfer %d", i);
+            result = -1;
+            break;
+        }
+    }
+    
+    while (tftp_client_loop_poll(&client_loop, 100) > 0) {
+    }
+    
+    for (int i = 0; i < TEST_LOOP_XFERS; i++) {
+        if (result == 0 &&
+            (buffers[i].size != strlen(test_download_file_content) ||
+             memcmp(buffers[i].data, test_download_file_content, buffers[i].size) != 0)) {
+            result = -1;
+        }
+        TEST_FREE(buffers[i].data);
+    }
+    if (completed != TEST_LOOP_XFERS) {
+        result = -1;
+    }
+    return result;
+}
+
+static int test_loop(void) {
+    static tftp_server_t server;
+    static tftp_writeback_t writeback;
+    static net_stack_t server_stack;
+    net_loop_config_t loop_config = {
+        .latency_ms = 1,
+        .loss_ppm = 20000,      // 2%丢包, 覆盖重传路径
+        .reorder_ppm = 10000,
+        .seed = 1
+    };
+    net_loop_endpoint_t *client_ep = NULL;
+    net_loop_endpoint_t *server_ep = NULL;
+    net_link_ops_t client_link;
+    net_link_ops_t server_link;
+    recv_buffer_t buffer = {0};
+    int result = -1;
+    
+    NET_LOGI("=== Starting TFTP Loopback Test ===");
+    
+    if (net_loop_pair_create(&loop_config, &client_ep, &server_ep) != 0) {
+        NET_LOGE("Failed to create loopback link");
+        return -1;
+    }
+    net_loop_link_ops(client_ep, &client_link);
+    net_loop_link_ops(server_ep, &server_link);
+    
+    if (net_stack_init(NULL, &client_config, &client_link) != 0 ||
+        net_stack_init(&server_stack, &server_config, &server_link) != 0) {
+        NET_LOGE("Network init failed");
+        goto out;
+    }
+    
+    if (test_udp_large(&server_stack) != 0) {
+        NET_LOGE("Large UDP datagram failed");
+        goto out;
+    }
+    NET_LOGI("Large UDP datagram successful");
+    
+    if (tftp_writeback_init(&writeback, &mem_provider, NULL) != 0) {
+        NET_LOGE("Writeback init failed");
+        goto out;
+    }
+    tftp_server_init_provider(&server, &server_stack, &tftp_writeback_provider, &writeback);
+    loop_server_poll(&server); // 先绑定监听端口, 再发起请求
+    net_stack_set_idle_hook(NULL, loop_server_poll, &server);
+    create_test_file(test_download_filename, test_download_file_content);
+    
+    // 上传: 服务器通过提供者写入文件表
+    const char *content = test_upload_file_content;
+    if (tftp_put_file(test_upload_filename, server_config.ip_addr, "octet", (void *)&content) != 0 ||
+        verify_file_content(test_upload_filename, test_upload_file_content) != 0) {
+        NET_LOGE("File upload failed");
+        goto out;
+    }
+    NET_LOGI("File upload successful");
+    
+    // 下载: 与服务器共用文件表, 直接比较收到的数据
+    tftp_session_t session = {
+        .peer_ip = server_config.ip_addr,
+        .peer_port = TFTP_DEFAULT_PORT,
+    };
+    tftp_init_default_options(&session.options);
+    session.options.window_size = 4;
+    if (tftp_client_get_sized(&session, test_download_filename, size_cb, data_cb, &buffer) != 0 ||
+        session.options.transfer_size != strlen(test_download_file_content) ||
+        buffer.size != strlen(test_download_file_content) ||
+        memcmp(buffer.data, test_download_file_content, buffer.size) != 0) {
+        NET_LOGE("File download failed");
+        goto out;
+    }
+    NET_LOGI("File download successful");
+    
+    if (test_loop_parallel() != 0) {
+        NET_LOGE("Parallel download failed");
+        goto out;
+    }
+    NET_LOGI("Parallel download successful");
+    
+    // 多播下载: 唯一的客户端成为主客户端, 使用小块覆盖多块传输
+    tftp_server_set_multicast(&server, 0x0100FFEF, 1758); // 239.255.0.1
+    TEST_FREE(buffer.data);
+    memset(&buffer, 0, sizeof(buffer));
+    tftp_init_default_options(&session.options);
+    session.peer_port = TFTP_DEFAULT_PORT;
+    session.local_port = 0;
+    session.options.block_size = 8;
+    if (tftp_client_get_multicast(&session, test_download_filename, size_cb, write_cb, &buffer) != 0 ||
+        !session.options.multicast ||
+        buffer.size != strlen(test_download_file_content) ||
+        memcmp(buffer.data, test_download_file_content, buffer.size) != 0) {
+        NET_LOGE("Multicast download failed");
+        goto out;
+    }
+    NET_LOGI("Multicast download successful");
+    result = 0;
+    
+    tftp_stats_t stats;
+    tftp_get_stats(&stats);
+    tftp_stats_log(&stats, NULL);
+    
+    net_udp_stats_t client_stats, server_stats;
+    udp_get_stats(NULL, &client_stats);
+    udp_get_stats(&server_stack, &server_stats);
+    NET_LOGI("udp: client tx %u rx %u, server tx %u rx %u",
+             client_stats.tx_packets, client_stats.rx_packets,
+             server_stats.tx_packets, server_stats.rx_packets);
+    
+out:
+    net_stack_set_idle_hook(NULL, NULL, NULL);
+    net_stack_set_link(NULL, NULL);
+    net_stack_set_link(&server_stack, NULL);
+    tftp_server_deinit(&server);
+    tftp_writeback_deinit(&writeback);
+    TEST_FREE(buffer.data);
+    net_loop_destroy(client_ep);
+    net_loop_destroy(server_ep);
+    NET_LOGI("=== TFTP Loopback Test Complete ===");
+    return result;
+}
+
+#ifdef __unix__
+// mmap提供者测试: 服务器从临时目录中的文件映射发送, 覆盖一帧内和超过一帧的块
+// 下载进行中上传同名文件, 正在下载的会话仍读到旧内容, 上传完成后文件被替换
+#define TEST_MMAP_SIZE      (64 * 1024)
+#define TEST_MMAP_NEW_SIZE  3000
+#define TEST_MMAP_FILENAME  "mmap.bin"
+
+typedef struct {
+    const uint8_t *data;
+    size_t size;
+    size_t pos;
+} mmap_source_t;
+
+static int mmap_source_cb(void *user_data, uint8_t *buffer, size_t max_size) {
+    mmap_source_t *src = (mmap_source_t *)user_data;
+    size_t to_copy = src->size - src->pos < max_size ? src->size - src->pos : max_size;
+    
+    memcpy(buffer, src->data + src->pos, to_copy);
+    src->pos += to_copy;
+    return (int)to_copy;
+}
+
+static int mmap_get(tftp_session_t *session, recv_buffer_t *buffer, const uint8_t *expect, size_t size) {
+    buffer->size = 0;
+    session->peer_port = TFTP_DEFAULT_PORT;
+    session->local_port = 0;
+    if (tftp_client_get_sized(session, TEST_MMAP_FILENAME, size_cb, data_cb, buffer) != 0) {
+        return -1;
+    }
+    return (buffer->size == size && memcmp(buffer->data, expect, size) == 0) ? 0 : -1;
+}
+
+static int test_mmap(void) {
+    static tftp_server_t server;
+    static net_stack_t server_stack;
+    static uint8_t old_data[TEST_MMAP_SIZE];
+    static uint8_t new_data[TEST_MMAP_NEW_SIZE];
+    static const uint16_t block_sizes[] = {512, 8192};
+    net_loop_config_t loop_config = {
+        .latency_ms = 1,
+        .loss_ppm = 10000,
+        .seed = 3
+    };
+    net_loop_endpoint_t *client_ep = NULL;
+    net_loop_endpoint_t *server_ep = NULL;
+    net_link_ops_t client_link;
+    net_link_ops_t server_link;
+    recv_buffer_t buffer = {0};
+    recv_buffer_t overlap = {0};
+    char dir[] = "/tmp/tftp_mmap_XXXXXX";
+    char path[sizeof(dir) + sizeof(TEST_MMAP_FILENAME) + 1];
+    int result = -1;
+    
+    NET_LOGI("=== Starting TFTP mmap Provider Test ===");
+    
+    for (size_t i = 0; i < sizeof(old_data); i++) {
+        old_data[i] = (uint8_t)(i * 13 + (i >> 8));
+    }
+    for (size_t i = 0; i < sizeof(new_data); i++) {
+        new_data[i] = (uint8_t)(i * 5 + 1);
+    }
+    
+    if (!mkdtemp(dir)) {
+        NET_LOGE("Failed to create directory");
+        return -1;
+    }
+    snprintf(path, sizeof(path), "%s/%s", dir, TEST_MMAP_FILENAME);
+    FILE *f = fopen(path, "wb");
+    if (!f || fwrite(old_data, 1, sizeof(old_data), f) != sizeof(old_data)) {
+        NET_LOGE("Failed to create %s", path);
+        if (f) fclose(f);
+        goto out;
+    }
+    fclose(f);
+    
+    if (net_loop_pair_create(&loop_config, &client_ep, &server_ep) != 0) {
+        NET_LOGE("Failed to create loopback link");
+        goto out;
+    }
+    net_loop_link_ops(client_ep, &client_link);
+    net_loop_link_ops(server_ep, &server_link);
+    
+    if (net_stack_init(NULL, &client_config, &client_link) != 0 ||
+        net_stack_init(&server_stack, &server_config, &server_link) != 0) {
+        NET_LOGE("Network init failed");
+        goto out;
+    }
+    
+    tftp_server_init_provider(&server, &server_stack, &tftp_mmap_provider, dir);
+    loop_server_poll(&server);
+    net_stack_set_idle_hook(NULL, loop_server_poll, &server);
+    
+    tftp_session_t session = {
+        .peer_ip = server_config.ip_addr,
+    };
+    for (size_t i = 0; i < sizeof(block_sizes) / sizeof(block_sizes[0]); i++) {
+        tftp_init_default_options(&session.options);
+        session.options.block_size = block_sizes[i];
+        session.options.window_size = 4;
+        if (mmap_get(&session, &buffer, old_data, sizeof(old_data)) != 0) {
+            NET_LOGE("Download with %u byte blocks failed", block_sizes[i]);
+            goto out;
+        }
+    }
+    NET_LOGI("mmap downloads successful");
+    
+    // 下载进行到一半时上传同名文件
+    static tftp_client_xfer_t xfer;
+    tftp_session_t reader = {
+        .peer_ip = server_config.ip_addr,
+        .peer_port = TFTP_DEFAULT_PORT,
+    };
+    tftp_client_loop_t client_loop;
+    int completed = 0;
+    tftp_init_default_options(&reader.options);
+    tftp_client_loop_init(&client_loop, NULL);
+    if (tftp_client_start_get(&xfer, &reader, TEST_MMAP_FILENAME, size_cb, data_cb, &overlap) != 0 ||
+        tftp_client_loop_add(&client_loop, &xfer, loop_done_cb, &completed) != 0) {
+        NET_LOGE("Failed to start download");
+        goto out;
+    }
+    while (overlap.size < sizeof(old_data) / 4 && tftp_client_loop_poll(&client_loop, 100) > 0) {
+    }
+    
+    mmap_source_t source = { .data = new_data, .size = sizeof(new_data) };
+    tftp_init_default_options(&session.options);
+    session.peer_port = TFTP_DEFAULT_PORT;
+    session.local_port = 0;
+    if (tftp_client_put(&session, TEST_MMAP_FILENAME, mmap_source_cb, &source) != 0) {
+        NET_LOGE("Upload failed");
+        goto out;
+    }
+    
+    while (tftp_client_loop_poll(&client_loop, 100) > 0) {
+    }
+    if (completed != 1 || overlap.size != sizeof(old_data) ||
+        memcmp(overlap.data, old_data, sizeof(old_data)) != 0) {
+        NET_LOGE("Download overlapping an upload failed");
+        goto out;
+    }
+    
+    // 之后的下载读到上传的内容, 目录中只剩目标文件
+    tftp_init_default_options(&session.options);
+    if (mmap_get(&session, &buffer, new_data, sizeof(new_data)) != 0) {
+        NET_LOGE("Download of the uploaded file failed");
+        goto out;
+    }
+    DIR *d = opendir(dir);
+    int entries = 0;
+    for (struct dirent *e = d ? readdir(d) : NULL; e; e = readdir(d)) {
+        if (strcmp(e->d_name, ".") != 0 && strcmp(e->d_name, "..") != 0) {
+            entries++;
+        }
+    }
+    if (d) closedir(d);
+    if (entries != 1) {
+        NET_LOGE("Upload left %d files behind", entries);
+        goto out;
+    }
+    NET_LOGI("Upload during download successful");
+    result = 0;
+    
+out:
+    net_stack_set_idle_hook(NULL, NULL, NULL);
+    net_stack_set_link(NULL, NULL);
+    net_stack_set_link(&server_stack, NULL);
+    tftp_server_deinit(&server);
+    TEST_FREE(buffer.data);
+    TEST_FREE(overlap.data);
+    net_loop_destroy(client_ep);
+    net_loop_destroy(server_ep);
+    unlink(path);
+    rmdir(dir);
+    NET_LOGI("=== TFTP mmap Provider Test Complete ===");
+    return result;
+}
+#endif
+
+// 分片服务器测试: 服务器端点按tftp_server_shard_steer拆分为两个队列, 每个工作线程一个协议栈实例
+// 多次下载使用不同的客户端端口, 分配到不同的工作线程; 上传由0号工作线程处理
+// 工作线程共用块缓存, 重复下载同一文件只从文件表读取一次
+#define TEST_SHARD_WORKERS  2
+#define TEST_SHARD_ROUNDS   8
+#define TEST_SHARD_OVERLAP  4
+
+// 同时发起多个读请求, 分到不同工作线程的会话共用缓存中同一段
+static int test_shard_overlap(void) {
+    static tftp_client_xfer_t xfers[TEST_SHARD_OVERLAP];
+    tftp_session_t sessions[TEST_SHARD_OVERLAP];
+    recv_buffer_t buffers[TEST_SHARD_OVERLAP];
+    tftp_client_loop_t client_loop;
+    int completed = 0;
+    int result = 0;
+    
+    memset(buffers, 0, sizeof(buffers));
+    tftp_client_loop_init(&client_loop, NULL);
+    for (int i = 0; i < TEST_SHARD_OVERLAP; i++) {
+        memset(&sessions[i], 0, sizeof(sessions[i]));
+        sessions[i].peer_ip = server_config.ip_addr;
+        sessions[i].peer_port = TFTP_DEFAULT_PORT;
+        tftp_init_default_options(&sessions[i].options);
+        sessions[i].options.window_size = 4;
+        if (tftp_client_start_get(&xfers[i], &sessions[i], test_download_filename,
+                                  size_cb, data_cb, &buffers[i]) != 0 ||
+            tftp_client_loop_add(&client_loop, &xfers[i], loop_done_cb, &completed) != 0) {
+            NET_LOGE("Failed to start transfer %d", i);
+            result = -1;
+            break;
+        }
+    }
+    
+    while (tftp_client_loop_poll(&client_loop, 100) > 0) {
+    }
+    
+    for (int i = 0; i < TEST_SHARD_OVERLAP; i++) {
+        if (result == 0 &&
+            (buffers[i].size != strlen(test_download_file_content) ||
+             memcmp(buffers[i].data, test_download_file_content, buffers[i].size) != 0)) {
+            result = -1;
+        }
+        TEST_FREE(buffers[i].data);
+    }
+    if (completed != TEST_SHARD_OVERLAP) {
+        result = -1;
+    }
+    return result;
+}
+
+static int test_shard(void) {
+    static tftp_server_shard_t shard;
+    static tftp_cache_t cache;
+    static net_stack_t worker_stacks[TEST_SHARD_WORKERS];
+    net_stack_t *stacks[TEST_SHARD_WORKERS];
+    net_link_ops_t worker_links[TEST_SHARD_WORKERS];
+    net_loop_config_t loop_config = {
+        .latency_ms = 1,
+        .loss_ppm = 20000,
+        .seed = 2
+    };
+    net_loop_endpoint_t *client_ep = NULL;
+    net_loop_endpoint_t *server_ep = NULL;
+    net_link_ops_t client_link;
+    recv_buffer_t buffer = {0};
+    bool started = false;
+    int result = -1;
+    
+    NET_LOGI("=== Starting TFTP Sharded Server Test ===");
+    
+    if (net_loop_pair_create(&loop_config, &client_ep, &server_ep) != 0 ||
+        net_loop_split(server_ep, TEST_SHARD_WORKERS, tftp_server_shard_steer, &shard, worker_links) != 0) {
+        NET_LOGE("Failed to create loopback link");
+        goto out;
+    }
+    net_loop_link_ops(client_ep, &client_link);
+    
+    if (net_stack_init(NULL, &client_config, &client_link) != 0) {
+        NET_LOGE("Network init failed");
+        goto out;
+    }
+    for (int i = 0; i < TEST_SHARD_WORKERS; i++) {
+        stacks[i] = &worker_stacks[i];
+        if (net_stack_init(stacks[i], &server_config, &worker_links[i]) != 0) {
+            NET_LOGE("Network init failed");
+            goto out;
+        }
+    }
+    
+    create_test_file(test_download_filename, test_download_file_content);
+    tftp_cache_init(&cache, &mem_provider, NULL, 1024 * 1024);
+    if (tftp_server_shard_start(&shard, stacks, TEST_SHARD_WORKERS, &tftp_cache_provider, &cache) != 0) {
+        NET_LOGE("Failed to start workers");
+        goto out;
+    }
+    started = true;
+    
+    const char *content = test_upload_file_content;
+    if (tftp_put_file(test_upload_filename, server_config.ip_addr, "octet", (void *)&content) != 0 ||
+        verify_file_content(test_upload_filename, test_upload_file_content) != 0) {
+        NET_LOGE("File upload failed");
+        goto out;
+    }
+    
+    // 缓存为空时先并发下载, 后到的会话等待首个会话加载的段
+    if (test_shard_overlap() != 0) {
+        NET_LOGE("Overlapping downloads failed");
+        goto out;
+    }
+    NET_LOGI("%d overlapping downloads successful", TEST_SHARD_OVERLAP);
+    
+    for (int round = 0; round < TEST_SHARD_ROUNDS; round++) {
+        tftp_session_t session = {
+            .peer_ip = server_config.ip_addr,
+            .peer_port = TFTP_DEFAULT_PORT,
+        };
+        tftp_init_default_options(&session.options);
+        session.options.window_size = 4;
+        buffer.size = 0;
+        if (tftp_client_get_sized(&session, test_download_filename, size_cb, data_cb, &buffer) != 0 ||
+            buffer.size != strlen(test_download_file_content) ||
+            memcmp(buffer.data, test_download_file_content, buffer.size) != 0) {
+            NET_LOGE("File download %d failed", round);
+            goto out;
+        }
+    }
+    NET_LOGI("%d downloads successful", TEST_SHARD_ROUNDS);
+    
+    tftp_cache_stats_t cache_stats;
+    tftp_cache_get_stats(&cache, &cache_stats);
+    NET_LOGI("cache: %llu hits, %llu misses", (unsigned long long)cache_stats.hits,
+             (unsigned long long)cache_stats.misses);
+    if (cache_stats.misses != 1) {
+        NET_LOGE("Cached file read from the backend more than once");
+        goto out;
+    }
+    
+    // 各工作线程都应处理过传输
+    for (int i = 0; i < TEST_SHARD_WORKERS; i++) {
+        net_udp_stats_t stats;
+        udp_get_stats(stacks[i], &stats);
+        NET_LOGI("worker %d: tx %u rx %u", i, stats.tx_packets, stats.rx_packets);
+        if (stats.tx_packets == 0) {
+            NET_LOGE("Worker %d handled no transfers", i);
+            goto out;
+        }
+    }
+    result = 0;
+    
+out:
+    if (started) {
+        tftp_server_shard_stop(&shard);
+    }
+    tftp_cache_deinit(&cache);
+    net_stack_set_link(NULL, NULL);
+    for (int i = 0; i < TEST_SHARD_WORKERS; i++) {
+        net_stack_set_link(&worker_stacks[i], NULL);
+    }
+    TEST_FREE(buffer.data);
+    net_loop_destroy(client_ep);
+    net_loop_destroy(server_ep);
+    NET_LOGI("=== TFTP Sharded Server Test Complete ===");
+    return result;
+}
+
 int main(int argc, char *argv[]) {
+    int result = 0;
+    
     if (argc < 2) {
         NET_LOGI("Usage:");
         NET_LOGI("  %s client    - Run TFTP client test", argv[0]);
         NET_LOGI("  %s server    - Run TFTP server test", argv[0]);
+        NET_LOGI("  %s loop      - Run client and server over an in-process loopback link", argv[0]);
+        NET_LOGI("  %s shard     - Run a sharded multi-worker server over a loopback link", argv[0]);
+#ifdef __unix__
+        NET_LOGI("  %s mmap      - Serve files through the mmap provider over a loopback link", argv[0]);
+#endif
         return 1;
     }
     
@@ -244,6 +916,17 @@ int main(int argc, char *argv[]) {
     else if (strcmp(argv[1], "server") == 0) {
         test_server();
     }
+    else if (strcmp(argv[1], "loop") == 0) {
+        result = test_loop();
+    }
+    else if (strcmp(argv[1], "shard") == 0) {
+        result = test_shard();
+    }
+#ifdef __unix__
+    else if (strcmp(argv[1], "mmap") == 0) {
+        result = test_mmap();
+    }
+#endif
     else {
         NET_LOGE("Invalid argument");
         return 1;
@@ -254,5 +937,5 @@ int main(int argc, char *argv[]) {
         TEST_FREE(file_system[i].data);
     }
     
-    return 0;
+    return result == 0 ? 0 : 1;
 }
\ No newline at end of file
@@ -0,0 +1,553 @@
+#include "tftp.h"
+#include "tftpclient.h"
+#include "tftpserver.h"
+#include "net_wrapper.h"
+#include "net_loopback.h"
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+
+// TFTP吞吐/时延基准: 客户端和服务器在同一进程中通过内存回环链路传输,
+// 按文件大小、块大小、窗口、丢包率、并发传输数组合逐项运行, 每项输出一行JSON
+
+#define BENCH_PATTERN_PERIOD    251     // 数据模式周期(素数, 与块大小错开)
+#define BENCH_MAX_LIST          16
+// 一项中同时进行的最大传输数: 每个传输占用客户端和服务器各一个socket, 另有服务器的监听端口
+#define BENCH_MAX_SESSIONS      ((NET_SOCKET_MAX - 1) / 2)
+#define BENCH_FRAME_BLOCK_SIZE  (NET_MTU_MAX - NET_UDP_HEADROOM - 4)   // 一帧能容纳的最大块
+#define BENCH_MAX_BLOCK_SIZE    TFTP_BLOCK_SIZE_LIMIT                   // 更大的块按IP分片发送
+#define BENCH_UDP_OFFSET        (14 + 20)         // 帧中UDP头的位置
+#define BENCH_TFTP_OFFSET       NET_UDP_HEADROOM  // 帧中TFTP头的位置
+#define BENCH_IP_FRAG_OFFSET    (14 + 6)          // 帧中IP分片字段的位置
+#define BENCH_RTT_SAMPLES_MAX   (1 << 20)         // 每项最多保留的RTT样本数
+#define BENCH_DRAIN_MS          10                // 每项开始前等待链路排空的时间(另加单向时延)
+
+static net_config_t bench_config = {
+    .ip_addr = 0x0301A8C0,    // 192.168.1.3
+    .netmask = 0x00FFFFFF,    // 255.255.255.0
+    .gateway = 0x0101A8C0,    // 192.168.1.1
+    .mac_addr = {0xAA, 0xBB, 0xCC, 0xDD, 0xEE, 0xFF}
+};
+
+// 数据模式: 偏移o处的字节为o % BENCH_PATTERN_PERIOD, 收发双方不需要存储文件
+static uint8_t bench_pattern[BENCH_PATTERN_PERIOD + TFTP_MAX_BLOCK_SIZE];
+
+static inline const uint8_t *bench_pattern_at(uint64_t offset) {
+    return bench_pattern + offset % BENCH_PATTERN_PERIOD;
+}
+
+// 测量参数
+typedef struct {
+    uint64_t sizes[BENCH_MAX_LIST];
+    int size_count;
+    uint32_t block_sizes[BENCH_MAX_LIST];
+    int block_size_count;
+    uint32_t windows[BENCH_MAX_LIST];
+    int window_count;
+    uint32_t losses[BENCH_MAX_LIST];    // 百万分之一
+    int loss_count;
+    uint32_t sessions[BENCH_MAX_LIST];  // 同时进行的传输数
+    int session_count;
+    bool get;
+    bool put;
+    int repeat;
+    uint8_t rollover;
+    net_loop_config_t link;
+    FILE *out;
+} bench_args_t;
+
+// 一个传输的逐块记录, 同时进行的传输按客户端端口区分
+typedef struct {
+    uint16_t port;                  // 客户端本地端口
+    // 按16位块号记录, 块号回绕前清除半个块号空间之前的记录
+    uint64_t first_send_us[65536];  // 各块首次发送时间
+    uint8_t sends[65536];           // 各块发送次数
+    bool sampled[65536];
+} bench_flow_t;
+
+// 单项结果, 由链路钩子统计
+typedef struct {
+    bench_flow_t *flows;
+    int flow_count;                 // 已开始的传输数, 开始后才记录其帧
+    uint32_t *rtt_us;               // 块RTT样本(只统计未重传的块, Karn算法)
+    uint32_t rtt_count;
+    uint32_t data_frames;
+    uint32_t retransmits;
+    uint32_t frames;
+    uint64_t bytes;                 // 校验通过的数据量
+    uint32_t errors;                // 数据校验失败次数
+} bench_stats_t;
+
+static bench_stats_t g_stats;
+static tftp_client_xfer_t g_xfers[BENCH_MAX_SESSIONS];
+static tftp_session_t g_sessions[BENCH_MAX_SESSIONS];
+static net_loop_endpoint_t *g_loop;
+static net_stack_t g_stack;         // 客户端和服务器共用的协议栈实例
+static tftp_server_t g_server;
+
+static uint64_t bench_now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static uint64_t bench_cpu_us(void) {
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    return (uint64_t)(ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000 +
+           ru.ru_utime.tv_usec + ru.ru_stime.tv_usec;
+}
+
+// 帧中是否有TFTP头: 第一个分片或未分片的帧
+static inline bool bench_has_tftp_header(const uint8_t *frame, size_t len) {
+    return len >= BENCH_TFTP_OFFSET + 4 &&
+           (ntohs(*(const uint16_t *)(frame + BENCH_IP_FRAG_OFFSET)) & 0x1FFF) == 0;
+}
+
+// 帧所属的传输: 源端口或目的端口是某个传输的客户端端口
+static bench_flow_t *bench_flow(const uint8_t *frame) {
+    uint16_t src = ntohs(*(const uint16_t *)(frame + BENCH_UDP_OFFSET));
+    uint16_t dst = ntohs(*(const uint16_t *)(frame + BENCH_UDP_OFFSET + 2));
+    int count = __atomic_load_n(&g_stats.flow_count, __ATOMIC_ACQUIRE);
+    for (int i = 0; i < count; i++) {
+        if (g_stats.flows[i].port == src || g_stats.flows[i].port == dst) {
+            return &g_stats.flows[i];
+        }
+    }
+    return NULL;
+}
+
+// 链路钩子: 发送DATA时记录首次发送时间和重传, 收到ACK时计算块RTT
+static int bench_link_send(void *ctx, const uint8_t *frame, size_t len) {
+    g_stats.frames++;
+    bench_flow_t *f;
+    if (bench_has_tftp_header(frame, len) && (f = bench_flow(frame)) != NULL) {
+        uint16_t opcode = ntohs(*(const uint16_t *)(frame + BENCH_TFTP_OFFSET));
+        uint16_t block = ntohs(*(const uint16_t *)(frame + BENCH_TFTP_OFFSET + 2));
+        if (opcode == TFTP_DATA) {
+            uint16_t old = block + 32768;
+            f->sends[old] = 0;
+            f->sampled[old] = false;
+            g_stats.data_frames++;
+            if (f->sends[block]++ == 0) {
+                f->first_send_us[block] = bench_now_us();
+            } else {
+                g_stats.retransmits++;
+            }
+        }
+    }
+    return net_loop_send(ctx, frame, len);
+}
+
+static int bench_link_receive(void *ctx, uint8_t *buf, size_t size) {
+    int len = net_loop_receive(ctx, buf, size);
+    bench_flow_t *f;
+    if (len > 0 && bench_has_tftp_header(buf, len) && (f = bench_flow(buf)) != NULL) {
+        uint16_t opcode = ntohs(*(const uint16_t *)(buf + BENCH_TFTP_OFFSET));
+        uint16_t block = ntohs(*(const uint16_t *)(buf + BENCH_TFTP_OFFSET + 2));
+        if (opcode == TFTP_ACK && f->sends[block] == 1 && !f->sampled[block] &&
+            g_stats.rtt_count < BENCH_RTT_SAMPLES_MAX) {
+            f->sampled[block] = true;
+            g_stats.rtt_us[g_stats.rtt_count++] =
+                (uint32_t)(bench_now_us() - f->first_send_us[block]);
+        }
+    }
+    return len;
+}
+
+// 服务器文件提供者: 文件名为"bench/<字节数>", 数据按模式生成, 写入时校验
+typedef struct {
+    uint64_t size;
+} bench_file_t;
+
+static int bench_open(void *user_data, const char *filename, bool write, void **handle) {
+    if (strncmp(filename, "bench/", 6) != 0) {
+        return -1;
+    }
+    bench_file_t *f = malloc(sizeof(bench_file_t));
+    if (!f) {
+        return -1;
+    }
+    f->size = strtoull(filename + 6, NULL, 10);
+    *handle = f;
+    return 0;
+}
+
+static int bench_map(void *user_data, void *handle, uint64_t offset,
+                     const uint8_t **data, size_t max_size) {
+    bench_file_t *f = (bench_file_t *)handle;
+    uint64_t remain = offset < f->size ? f->size - offset : 0;
+    *data = bench_pattern_at(offset);
+    return (int)(remain < max_size ? remain : max_size);
+}
+
+static int bench_read(void *user_data, void *handle, uint64_t offset,
+                      uint8_t *buffer, size_t max_size) {
+    const uint8_t *data;
+    int len = bench_map(user_data, handle, offset, &data, max_size);
+    memcpy(buffer, data, len);
+    return len;
+}
+
+static int bench_write(void *user_data, void *handle, uint64_t offset,
+                       const uint8_t *data, size_t size) {
+    if (memcmp(data, bench_pattern_at(offset), size) != 0) {
+        g_stats.errors++;
+    } else {
+        g_stats.bytes += size;
+    }
+    return (int)size;
+}
+
+static int bench_size(void *user_data, void *handle, uint64_t *size) {
+    *size = ((bench_file_t *)handle)->size;
+    return 0;
+}
+
+static void bench_close(void *user_data, void *handle) {
+    free(handle);
+}
+
+static const tftp_server_provider_t bench_provider = {
+    .open = bench_open,
+    .read = bench_read,
+    .write = bench_write,
+    .close = bench_close,
+    .map = bench_map,
+    .size = bench_size
+};
+
+// 客户端数据源/数据接收
+typedef struct {
+    uint64_t offset;
+    uint64_t size;
+} bench_stream_t;
+
+static int bench_get_data(void *user_data, uint8_t *buffer, size_t max_size) {
+    bench_stream_t *s = (bench_stream_t *)user_data;
+    uint64_t remain = s->size - s->offset;
+    size_t len = remain < max_size ? (size_t)remain : max_size;
+    memcpy(buffer, bench_pattern_at(s->offset), len);
+    s->offset += len;
+    return (int)len;
+}
+
+static int bench_data(void *user_data, const uint8_t *data, size_t size) {
+    bench_stream_t *s = (bench_stream_t *)user_data;
+    if (memcmp(data, bench_pattern_at(s->offset), size) != 0) {
+        g_stats.errors++;
+    } else {
+        g_stats.bytes += size;
+    }
+    s->offset += size;
+    return 0;
+}
+
+static void bench_server_poll(void *arg) {
+    tftp_server_poll(&g_server, 0);
+}
+
+// 传输结束时计数成功的传输
+static void bench_done(tftp_client_xfer_t *xfer, int result, void *user_data) {
+    if (result == 0) {
+        (*(uint32_t *)user_data)++;
+    }
+}
+
+static int bench_cmp_u32(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static uint32_t bench_percentile(uint32_t *samples, uint32_t count, uint32_t pct) {
+    if (count == 0) {
+        return 0;
+    }
+    return samples[(uint64_t)(count - 1) * pct / 100];
+}
+
+// 等待上一项留在链路中的帧到达并被处理, 不计入下一项
+static void bench_drain(uint32_t ms) {
+    uint32_t start = net_get_time_ms();
+    while (net_get_time_ms() - start < ms) {
+        tftp_server_poll(&g_server, 1);
+    }
+}
+
+// 运行一项测量并输出结果, 返回是否成功
+static bool bench_run(const bench_args_t *args, bool get, uint64_t size,
+                      uint32_t block_size, uint32_t window, uint32_t loss_ppm, uint32_t sessions) {
+    FILE *out = args->out;
+    bench_flow_t *flows = g_stats.flows;
+    uint32_t *rtt = g_stats.rtt_us;
+
+    // 链路在整个运行期间不替换(异步模式下接收任务一直在使用), 每项只修改参数并重新开始丢包序列
+    net_loop_config_t link = args->link;
+    link.loss_ppm = loss_ppm;
+    net_loop_set_config(g_loop, &link);
+    bench_drain(args->link.latency_ms + BENCH_DRAIN_MS);
+
+    memset(&g_stats, 0, sizeof(g_stats));
+    memset(flows, 0, sessions * sizeof(bench_flow_t));
+    g_stats.flows = flows;
+    g_stats.rtt_us = rtt;
+
+    fprintf(out, "{\"op\":\"%s\",\"size\":%llu,\"blksize\":%u,\"window\":%u,"
+            "\"loss_ppm\":%u,\"latency_ms\":%u,\"bandwidth_kbps\":%u,\"sessions\":%u,",
+            get ? "get" : "put", (unsigned long long)size, block_size, window,
+            loss_ppm, args->link.latency_ms, args->link.bandwidth_kbps, sessions);
+
+    char filename[64];
+    snprintf(filename, sizeof(filename), "bench/%llu", (unsigned long long)size);
+
+    // 所有传输在一个事件循环中同时进行, 每个传输的数据分别校验
+    bench_stream_t streams[BENCH_MAX_SESSIONS];
+    tftp_client_loop_t loop;
+    uint32_t completed = 0;
+    tftp_client_loop_init(&loop, &g_stack);
+
+    tftp_reset_stats();
+    udp_reset_stats(&g_stack);
+    uint64_t cpu_start = bench_cpu_us();
+    uint64_t start = bench_now_us();
+    for (uint32_t i = 0; i < sessions; i++) {
+        tftp_session_t *session = &g_sessions[i];
+        memset(session, 0, sizeof(*session));
+        session->stack = &g_stack;
+        session->peer_ip = bench_config.ip_addr;
+        session->peer_port = TFTP_DEFAULT_PORT;
+        tftp_init_default_options(&session->options);
+        session->options.block_size = block_size;
+        session->options.window_size = window;
+        session->options.rollover = args->rollover;
+
+        streams[i].offset = 0;
+        streams[i].size = size;
+        int ret;
+        if (get) {
+            ret = tftp_client_start_get(&g_xfers[i], session, filename, NULL, bench_data, &streams[i]);
+        } else {
+            ret = tftp_client_start_put(&g_xfers[i], session, filename, bench_get_data, &streams[i]);
+        }
+        if (ret != 0 || tftp_client_loop_add(&loop, &g_xfers[i], bench_done, &completed) != 0) {
+            break;
+        }
+        // 请求已发出, 首个DATA要等本线程运行服务器或处理应答时才发送, 在端口登记之后
+        flows[i].port = session->local_port;
+        __atomic_store_n(&g_stats.flow_count, (int)i + 1, __ATOMIC_RELEASE);
+    }
+    while (tftp_client_loop_poll(&loop, 100) > 0) {
+        bench_server_poll(NULL);
+    }
+    uint64_t elapsed = bench_now_us() - start;
+    uint64_t cpu = bench_cpu_us() - cpu_start;
+
+    // 结束服务器上的会话, 下一项重新开始
+    tftp_server_deinit(&g_server);
+    tftp_server_init_provider(&g_server, &g_stack, &bench_provider, NULL);
+    bench_server_poll(NULL);
+
+    uint64_t total = size * sessions;
+    bool ok = completed == sessions && g_stats.errors == 0 && g_stats.bytes == total;
+    double seconds = elapsed / 1e6;
+    double mb = total / 1e6;
+
+    qsort(g_stats.rtt_us, g_stats.rtt_count, sizeof(uint32_t), bench_cmp_u32);
+
+    tftp_stats_t tftp_stats;
+    net_udp_stats_t udp_stats;
+    tftp_get_stats(&tftp_stats);
+    udp_get_stats(&g_stack, &udp_stats);
+
+    fprintf(out, "\"ok\":%s,\"seconds\":%.6f,\"mb_per_s\":%.3f,\"packets_per_s\":%.0f,"
+            "\"frames\":%u,\"data_frames\":%u,\"retransmits\":%u,"
+            "\"timeouts\":%u,\"out_of_order\":%u,\"dup_acks\":%u,\"rx_queue_full\":%u,"
+            "\"rtt_samples\":%u,\"rtt_p50_us\":%u,\"rtt_p99_us\":%u,\"cpu_ms_per_mb\":%.3f}\n",
+            ok ? "true" : "false", seconds, seconds > 0 ? mb / seconds : 0,
+            seconds > 0 ? g_stats.frames / seconds : 0,
+            g_stats.frames, g_stats.data_frames, g_stats.retransmits,
+            tftp_stats.timeouts, tftp_stats.out_of_order, tftp_stats.dup_acks, udp_stats.rx_queue_full,
+            g_stats.rtt_count,
+            bench_percentile(g_stats.rtt_us, g_stats.rtt_count, 50),
+            bench_percentile(g_stats.rtt_us, g_stats.rtt_count, 99),
+            mb > 0 ? cpu / 1000.0 / mb : 0);
+    fflush(out);
+    return ok;
+}
+
+// 解析逗号分隔的列表, 数值可带K/M/G后缀(1024进制)
+static int bench_parse_list(const char *arg, uint64_t *values, int max) {
+    int count = 0;
+    const char *p = arg;
+
+    while (*p && count < max) {
+        char *end;
+        uint64_t v = strtoull(p, &end, 10);
+        switch (*end) {
+        case 'k': case 'K': v <<= 10; end++; break;
+        case 'm': case 'M': v <<= 20; end++; break;
+        case 'g': case 'G': v <<= 30; end++; break;
+        default: break;
+        }
+        if (end == p || (*end != ',' && *end != '\0')) {
+            return -1;
+        }
+        values[count++] = v;
+        p = *end ? end + 1 : end;
+    }
+    return count;
+}
+
+static int bench_parse_list32(const char *arg, uint32_t *values, int max) {
+    uint64_t tmp[BENCH_MAX_LIST];
+    int count = bench_parse_list(arg, tmp, max < BENCH_MAX_LIST ? max : BENCH_MAX_LIST);
+    for (int i = 0; i < count; i++) {
+        values[i] = (uint32_t)tmp[i];
+    }
+    return count;
+}
+
+static void bench_usage(const char *prog) {
+    fprintf(stderr,
+            "Usage: %s [options]\n"
+            "  -s sizes      file sizes, e.g. 1K,1M,64M (default 1K,64K,1M,16M)\n"
+            "  -b blksizes   block sizes (default 512,%d, max %d)\n"
+            "  -w windows    window sizes (default 1,8)\n"
+            "  -l losses     loss rates in ppm (default 0,1000,10000)\n"
+            "  -c sessions   concurrent transfers per case, max %d (default 1)\n"
+            "  -L ms         one-way latency (default 0)\n"
+            "  -B kbps       link bandwidth, 0 = unlimited (default 0)\n"
+            "  -d ops        get, put or get,put (default get,put)\n"
+            "  -r n          repeat each case n times (default 1)\n"
+            "  -S seed       loss/reorder seed (default 1)\n"
+            "  -R n          request block number rollover to n, 0 or 1 (default 0)\n"
+            "  -o file       write JSON lines to file instead of stdout\n",
+            prog, BENCH_FRAME_BLOCK_SIZE, BENCH_MAX_BLOCK_SIZE, BENCH_MAX_SESSIONS);
+}
+
+int main(int argc, char *argv[]) {
+    bench_args_t args = {
+        .sizes = {1 << 10, 64 << 10, 1 << 20, 16 << 20},
+        .size_count = 4,
+        .block_sizes = {512, BENCH_FRAME_BLOCK_SIZE},
+        .block_size_count = 2,
+        .windows = {1, 8},
+        .window_count = 2,
+        .losses = {0, 1000, 10000},
+        .loss_count = 3,
+        .sessions = {1},
+        .session_count = 1,
+        .get = true,
+        .put = true,
+        .repeat = 1,
+        .link = { .seed = 1 },
+        .out = stdout
+    };
+    int opt;
+
+    while ((opt = getopt(argc, argv, "s:b:w:l:c:L:B:d:r:S:R:o:h")) != -1) {
+        switch (opt) {
+        case 's': args.size_count = bench_parse_list(optarg, args.sizes, BENCH_MAX_LIST); break;
+        case 'b': args.block_size_count = bench_parse_list32(optarg, args.block_sizes, BENCH_MAX_LIST); break;
+        case 'w': args.window_count = bench_parse_list32(optarg, args.windows, BENCH_MAX_LIST); break;
+        case 'l': args.loss_count = bench_parse_list32(optarg, args.losses, BENCH_MAX_LIST); break;
+        case 'c': args.session_count = bench_parse_list32(optarg, args.sessions, BENCH_MAX_LIST); break;
+        case 'L': args.link.latency_ms = atoi(optarg); break;
+        case 'B': args.link.bandwidth_kbps = atoi(optarg); break;
+        case 'd':
+            args.get = strstr(optarg, "get") != NULL;
+            args.put = strstr(optarg, "put") != NULL;
+            break;
+        case 'r': args.repeat = atoi(optarg); break;
+        case 'S': args.link.seed = atoi(optarg); break;
+        case 'R': args.rollover = atoi(optarg) ? 1 : 0; break;
+        case 'o':
+            args.out = fopen(optarg, "w");
+            if (!args.out) {
+                perror(optarg);
+                return 1;
+            }
+            break;
+        default:
+            bench_usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (args.size_count <= 0 || args.block_size_count <= 0 ||
+        args.window_count <= 0 || args.loss_count <= 0 || args.session_count <= 0) {
+        bench_usage(argv[0]);
+        return 1;
+    }
+    for (int i = 0; i < args.block_size_count; i++) {
+        if (args.block_sizes[i] < TFTP_MIN_BLOCK_SIZE || args.block_sizes[i] > BENCH_MAX_BLOCK_SIZE) {
+            fprintf(stderr, "block size %u out of range\n", args.block_sizes[i]);
+            return 1;
+        }
+    }
+    uint32_t max_sessions = 0;
+    for (int i = 0; i < args.session_count; i++) {
+        if (args.sessions[i] < 1 || args.sessions[i] > BENCH_MAX_SESSIONS) {
+            fprintf(stderr, "session count %u out of range\n", args.sessions[i]);
+            return 1;
+        }
+        if (args.sessions[i] > max_sessions) {
+            max_sessions = args.sessions[i];
+        }
+    }
+
+    for (size_t i = 0; i < sizeof(bench_pattern); i++) {
+        bench_pattern[i] = i % BENCH_PATTERN_PERIOD;
+    }
+    g_stats.rtt_us = malloc(BENCH_RTT_SAMPLES_MAX * sizeof(uint32_t));
+    g_stats.flows = malloc(max_sessions * sizeof(bench_flow_t));
+    if (!g_stats.rtt_us || !g_stats.flows) {
+        return 1;
+    }
+
+    // 所有测量共用一个自环链路, 参数在每项开始时设置
+    g_loop = net_loop_create(&args.link);
+    if (!g_loop) {
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+    net_link_ops_t ops = { .send = bench_link_send, .receive = bench_link_receive, .ctx = g_loop };
+    if (net_stack_init(&g_stack, &bench_config, &ops) != 0) {
+        fprintf(stderr, "network init failed\n");
+        return 1;
+    }
+
+    tftp_server_init_provider(&g_server, &g_stack, &bench_provider, NULL);
+    bench_server_poll(NULL); // 先绑定监听端口, 再发起请求
+    net_stack_set_idle_hook(&g_stack, bench_server_poll, NULL);
+
+    int failures = 0;
+    for (int op = 0; op < 2; op++) {
+        bool get = (op == 0);
+        if ((get && !args.get) || (!get && !args.put)) {
+            continue;
+        }
+        for (int s = 0; s < args.size_count; s++)
+        for (int b = 0; b < args.block_size_count; b++)
+        for (int w = 0; w < args.window_count; w++)
+        for (int l = 0; l < args.loss_count; l++)
+        for (int c = 0; c < args.session_count; c++)
+        for (int r = 0; r < args.repeat; r++) {
+            if (!bench_run(&args, get, args.sizes[s], args.block_sizes[b],
+                           args.windows[w], args.losses[l], args.sessions[c])) {
+                failures++;
+            }
+        }
+    }
+
+    tftp_server_deinit(&g_server);
+    free(g_stats.rtt_us);
+    free(g_stats.flows);
+    if (args.out != stdout) {
+        fclose(args.out);
+    }
+    return failures ? 1 : 0;
+}